@@ -0,0 +1,310 @@
+/*
+ * bench - chunk dispatch and unfilter microbenchmarks
+ *
+ * Builds an IDAT-heavy PNG in memory and measures, per chunk, the old
+ * strcmp chain against the tag hash, then a whole parse without any
+ * callback. The library is included whole to reach its static parts.
+ * Then every filter engine undoes each filter type on RGB and RGBA rows,
+ * a stream with full flushes is inflated with 1 to 8 threads, and every
+ * UTF-8 engine checks ASCII and Japanese text, as XMP in iTXt can be.
+ *
+ * usage: ./bench [number of IDAT chunks]
+ */
+
+#include "chunkinfo.c"
+
+#include <time.h>
+
+typedef void (*decode_fn)(struct ci_ctx *, const uint8_t *, const uint32_t);
+
+#define chain_if(what, fn)			\
+	do {					\
+		if (!strcmp(type, what))	\
+			return fn;		\
+	} while (0)
+
+/* decode_chunk_data() as it was before the tag hash */
+static decode_fn chain_lookup(const char *type)
+{
+	chain_if("IHDR", decode_ihdr);
+	chain_if("PLTE", decode_plte);
+	chain_if("IDAT", decode_idat);
+	chain_if("tIME", decode_time);
+	chain_if("pHYs", decode_phys);
+	chain_if("sRGB", decode_srgb);
+	chain_if("gAMA", decode_gama);
+	chain_if("cHRM", decode_chrm);
+	chain_if("iCCP", decode_iccp);
+	chain_if("tEXt", decode_text);
+	chain_if("iTXt", decode_itxt);
+	chain_if("zTXt", decode_ztxt);
+	chain_if("bKGD", decode_bkgd);
+	chain_if("sBIT", decode_sbit);
+	chain_if("tRNS", decode_trns);
+	chain_if("sPLT", decode_splt);
+	chain_if("hIST", decode_hist);
+	chain_if("oFFs", decode_ext_offs);
+	chain_if("sCAL", decode_ext_scal);
+	chain_if("pCAL", decode_ext_pcal);
+	chain_if("gIFx", decode_ext_gifx);
+	chain_if("gIFg", decode_ext_gifg);
+	chain_if("sTER", decode_ext_ster);
+	chain_if("acTL", decode_apng_actl);
+	chain_if("fcTL", decode_apng_fctl);
+	return NULL;
+}
+
+static decode_fn hash_lookup(uint32_t tag)
+{
+	const struct decoder *d = &decoders[PH(tag)];
+
+	return d->tag == tag ? d->fn : NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *put_chunk(uint8_t *p, const char *type,
+			  const void *data, uint32_t len)
+{
+	uint32_t crc;
+
+	p[0] = len >> 24; p[1] = len >> 16; p[2] = len >> 8; p[3] = len;
+	memcpy(p + 4, type, 4);
+	if (len > 0)
+		memcpy(p + 8, data, len);
+
+	crc = pd_crc32(0, p + 4, len + 4);
+	p += 8 + len;
+	p[0] = crc >> 24; p[1] = crc >> 16; p[2] = crc >> 8; p[3] = crc;
+	return p + 4;
+}
+
+/* unfilter 64 MB of 4096 pixel wide rows */
+static void bench_filter(void)
+{
+	static const char *type[FILTER_TYPES] = {
+		"None", "Sub", "Up", "Average", "Paeth"
+	};
+	static uint8_t rows[2][4096 * 4];
+	unsigned t, bpp, e;
+	size_t n, i, len;
+	double t0;
+
+	for (i = 0; i < sizeof(rows[0]); i++)
+		rows[0][i] = rows[1][i] = i * 7;
+
+	for (bpp = 3; bpp <= 4; bpp++) {
+		len = 4096 * bpp;
+		n = (64 << 20) / len;
+
+		for (e = 0; e < FILTER_ENGINES; e++) {
+			if (!filter_engine_ok(e))
+				continue;
+
+			printf("unfilter %-6s %u bytes/pixel:", filter_engine_name(e),
+			       bpp);
+			for (t = FILTER_SUB; t < FILTER_TYPES; t++) {
+				t0 = now();
+				for (i = 0; i < n; i++)
+					unfilter_with(e, t, rows[i & 1],
+						      rows[~i & 1], len, bpp);
+				printf(" %s %.0f", type[t],
+				       n * len / (now() - t0) / 1e6);
+			}
+			printf(" MB/s\n");
+		}
+	}
+}
+
+/* check 64 MB of text a MB at a time */
+static void bench_utf8(void)
+{
+	static const char *text[] = {
+		"<rdf:Description rdf:about=\"\"/>\n",
+		"\xe8\x91\x97\xe4\xbd\x9c\xe6\xa8\xa9 PNG \xe5\xbd\xa2\xe5\xbc\x8f"
+	};
+	static const char *name[] = { "ascii", "japanese" };
+	uint8_t *buf;
+	size_t t, i, k, len, cut;
+	unsigned e;
+	double t0;
+
+	buf = malloc(1 << 20);
+	if (!buf)
+		return;
+
+	for (t = 0; t < 2; t++) {
+		len = strlen(text[t]);
+		for (i = 0; i + len <= 1 << 20; i += len)
+			memcpy(buf + i, text[t], len);
+		len = i;
+
+		printf("utf8 %-9s", name[t]);
+		for (e = 0; e < UTF8_ENGINES; e++) {
+			if (!utf8_engine_ok(e))
+				continue;
+
+			t0 = now();
+			for (k = 0; k < 64; k++)
+				if (utf8_valid_with(e, buf, len, &cut) != len)
+					printf(" (invalid)");
+			printf(" %s %.0f", utf8_engine_name(e),
+			       64 * len / (now() - t0) / 1e6);
+		}
+		printf(" MB/s\n");
+	}
+
+	free(buf);
+}
+
+/* 16 MB gray image deflated with a full flush every 256 rows */
+static void bench_inflate(void)
+{
+	enum { W = 4096, H = 4096 };
+	uint8_t ihdr[13] = { 0 }, *raw, *z, *png, *p;
+	struct ci_ctx *ctx;
+	z_stream zs;
+	unsigned threads;
+	size_t i, x, y;
+	double t0;
+	int err;
+
+	raw = malloc((size_t)H * (W + 1));
+	z = malloc(compressBound(H * (W + 1)));
+	png = malloc(compressBound(H * (W + 1)) * 2);
+	if (!raw || !z || !png)
+		return;
+
+	for (y = 0; y < H; y++) {
+		raw[y * (W + 1)] = 0;
+		for (x = 0; x < W; x++)
+			raw[y * (W + 1) + 1 + x] = (x * y) >> 5 ^ x;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	deflateInit(&zs, 6);
+	zs.next_out = z;
+	zs.avail_out = compressBound(H * (W + 1));
+	for (y = 0; y < H; y++) {
+		zs.next_in = raw + y * (W + 1);
+		zs.avail_in = W + 1;
+		deflate(&zs, y + 1 == H ? Z_FINISH :
+			(y + 1) % 256 ? Z_NO_FLUSH : Z_FULL_FLUSH);
+	}
+	deflateEnd(&zs);
+
+	ihdr[2] = W >> 8, ihdr[6] = H >> 8, ihdr[8] = 8;
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, sizeof(ihdr));
+	for (i = 0; i < zs.total_out; i += 65536)
+		p = put_chunk(p, "IDAT", z + i, zs.total_out - i < 65536 ?
+			      zs.total_out - i : 65536);
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	for (threads = 1; threads <= 8; threads *= 2) {
+		ctx = ci_new(NULL, NULL);
+		ci_set_threads(ctx, threads);
+		t0 = now();
+		err = ci_open_mem(ctx, png, p - png);
+		while (err == CI_OK)
+			err = ci_next(ctx, NULL);
+		printf("inflate, full flushes, %u threads: %6.0f MB/s%s\n",
+		       threads, (double)H * (W + 1) / (now() - t0) / 1e6,
+		       err == CI_END ? "" : " (failed)");
+		ci_free(ctx);
+	}
+
+	free(png);
+	free(z);
+	free(raw);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *mix[] = {
+		"IDAT", "IDAT", "IDAT", "IDAT", "IDAT", "IDAT", "fdAT", "fcTL",
+		"IDAT", "IDAT", "IDAT", "IDAT", "IDAT", "IDAT", "prIv", "tEXt"
+	};
+	uint8_t ihdr[13] = { 0, 0, 0, 63, 0, 0, 0, 0, 8, 0 }, *raw, *z, *png, *p;
+	struct ci_ctx *ctx;
+	uint32_t tags[16];
+	size_t nidat, i, n, rounds, hits;
+	double t0, chain, hash, parse;
+	uLongf zlen;
+	int err;
+
+	nidat = argc > 1 ? strtoul(argv[1], NULL, 10) : 8000;
+	if (nidat == 0)
+		nidat = 1;
+
+	crc32_init();
+
+	/* dispatch only, over a mix like an APNG */
+	for (i = 0; i < 16; i++)
+		tags[i] = be32((const uint8_t *)mix[i]);
+
+	rounds = 1 << 24;
+	hits = 0;
+
+	t0 = now();
+	for (i = 0; i < rounds; i++)
+		hits += chain_lookup(mix[i & 15]) != NULL;
+	chain = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < rounds; i++)
+		hits += hash_lookup(tags[i & 15]) != NULL;
+	hash = now() - t0;
+
+	/*
+	 * whole parse of IHDR, about nidat IDAT and IEND: 64 byte rows
+	 * stored, not deflated, and cut in 64 byte chunks
+	 */
+	ihdr[4] = nidat >> 24, ihdr[5] = nidat >> 16;
+	ihdr[6] = nidat >> 8, ihdr[7] = nidat;
+
+	zlen = compressBound(nidat * 64);
+	raw = calloc(nidat, 64);
+	z = malloc(zlen);
+	png = malloc(8 + 25 + zlen / 64 * 76 + 76 + 12);
+	if (!raw || !z || !png ||
+	    compress2(z, &zlen, raw, nidat * 64, 0) != Z_OK)
+		return 1;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, sizeof(ihdr));
+	for (i = 0; i < zlen; i += 64)
+		p = put_chunk(p, "IDAT", z + i, zlen - i < 64 ? zlen - i : 64);
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	ctx = ci_new(NULL, NULL);
+	t0 = now();
+	err = ci_open_mem(ctx, png, p - png);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	parse = now() - t0;
+	n = ci_chunk_count(ctx);
+	if (err != CI_END)
+		printf("parse failed: %s\n", ci_errmsg(ctx));
+	ci_free(ctx);
+	free(png);
+	free(z);
+	free(raw);
+
+	printf("dispatch, strcmp chain: %6.2f ns/chunk\n", chain * 1e9 / rounds);
+	printf("dispatch, tag hash:     %6.2f ns/chunk\n", hash * 1e9 / rounds);
+	printf("parse, %zu chunks:   %6.2f ns/chunk (crc %s, %zu hits)\n",
+	       n, parse * 1e9 / n, crc32_engine_name(crc32_engine_used()),
+	       hits);
+
+	bench_filter();
+	bench_utf8();
+	bench_inflate();
+	return 0;
+}
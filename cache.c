@@ -0,0 +1,687 @@
+/*
+ * cache - what was found in files that have not changed since
+ *
+ * The index is mapped read-only and looked up by the workers without a
+ * lock, only the entries made in this run and the ones used are kept
+ * under one. They are all written to a new index at the end, renamed
+ * over the old one, so a run that is stopped leaves the old index as it
+ * was. Two runs on the same index keep the entries of the last one.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_VERSION	1
+#define CACHE_ORDER	0x01020304u
+#define DAY		(24 * 60 * 60)
+
+struct entry {
+	uint64_t dev, ino, size;
+	int64_t mtime, ctime;
+	uint64_t options;
+	uint64_t data;
+	uint32_t path_len, ev_len;
+	int64_t used;
+	uint8_t zero[8];
+};
+
+_Static_assert(sizeof(struct entry) == CACHE_ENTRY, "cache entry size");
+
+/* an entry of this run, or of the index, and where its data is */
+struct slot {
+	struct entry e;
+	const uint8_t *data;
+	int fresh;  /* made in this run */
+	int used;   /* or used in it */
+};
+
+struct cache {
+	char *path;
+	uint64_t options;
+	int prune_days;
+	int64_t now;
+
+	uint8_t *map;
+	size_t map_len;
+	const struct entry *old;  /* in the map */
+	size_t nold;
+
+	pthread_mutex_t lock;
+	uint8_t *used;            /* old entries used in this run */
+	int stale;                /* one of them was not used for a day */
+	struct slot *fresh;       /* data on the heap */
+	size_t nfresh, cap;
+};
+
+static int64_t ns(const struct timespec *t)
+{
+	return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+/* the file of e is still st */
+static int same_file(const struct entry *e, const struct stat *st)
+{
+	return e->dev == (uint64_t)st->st_dev && e->ino == (uint64_t)st->st_ino &&
+	       e->size == (uint64_t)st->st_size &&
+	       e->mtime == ns(&st->st_mtim) && e->ctime == ns(&st->st_ctim);
+}
+
+static int cmp_slot(const void *a, const void *b)
+{
+	const struct slot *x = a, *y = b;
+
+	if (x->e.dev != y->e.dev)
+		return x->e.dev < y->e.dev ? -1 : 1;
+	if (x->e.ino != y->e.ino)
+		return x->e.ino < y->e.ino ? -1 : 1;
+
+	/* the one of this run first, it replaces the other */
+	return y->fresh - x->fresh;
+}
+
+struct cache *cache_open(const char *path, uint64_t options, int prune_days,
+			 char *err, size_t errlen)
+{
+	const uint8_t *h;
+	struct cache *c;
+	struct stat st;
+	uint32_t v;
+	int fd;
+
+	c = calloc(1, sizeof(*c));
+	if (!c || !(c->path = strdup(path))) {
+		free(c);
+		snprintf(err, errlen, "out of memory");
+		return NULL;
+	}
+
+	c->options = options;
+	c->prune_days = prune_days;
+	c->now = time(NULL);
+	pthread_mutex_init(&c->lock, NULL);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 && errno != ENOENT) {
+		snprintf(err, errlen, "%s: %s", path, strerror(errno));
+		goto fail;
+	}
+
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		c->map_len = st.st_size;
+		c->map = mmap(NULL, c->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (c->map == MAP_FAILED) {
+			c->map = NULL;
+			snprintf(err, errlen, "%s: %s", path, strerror(errno));
+			close(fd);
+			goto fail;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (c->map) {
+		h = c->map;
+		if (c->map_len < CACHE_HEADER || memcmp(h, "CHUNKIDX", 8))
+			goto not_index;
+
+		memcpy(&v, h + 8, 4);
+		if (v != CACHE_VERSION)
+			goto not_index;
+		memcpy(&v, h + 12, 4);
+		if (v != CACHE_ORDER)
+			goto not_index;
+		memcpy(&v, h + 24, 4);
+		if (v != CACHE_ENTRY)
+			goto not_index;
+
+		memcpy(&c->nold, h + 16, 8);
+		if (c->nold > (c->map_len - CACHE_HEADER) / CACHE_ENTRY)
+			goto not_index;
+		c->old = (const struct entry *)(h + CACHE_HEADER);
+	}
+
+	c->used = calloc(c->nold + 1, 1);
+	if (!c->used) {
+		snprintf(err, errlen, "out of memory");
+		goto fail;
+	}
+
+	return c;
+
+not_index:
+	snprintf(err, errlen, "%s: not a chunkinfo index", path);
+fail:
+	if (c->map)
+		munmap(c->map, c->map_len);
+	pthread_mutex_destroy(&c->lock);
+	free(c->path);
+	free(c);
+	return NULL;
+}
+
+int cache_lookup(struct cache *c, const struct stat *st, const uint8_t **ev,
+		 size_t *len)
+{
+	const struct entry *e;
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = c->nold;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &c->old[mid];
+		if (e->dev < (uint64_t)st->st_dev ||
+		    (e->dev == (uint64_t)st->st_dev &&
+		     e->ino < (uint64_t)st->st_ino))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == c->nold)
+		return 0;
+
+	e = &c->old[lo];
+	if (!same_file(e, st) || e->options != c->options)
+		return 0;
+
+	/* the index is as trusted as the files, but not past its end */
+	if (e->path_len == 0 || e->data > c->map_len ||
+	    c->map_len - e->data < (uint64_t)e->path_len + e->ev_len)
+		return 0;
+
+	*ev = c->map + e->data + e->path_len;
+	*len = e->ev_len;
+
+	pthread_mutex_lock(&c->lock);
+	c->used[lo] = 1;
+	if (c->now - e->used >= DAY)
+		c->stale = 1;
+	pthread_mutex_unlock(&c->lock);
+
+	return 1;
+}
+
+void cache_store(struct cache *c, const char *path, const struct stat *st,
+		 const uint8_t *ev, size_t len)
+{
+	struct slot *s, *tmp;
+	char *full;
+	uint8_t *data;
+	size_t plen;
+
+	if (len > UINT32_MAX)
+		return;
+
+	/* the entries are pruned from anywhere */
+	full = realpath(path, NULL);
+	plen = strlen(full ? full : path) + 1;
+	data = malloc(plen + len);
+	if (!data) {
+		free(full);
+		return;
+	}
+	memcpy(data, full ? full : path, plen);
+	memcpy(data + plen, ev, len);
+	free(full);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->nfresh == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 256;
+		tmp = realloc(c->fresh, c->cap * sizeof(*tmp));
+		if (!tmp) {
+			pthread_mutex_unlock(&c->lock);
+			free(data);
+			return;
+		}
+		c->fresh = tmp;
+	}
+
+	s = &c->fresh[c->nfresh++];
+	memset(s, 0, sizeof(*s));
+	s->e.dev = st->st_dev;
+	s->e.ino = st->st_ino;
+	s->e.size = st->st_size;
+	s->e.mtime = ns(&st->st_mtim);
+	s->e.ctime = ns(&st->st_ctim);
+	s->e.options = c->options;
+	s->e.path_len = plen;
+	s->e.ev_len = len;
+	s->e.used = c->now;
+	s->data = data;
+	s->fresh = 1;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* an entry of the index not used in this run, still worth keeping */
+static int keep_old(struct cache *c, const struct slot *s)
+{
+	struct stat st;
+
+	if (c->prune_days < 0)
+		return 1;
+	if (c->prune_days > 0 && c->now - s->e.used >= (int64_t)c->prune_days * DAY)
+		return 0;
+
+	/* its path, and the end of it, were checked when it was listed */
+	return stat((const char *)s->data, &st) == 0 && same_file(&s->e, &st);
+}
+
+static int write_index(struct cache *c, struct slot *s, size_t n,
+		       char *err, size_t errlen)
+{
+	uint8_t h[CACHE_HEADER] = "CHUNKIDX";
+	uint32_t v;
+	uint64_t data;
+	char *tmp;
+	size_t i;
+	FILE *f;
+
+	i = strlen(c->path) + 32;
+	tmp = malloc(i);
+	if (!tmp) {
+		snprintf(err, errlen, "out of memory");
+		return -1;
+	}
+	snprintf(tmp, i, "%s.%ld.tmp", c->path, (long)getpid());
+
+	f = fopen(tmp, "wb");
+	if (!f) {
+		snprintf(err, errlen, "%s: %s", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+	v = CACHE_VERSION;
+	memcpy(h + 8, &v, 4);
+	v = CACHE_ORDER;
+	memcpy(h + 12, &v, 4);
+	data = n;
+	memcpy(h + 16, &data, 8);
+	v = CACHE_ENTRY;
+	memcpy(h + 24, &v, 4);
+	fwrite(h, 1, sizeof(h), f);
+
+	data = CACHE_HEADER + (uint64_t)n * CACHE_ENTRY;
+	for (i = 0; i < n; i++) {
+		s[i].e.data = data;
+		data += s[i].e.path_len + s[i].e.ev_len;
+		fwrite(&s[i].e, 1, CACHE_ENTRY, f);
+	}
+	for (i = 0; i < n; i++)
+		fwrite(s[i].data, 1, s[i].e.path_len + s[i].e.ev_len, f);
+
+	if (ferror(f) | fclose(f) || rename(tmp, c->path)) {
+		snprintf(err, errlen, "%s: %s", c->path, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+	return 0;
+}
+
+int cache_close(struct cache *c, size_t *kept, size_t *dropped, char *err,
+		size_t errlen)
+{
+	struct slot *s;
+	size_t i, n, k;
+	int ret = 0;
+
+	*kept = c->nold;
+	*dropped = 0;
+
+	if (c->nfresh > 0 || c->stale || c->prune_days >= 0) {
+		s = malloc((c->nold + c->nfresh + 1) * sizeof(*s));
+		if (!s) {
+			snprintf(err, errlen, "out of memory");
+			ret = -1;
+			goto out;
+		}
+
+		n = 0;
+		for (i = 0; i < c->nfresh; i++)
+			s[n++] = c->fresh[i];
+		for (i = 0; i < c->nold; i++) {
+			const struct entry *e = &c->old[i];
+
+			/* not past the end of the index, as in lookup */
+			if (e->path_len == 0 || e->data > c->map_len ||
+			    c->map_len - e->data < (uint64_t)e->path_len + e->ev_len ||
+			    c->map[e->data + e->path_len - 1] != 0)
+				continue;
+
+			s[n].e = *e;
+			s[n].data = c->map + e->data;
+			s[n].fresh = 0;
+			s[n].used = c->used[i];
+			if (s[n].used)
+				s[n].e.used = c->now;
+			n++;
+		}
+
+		qsort(s, n, sizeof(*s), cmp_slot);
+
+		for (i = k = 0; i < n; i++) {
+			if (k > 0 && s[k - 1].e.dev == s[i].e.dev &&
+			    s[k - 1].e.ino == s[i].e.ino)
+				continue;
+			if (!s[i].fresh && !s[i].used && !keep_old(c, &s[i])) {
+				(*dropped)++;
+				continue;
+			}
+			s[k++] = s[i];
+		}
+
+		*kept = k;
+		ret = write_index(c, s, k, err, errlen);
+		free(s);
+	}
+
+out:
+	if (c->map)
+		munmap(c->map, c->map_len);
+	for (i = 0; i < c->nfresh; i++)
+		free((void *)c->fresh[i].data);
+	pthread_mutex_destroy(&c->lock);
+	free(c->fresh);
+	free(c->used);
+	free(c->path);
+	free(c);
+
+	return ret;
+}
+
+/*
+ * callbacks, one byte of what then the values, in the byte order of
+ * the index. strings are their length, with the nul, then the string.
+ */
+enum {
+	EV_CHUNK = 'c',
+	EV_FIELD = 'f',
+	EV_IHDR = 'i',
+	EV_ACTL = 'a',
+	EV_FCTL = 'l',
+	EV_DAMAGE = 'd',
+	EV_NEXT = 'n',
+	EV_END = 'e'
+};
+
+static void put(struct recording *r, const void *p, size_t n)
+{
+	size_t cap;
+	uint8_t *tmp;
+
+	if (r->cap - r->len < n) {
+		cap = r->cap ? r->cap : 4096;
+		while (cap - r->len < n)
+			cap *= 2;
+
+		tmp = realloc(r->buf, cap);
+		if (!tmp) {
+			fputs("out of memory\n", stderr);
+			exit(1);
+		}
+		r->buf = tmp;
+		r->cap = cap;
+	}
+
+	memcpy(r->buf + r->len, p, n);
+	r->len += n;
+}
+
+static void put_u8(struct recording *r, uint8_t v)
+{
+	put(r, &v, 1);
+}
+
+static void put_str(struct recording *r, const char *s, size_t n)
+{
+	uint32_t len = n + 1;
+
+	put(r, &len, 4);
+	put(r, s, n);
+	put_u8(r, 0);
+}
+
+void record_chunk(void *user, const struct ci_chunk *c)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_CHUNK);
+	put(r, &c->tag, 4);
+	put(r, &c->length, 4);
+	put(r, &c->crc, 4);
+	put(r, &c->offset, 8);
+	put(r, &c->index, 4);
+
+	report_chunk(r->rep, c);
+}
+
+void record_field(void *user, const struct ci_field *f)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_FIELD);
+	put_u8(r, f->kind);
+	put(r, &f->index, 4);
+	put_u8(r, f->key != NULL);
+	if (f->key)
+		put_str(r, f->key, strlen(f->key));
+	put_str(r, f->value, f->value_len);
+
+	report_field(r->rep, f);
+}
+
+void record_ihdr(void *user, const struct ci_ihdr *ihdr)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_IHDR);
+	put(r, ihdr, sizeof(*ihdr));
+
+	report_ihdr(r->rep, ihdr);
+}
+
+void record_actl(void *user, const struct ci_actl *actl)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_ACTL);
+	put(r, actl, sizeof(*actl));
+
+	report_actl(r->rep, actl);
+}
+
+void record_fctl(void *user, const struct ci_fctl *fctl)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_FCTL);
+	put(r, fctl, sizeof(*fctl));
+
+	report_fctl(r->rep, fctl);
+}
+
+void record_damage(void *user, const struct ci_damage *d)
+{
+	struct recording *r = user;
+
+	put_u8(r, EV_DAMAGE);
+	put(r, &d->error, sizeof(d->error));
+	put(r, &d->offset, 8);
+	put(r, &d->length, 8);
+	put_str(r, d->msg, strlen(d->msg));
+
+	report_damage(r->rep, d);
+}
+
+void record_next(struct recording *r)
+{
+	put_u8(r, EV_NEXT);
+
+	report_next(r->rep);
+}
+
+void record_end(struct recording *r, int err, uint32_t chunks,
+		const char *errmsg)
+{
+	put_u8(r, EV_END);
+	put(r, &err, sizeof(err));
+	put(r, &chunks, 4);
+	put_str(r, errmsg ? errmsg : "", errmsg ? strlen(errmsg) : 0);
+}
+
+/* recorded callbacks, bad once any read went past the end */
+struct reader {
+	const uint8_t *p, *end;
+	int bad;
+};
+
+static void get(struct reader *rd, void *v, size_t n)
+{
+	if (rd->bad || (size_t)(rd->end - rd->p) < n) {
+		rd->bad = 1;
+		memset(v, 0, n);
+		return;
+	}
+
+	memcpy(v, rd->p, n);
+	rd->p += n;
+}
+
+static const char *get_str(struct reader *rd, size_t *n)
+{
+	const char *s;
+	uint32_t len;
+
+	get(rd, &len, 4);
+	if (rd->bad || len == 0 || (size_t)(rd->end - rd->p) < len ||
+	    rd->p[len - 1] != 0) {
+		rd->bad = 1;
+		*n = 0;
+		return "";
+	}
+
+	s = (const char *)rd->p;
+	rd->p += len;
+	*n = len - 1;
+	return s;
+}
+
+int replay(const uint8_t *ev, size_t len, struct report *rep, int *err,
+	   uint32_t *chunks, char *errmsg, size_t errlen)
+{
+	struct reader rd;
+	struct ci_chunk c;
+	struct ci_field f;
+	struct ci_ihdr ihdr;
+	struct ci_actl actl;
+	struct ci_fctl fctl;
+	struct ci_damage d;
+	const char *msg;
+	uint8_t what, kind, has_key;
+	size_t n;
+	int pass, end;
+
+	/* checked whole first, so that a bad entry gives nothing */
+	for (pass = 0; pass < 2; pass++) {
+		rd.p = ev;
+		rd.end = ev + len;
+		rd.bad = 0;
+
+		for (end = 0; !end && !rd.bad && rd.p < rd.end;) {
+			get(&rd, &what, 1);
+
+			switch (what) {
+			case EV_CHUNK:
+				memset(&c, 0, sizeof(c));
+				get(&rd, &c.tag, 4);
+				get(&rd, &c.length, 4);
+				get(&rd, &c.crc, 4);
+				get(&rd, &c.offset, 8);
+				get(&rd, &c.index, 4);
+				c.type[0] = c.tag >> 24;
+				c.type[1] = c.tag >> 16;
+				c.type[2] = c.tag >> 8;
+				c.type[3] = c.tag;
+				if (pass)
+					report_chunk(rep, &c);
+				break;
+			case EV_FIELD:
+				memset(&f, 0, sizeof(f));
+				get(&rd, &kind, 1);
+				get(&rd, &f.index, 4);
+				get(&rd, &has_key, 1);
+				f.kind = kind;
+				f.key = has_key ? get_str(&rd, &n) : NULL;
+				f.value = get_str(&rd, &f.value_len);
+				if (kind > CI_FIELD_ENTRY)
+					rd.bad = 1;
+				else if (pass)
+					report_field(rep, &f);
+				break;
+			case EV_IHDR:
+				get(&rd, &ihdr, sizeof(ihdr));
+				if (pass)
+					report_ihdr(rep, &ihdr);
+				break;
+			case EV_ACTL:
+				get(&rd, &actl, sizeof(actl));
+				if (pass)
+					report_actl(rep, &actl);
+				break;
+			case EV_FCTL:
+				get(&rd, &fctl, sizeof(fctl));
+				if (pass)
+					report_fctl(rep, &fctl);
+				break;
+			case EV_DAMAGE:
+				get(&rd, &d.error, sizeof(d.error));
+				get(&rd, &d.offset, 8);
+				get(&rd, &d.length, 8);
+				d.msg = get_str(&rd, &n);
+				if (pass)
+					report_damage(rep, &d);
+				break;
+			case EV_NEXT:
+				if (pass)
+					report_next(rep);
+				break;
+			case EV_END:
+				get(&rd, err, sizeof(*err));
+				get(&rd, chunks, 4);
+				msg = get_str(&rd, &n);
+				if (pass)
+					snprintf(errmsg, errlen, "%s", msg);
+				end = 1;
+				break;
+			default:
+				rd.bad = 1;
+				break;
+			}
+		}
+
+		if (rd.bad || !end || rd.p != rd.end)
+			return -1;
+	}
+
+	return 0;
+}
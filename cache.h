@@ -0,0 +1,111 @@
+/*
+ * cache - what was found in files that have not changed since
+ */
+
+#ifndef CHUNKINFO_CACHE_H
+#define CHUNKINFO_CACHE_H
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunkinfo.h"
+#include "output.h"
+
+/*
+ * One index file, mapped as it is and rewritten whole when it changed,
+ * in the byte order of the machine that wrote it. A file is found by
+ * its device and inode and is only answered from the index if its
+ * size, mtime and ctime are still the same and it was checked with the
+ * same options. What is kept are the library callbacks of the file, in
+ * order: the report is made again from them, for its path and its place
+ * in the input, in any format.
+ *
+ * header, 32 bytes
+ *    0  char[8]  "CHUNKIDX"
+ *    8  uint32   version, 1
+ *   12  uint32   0x01020304, in the byte order of the file
+ *   16  uint64   entries
+ *   24  uint32   entry size, 80
+ *   28           zero
+ *
+ * entry, 80 bytes, sorted by device then inode
+ *    0  uint64   device
+ *    8  uint64   inode
+ *   16  uint64   size
+ *   24  int64    mtime, in ns
+ *   32  int64    ctime, in ns
+ *   40  uint64   options, see cache_open()
+ *   48  uint64   offset of the data in the index: the path, nul
+ *                terminated, then the callbacks
+ *   56  uint32   path length, the nul included
+ *   60  uint32   callbacks length
+ *   64  int64    time it was last used, in s
+ *   72           zero
+ */
+#define CACHE_HEADER	32
+#define CACHE_ENTRY	80
+
+struct cache;
+
+/*
+ * NULL if the index can't be made. one that does not exist yet is
+ * empty, one that is not an index is an error. options is a hash of
+ * what changes the callbacks of a file, an entry of other options is
+ * checked again. prune_days > 0 drops, when it is closed, the entries
+ * not used for that many days, and prune_days >= 0 those of files that
+ * are gone or changed.
+ */
+struct cache *cache_open(const char *path, uint64_t options, int prune_days,
+			 char *err, size_t errlen);
+
+/* the callbacks of the file of st, 0 if it is not in the index */
+int cache_lookup(struct cache *c, const struct stat *st, const uint8_t **ev,
+		 size_t *len);
+
+/* keep the callbacks of path, its st from before it was read */
+void cache_store(struct cache *c, const char *path, const struct stat *st,
+		 const uint8_t *ev, size_t len);
+
+/*
+ * write the index if it changed, and free c: 0, or -1 and why in err.
+ * the entries kept and dropped are counted in kept and dropped.
+ */
+int cache_close(struct cache *c, size_t *kept, size_t *dropped, char *err,
+		size_t errlen);
+
+/*
+ * callbacks of a file as they come, handed on to the report. user of
+ * the record_* callbacks is the recording.
+ */
+struct recording {
+	struct report *rep;
+	uint8_t *buf;
+	size_t len, cap;
+};
+
+void record_chunk(void *user, const struct ci_chunk *c);
+void record_field(void *user, const struct ci_field *f);
+void record_ihdr(void *user, const struct ci_ihdr *ihdr);
+void record_actl(void *user, const struct ci_actl *actl);
+void record_fctl(void *user, const struct ci_fctl *fctl);
+void record_damage(void *user, const struct ci_damage *d);
+void record_next(struct recording *r);
+
+/*
+ * the end of the file, only kept for replay(): errmsg is from
+ * ci_errmsg(), NULL if err is CI_END
+ */
+void record_end(struct recording *r, int err, uint32_t chunks,
+		const char *errmsg);
+
+/*
+ * give the recorded callbacks to rep, up to the end of the file: -1 if
+ * they are not what record_* made, before anything is given. what ended
+ * the file is in err and chunks, ci_errmsg() in errmsg.
+ */
+int replay(const uint8_t *ev, size_t len, struct report *rep, int *err,
+	   uint32_t *chunks, char *errmsg, size_t errlen);
+
+#endif
@@ -0,0 +1,3572 @@
+/*
+ * libchunkinfo - decode and check PNG chunks
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "chunkinfo.h"
+#include "crc32.h"
+#include "idat.h"
+#include "utf8.h"
+
+#define TAG(a, b, c, d) \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+#define TAG_IHDR	TAG('I', 'H', 'D', 'R')
+#define TAG_PLTE	TAG('P', 'L', 'T', 'E')
+#define TAG_IDAT	TAG('I', 'D', 'A', 'T')
+#define TAG_IEND	TAG('I', 'E', 'N', 'D')
+#define TAG_FCTL	TAG('f', 'c', 'T', 'L')
+#define TAG_FDAT	TAG('f', 'd', 'A', 'T')
+#define valid_keyword(c) ((c >= 0x20 && c <= 0x7e))
+
+/*
+ * chunk reader
+ *
+ * regular files are mapped into memory and every chunk is handed out as
+ * a pointer into the mapping. a regular file that is not mapped is read
+ * through a fixed window with pread() from its own offset, which is left
+ * alone, and seeked over by moving that offset. anything else (pipes,
+ * sockets, ...) is read in order through the window and never seeks.
+ * offsets are 64-bit and counted as the bytes go by. memory given by
+ * the caller is read the same way as a mapping.
+ *
+ * a chunk bigger than the window is only kept whole if its decoder
+ * needs it, image data and unknown chunks go through the window.
+ *
+ * with more than one thread, a pipe is read ahead by a thread of its own
+ * into AHEAD_BUFS windows, handed to the reader as they fill and back to
+ * the thread once copied out, so that the next chunks come in while one
+ * is checked. a file read with pread() is left to the readahead of the
+ * kernel, told that it is read in order and where a skip lands.
+ */
+#define READ_WINDOW	65536
+#define AHEAD_BUFS	4
+#define MAX_KEEP	(16 << 20)  /* biggest chunk kept whole if not mapped */
+#define MAX_LENGTH	0x7fffffffu  /* of a chunk, 2^31 - 1 */
+
+struct reader {
+	int fd;              /* -1 if not reading a file descriptor */
+	const uint8_t *map;  /* NULL if not mapped */
+	size_t map_len;
+	int unmap;  /* map is ours */
+	off_t at;            /* pread() from here, -1 to read() */
+	uint64_t pos;        /* offset of the next byte */
+	uint8_t *buf;        /* the window */
+	size_t start, end;   /* bytes read but not handed out yet */
+	int eof;
+	size_t got;          /* bytes there were, after a short read */
+	uint8_t *big;        /* a chunk bigger than the window */
+	size_t big_cap;
+	struct ahead *ahead;  /* NULL if read() here */
+};
+
+/* the read ahead thread of a pipe and its windows */
+struct ahead {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	uint8_t *buf;              /* AHEAD_BUFS windows */
+	size_t len[AHEAD_BUFS];
+	unsigned head, tail;       /* full ones, head is being copied out */
+	size_t off;                /* of it, copied out already */
+	size_t fill;               /* of the tail one, being read into */
+	int eof, err;              /* after all of them: errno if err */
+	int stop;
+};
+
+/* a chunk checked a window at a time, see windowed() */
+struct part {
+	struct ci_chunk c;
+	uint32_t left;   /* data bytes still to come */
+	uint32_t check;  /* CRC so far */
+	int crc;         /* check it */
+	int skip;        /* see skipped() */
+	int image, fed, ret;
+	uint8_t nhdr;
+	uint8_t seq[4];  /* fdAT */
+};
+
+/* where the stream is for the chunk order, see check_type() */
+enum order_state {
+	ORD_HEAD,  /* after IHDR */
+	ORD_PLTE,  /* after PLTE */
+	ORD_IDAT,  /* in the IDAT chunks */
+	ORD_TAIL   /* after them */
+};
+
+struct order {
+	enum order_state state;
+	uint64_t seen;        /* a bit per slot of rules[] */
+	char post_plte[5];    /* the first chunk that wants PLTE before it */
+	int frame;            /* fcTL since IDAT, for fdAT */
+	uint32_t fctl;        /* fcTL chunks */
+	uint32_t frames;      /* of acTL, if has_frames */
+	int has_frames;
+	uint32_t sequence;    /* next fcTL or fdAT sequence number */
+};
+
+/*
+ * every chunk checked, one array per field so that a query over one of
+ * them reads nothing else: 21 bytes a chunk, grown by doubling
+ */
+struct chunk_table {
+	uint32_t *tag;
+	uint64_t *offset;
+	uint32_t *length;
+	uint32_t *crc;
+	uint8_t *flags;
+	uint32_t n, cap;
+};
+
+/*
+ * scratch memory for the chunk being decoded: blocks kept for the whole
+ * file, handed out in order and all reused from the next chunk on
+ */
+#define ARENA_BLOCK	65536
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used, size;
+	uint8_t data[];
+};
+
+struct custom {
+	uint32_t tag;
+	ci_decoder fn;
+	void *arg;
+};
+
+enum ci_mode {
+	MODE_NONE,
+	MODE_PULL,
+	MODE_PUSH
+};
+
+/*
+ * per-stream parse state
+ *
+ * die() and fail() record the error and jump back to the public entry
+ * point, which returns the error code.
+ */
+struct ci_ctx {
+	struct ci_callbacks cb;
+	void *user;
+	struct custom *custom;  /* ci_register() */
+	size_t ncustom;
+	enum ci_mode mode;
+	int fd;  /* ci_open_file(), -1 if none */
+	struct reader r;
+
+	/* push mode: bytes not parsed yet */
+	uint8_t *pend;
+	size_t pend_len, pend_cap;
+	uint64_t pend_off;  /* file offset of pend[0] */
+	int sig_ok;
+
+	struct chunk_table table;  /* its n is the chunks checked */
+	int done;
+	uint8_t plt[256][3];
+	uint8_t bit_depth, color_type;
+	uint32_t plt_entry, bit_depth_max;
+	uint32_t width, height;
+	uint8_t pixel_bits, interlace;
+	uint32_t frame_width, frame_height;  /* last fcTL */
+	struct order ord;
+	enum ci_verify verify;
+	unsigned threads;  /* per image */
+	enum ci_stop stop;
+	int recover;       /* ci_set_recover() */
+	int checked;       /* the chunk being read was already CRC'd */
+	int damaged;       /* image data is then only CRC'd */
+	uint32_t ndamage;
+	int damage_err;    /* of the first one */
+	int resync;        /* the next chunk comes after damage */
+	struct part part;  /* windowed chunk */
+	int in_part;       /* push: in the middle of part */
+	uint8_t head[33];  /* CI_STOP_IHDR: signature, IHDR and its CRC */
+	struct idat img;  /* IDAT or fdAT stream being inflated */
+	uint64_t inflate_max;    /* ci_set_inflate_limits() */
+	unsigned inflate_ratio;
+	z_stream meta_z;  /* zTXt, iTXt and iCCP, see inflate_meta() */
+	int meta_z_ready;
+	struct arena_block *arena, *arena_at;
+	char fmt[512];  /* field values */
+
+	int error;
+	char err[256];
+	jmp_buf fail;
+};
+
+/* private util functions */
+static uint32_t reader_u32(struct reader *);
+static uint32_t keyword_len(const uint8_t *, uint32_t, uint32_t *);
+static void table_add(struct ci_ctx *, struct ci_chunk *, uint8_t);
+static void *arena_alloc(struct ci_ctx *, size_t);
+static void arena_reset(struct ci_ctx *);
+static size_t copy_printable(char *, const uint8_t *, size_t);
+static size_t copy_utf8(char *, const uint8_t *, size_t);
+static void fail(struct ci_ctx *, int, const char *, ...)
+	__attribute__((noreturn, format(printf, 3, 4)));
+static size_t format_value(struct ci_ctx *, const char *, va_list);
+static void send_field(struct ci_ctx *, enum ci_field_kind, const char *,
+		       uint32_t, const char *, size_t);
+static void field(struct ci_ctx *, const char *, const char *, ...)
+	__attribute__((format(printf, 3, 4)));
+static void field_text(struct ci_ctx *, const char *, const char *, size_t);
+static void note(struct ci_ctx *, const char *, ...)
+	__attribute__((format(printf, 2, 3)));
+static void entry(struct ci_ctx *, uint32_t, const char *, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* invalid chunk content */
+#define die(ctx, ...)	fail(ctx, CI_ERR_CHUNK, __VA_ARGS__)
+
+/* typed callback, if the user wants it */
+#define emit(ctx, what, ...)					\
+	do {							\
+		if ((ctx)->cb.what)				\
+			(ctx)->cb.what((ctx)->user, __VA_ARGS__);	\
+	} while (0)
+
+enum COLOR_TYPE {
+	GRAY = CI_GRAY,
+	RGB = CI_RGB,
+	INDEXED = CI_INDEXED,
+	GRAY_ALPHA = CI_GRAY_ALPHA,
+	RGB_ALPHA = CI_RGB_ALPHA
+};
+
+static const char *cstr[] = {
+	[GRAY] = "Grayscale",
+	NULL,
+	[RGB] = "RGB",
+	[INDEXED] = "Indexed-color",
+	[GRAY_ALPHA] = "Grayscale with Alpha channel",
+	NULL,
+	[RGB_ALPHA] = "RGB with Alpha channel"
+};
+
+static uint32_t be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void *ahead_main(void *arg)
+{
+	struct ahead *a = arg;
+	uint8_t *dst;
+	ssize_t got;
+	int old;
+
+	/* only a read() that blocks can be cancelled, not a wait */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+
+	pthread_mutex_lock(&a->lock);
+	while (!a->eof && !a->err) {
+		while (a->tail - a->head == AHEAD_BUFS && !a->stop)
+			pthread_cond_wait(&a->cond, &a->lock);
+		if (a->stop)
+			break;
+
+		dst = a->buf + (size_t)(a->tail % AHEAD_BUFS) * READ_WINDOW;
+		pthread_mutex_unlock(&a->lock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+		do
+			got = read(a->fd, dst + a->fill, READ_WINDOW - a->fill);
+		while (got < 0 && errno == EINTR);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+
+		pthread_mutex_lock(&a->lock);
+		if (got < 0)
+			a->err = errno;
+		else if (got == 0)
+			a->eof = 1;
+		else
+			a->fill += got;
+
+		/* full, the next one is read into */
+		if (a->fill == READ_WINDOW) {
+			a->len[a->tail++ % AHEAD_BUFS] = READ_WINDOW;
+			a->fill = 0;
+		}
+		pthread_cond_signal(&a->cond);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+/* NULL if fd can't be read ahead, it is then read() as it is */
+static struct ahead *ahead_start(int fd)
+{
+	struct ahead *a;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->fd = fd;
+	a->buf = malloc((size_t)AHEAD_BUFS * READ_WINDOW);
+	if (!a->buf)
+		goto fail;
+
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+	if (pthread_create(&a->tid, NULL, ahead_main, a) == 0)
+		return a;
+
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+fail:
+	free(a->buf);
+	free(a);
+	return NULL;
+}
+
+static void ahead_stop(struct ahead *a)
+{
+	pthread_mutex_lock(&a->lock);
+	a->stop = 1;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	/* it may be waiting for a writer that never comes */
+	pthread_cancel(a->tid);
+	pthread_join(a->tid, NULL);
+
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+	free(a->buf);
+	free(a);
+}
+
+/*
+ * like read(): what was read ahead, waiting for it if there is none. a
+ * pipe gives a little at a time, the window being read into is copied
+ * out as far as it is filled, the thread only goes on after that
+ */
+static ssize_t ahead_read(struct ahead *a, uint8_t *dst, size_t cap)
+{
+	size_t n, k, i, len;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->head == a->tail && a->fill == a->off && !a->eof && !a->err)
+		pthread_cond_wait(&a->cond, &a->lock);
+
+	for (n = 0; n < cap;) {
+		i = a->head % AHEAD_BUFS;
+		len = a->head != a->tail ? a->len[i] : a->fill;
+		k = len - a->off < cap - n ? len - a->off : cap - n;
+		memcpy(dst + n, a->buf + i * READ_WINDOW + a->off, k);
+		a->off += k;
+		n += k;
+
+		if (a->head == a->tail)
+			break;
+		if (a->off == len) {
+			/* back to the thread */
+			a->head++;
+			a->off = 0;
+			pthread_cond_signal(&a->cond);
+		}
+	}
+
+	if (n == 0 && a->err) {
+		errno = a->err;
+		pthread_mutex_unlock(&a->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return n;
+}
+
+/*
+ * map a regular file if map_it, or read it through the window, ahead on
+ * a thread if ahead and it is a pipe (a FIFO, not a tty or socket)
+ */
+static int reader_open(struct reader *r, int fd, int map_it, int ahead)
+{
+	struct stat st;
+	void *map;
+	int fifo = 0;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->at = -1;
+
+	if (fstat(fd, &st) == 0) {
+		if (S_ISREG(st.st_mode))
+			r->at = lseek(fd, 0, SEEK_CUR);
+		fifo = S_ISFIFO(st.st_mode);
+	}
+
+	if (map_it && r->at == 0 && st.st_size > 0 &&
+	    (uintmax_t)st.st_size <= SIZE_MAX) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+			r->map = map;
+			r->map_len = st.st_size;
+			r->unmap = 1;
+			return 1;
+		}
+	}
+
+	if (r->at >= 0)
+		posix_fadvise(fd, r->at, 0, POSIX_FADV_SEQUENTIAL);
+	else if (ahead && fifo)
+		r->ahead = ahead_start(fd);
+
+	r->buf = malloc(READ_WINDOW);
+	return r->buf != NULL;
+}
+
+static void reader_open_mem(struct reader *r, const void *buf, size_t len)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->at = -1;
+	r->map = buf;
+	r->map_len = len;
+}
+
+static void reader_close(struct reader *r)
+{
+	if (r->map && r->unmap)
+		munmap((void *)r->map, r->map_len);
+	if (r->ahead)
+		ahead_stop(r->ahead);
+
+	free(r->buf);
+	free(r->big);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->at = -1;
+}
+
+/* read into dst until it has n bytes, errno is EIO at the end */
+static size_t reader_fill(struct reader *r, uint8_t *dst, size_t have,
+			  size_t n, size_t cap)
+{
+	ssize_t got;
+
+	while (have < n && !r->eof) {
+		if (r->at >= 0)
+			got = pread(r->fd, dst + have, cap - have, r->at);
+		else if (r->ahead)
+			got = ahead_read(r->ahead, dst + have, cap - have);
+		else
+			got = read(r->fd, dst + have, cap - have);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return have;
+		if (got == 0)
+			r->eof = 1;
+		if (r->at >= 0)
+			r->at += got;
+		have += got;
+	}
+
+	if (have < n)
+		errno = EIO;
+	return have;
+}
+
+/* return a pointer to the next n bytes, valid until the next call */
+static const uint8_t *reader_get(struct reader *r, size_t n)
+{
+	const uint8_t *p;
+	size_t have;
+
+	if (r->map) {
+		if (n > r->map_len - r->pos) {
+			r->got = r->map_len - r->pos;
+			r->pos = r->map_len;
+			errno = EIO;
+			return NULL;
+		}
+
+		p = r->map + r->pos;
+		r->pos += n;
+		return p;
+	}
+
+	have = r->end - r->start;
+	if (n > READ_WINDOW) {
+		/* what is in the window, then the rest straight from the fd */
+		if (n > r->big_cap) {
+			uint8_t *tmp = realloc(r->big, n);
+			if (!tmp)
+				return NULL;
+
+			r->big = tmp;
+			r->big_cap = n;
+		}
+
+		memcpy(r->big, r->buf + r->start, have);
+		r->start = r->end = 0;
+		r->got = reader_fill(r, r->big, have, n, n);
+		if (r->got < n)
+			return NULL;
+
+		r->pos += n;
+		return r->big;
+	}
+
+	if (have < n) {
+		memmove(r->buf, r->buf + r->start, have);
+		r->start = 0;
+		r->end = reader_fill(r, r->buf, have, n, READ_WINDOW);
+		if (r->end < n) {
+			r->got = r->end;
+			return NULL;
+		}
+	}
+
+	p = r->buf + r->start;
+	r->start += n;
+	r->pos += n;
+	return p;
+}
+
+static int reader_read(struct reader *r, void *dst, size_t n)
+{
+	const uint8_t *p = reader_get(r, n);
+
+	if (!p)
+		return 0;
+
+	memcpy(dst, p, n);
+	return 1;
+}
+
+/* skip n bytes, seeking over them in a file, which must hold them all */
+static int reader_skip(struct reader *r, size_t n)
+{
+	struct stat st;
+	size_t k;
+
+	if (r->map) {
+		if (n > r->map_len - r->pos) {
+			r->pos = r->map_len;
+			errno = EIO;
+			return 0;
+		}
+
+		r->pos += n;
+		return 1;
+	}
+
+	k = r->end - r->start < n ? r->end - r->start : n;
+	r->start += k;
+	r->pos += k;
+	n -= k;
+	if (n == 0)
+		return 1;
+
+	if (r->at >= 0) {
+		if (fstat(r->fd, &st) != 0)
+			return 0;
+		if (r->at > st.st_size ||
+		    (uintmax_t)n > (uintmax_t)(st.st_size - r->at)) {
+			errno = EIO;
+			return 0;
+		}
+
+		r->at += n;
+		r->pos += n;
+		posix_fadvise(r->fd, r->at, READ_WINDOW, POSIX_FADV_WILLNEED);
+		return 1;
+	}
+
+	/* a pipe: read and drop */
+	while (n > 0) {
+		r->start = 0;
+		r->end = reader_fill(r, r->buf, 0, 1, READ_WINDOW);
+		if (r->end == 0)
+			return 0;
+
+		k = r->end < n ? r->end : n;
+		r->start = k;
+		r->pos += k;
+		n -= k;
+	}
+
+	return 1;
+}
+
+static int reader_eof(struct reader *r)
+{
+	if (r->map)
+		return r->pos >= r->map_len;
+
+	if (r->start == r->end) {
+		r->start = 0;
+		r->end = reader_fill(r, r->buf, 0, 1, READ_WINDOW);
+	}
+
+	return r->start == r->end;
+}
+
+static int png_ok(struct reader *r)
+{
+	uint8_t buf[8];
+
+	if (!reader_read(r, buf, 8)) {
+		errno = EIO;  /* reached EOF or I/O error */
+		return 0;
+	}
+
+	if (!memcmp(buf, "\x89\x50\x4e\x47\x0d\x0a\x1a\x0a", 8))
+		return 1;
+
+	errno = EINVAL;  /* invalid PNG signature */
+	return 0;
+}
+
+#define valid_bdepth_gray(d) \
+	((d == 1) || (d == 2) || (d == 4) || (d == 8) || (d == 16))
+#define valid_bdepth_indexed(d) \
+	((d == 1) || (d == 2) || (d == 4) || (d == 8))
+#define valid_bdepth_rgb(d) ((d == 8) || (d == 16))
+
+static void check_bit_depth_and_color_type(struct ci_ctx *ctx)
+{
+	switch (ctx->color_type) {
+	case GRAY:
+		if (!valid_bdepth_gray(ctx->bit_depth))
+			die(ctx, "IHDR: invalid bit depth for grayscale: (%u)",
+					ctx->bit_depth);
+		break;
+	case RGB: case RGB_ALPHA: case GRAY_ALPHA:
+		if (!valid_bdepth_rgb(ctx->bit_depth))
+			die(ctx, "IHDR: invalid bit depth for %s: (%u)",
+					cstr[ctx->color_type], ctx->bit_depth);
+		break;
+	case INDEXED:
+		if (!valid_bdepth_indexed(ctx->bit_depth))
+			die(ctx, "IHDR: invalid bit depth for indexed-color: (%u)",
+					ctx->bit_depth);
+		break;
+	default:
+		die(ctx, "IHDR: invalid color type: (%u)", ctx->color_type);
+		break;
+	}
+}
+
+/**
+ * IHDR
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      width (min=1,max=2^31)
+ *   4      uint32    4      height (min=1,max=2^31)
+ *   8      uint8     1      bit depth (1,2,4,8,16)
+ *   9      uint8     1      color type (0,2,3,4,6)
+ *  10      uint8     1      compression method (0)
+ *  11      uint8     1      filter method (0)
+ *  12      uint8     1      interlace method (0,1)
+ */
+static void decode_ihdr(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 13)
+		die(ctx, "IHDR: invalid chunk length: (%u)", len);
+
+	ctx->bit_depth = data[8], ctx->color_type = data[9];
+	check_bit_depth_and_color_type(ctx);
+
+	ctx->bit_depth_max = 1 << ctx->bit_depth;
+
+	uint32_t w, h;
+	uint8_t chan_bits, comp, filter, interlace;
+	const uint8_t chan[] = {
+		[GRAY] = 1,
+		[RGB] = 3,
+		[INDEXED] = 1,
+		[GRAY_ALPHA] = 2,
+		[RGB_ALPHA] = 4
+	};
+
+	comp = !!data[10];
+	if (comp)
+		die(ctx, "IHDR: invalid compression method: (%u)", data[10]);
+
+	filter = !!data[11];
+	if (filter)
+		die(ctx, "IHDR: invalid filter method: (%u)", data[11]);
+
+	interlace = !!data[12];
+	if (interlace > 1)
+		die(ctx, "IHDR: invalid interlace method: (%u)", data[12]);
+
+	w = h = 0;
+	chan_bits = chan[ctx->color_type] *
+		((ctx->color_type == INDEXED) ? 8 : ctx->bit_depth);
+
+	memcpy(&w, data, 4);
+	w = __builtin_bswap32(w);
+	if (w > INT_MAX - 1)
+		die(ctx, "IHDR: width is too large: (%u)", w);
+
+	memcpy(&h, data + 4, 4);
+	h = __builtin_bswap32(h);
+	if (h > INT_MAX - 1)
+		die(ctx, "IHDR: height is too large: (%u)", h);
+
+	field(ctx, "Width", "%u", w);
+	field(ctx, "Height", "%u", h);
+	field(ctx, "Bit depth", "%u bits per %s", ctx->bit_depth,
+			(ctx->color_type == INDEXED) ? "palette index" : "channel");
+	field(ctx, "Color type", "%s", cstr[ctx->color_type]);
+	field(ctx, "Channels", "%u per pixel (%u bits)",
+			chan[ctx->color_type], chan_bits);
+	field(ctx, "Compression", "zlib deflate/inflate)");
+	field(ctx, "Filter", "adaptive filtering");
+	field(ctx, "Interlace", "%s interlace", interlace ? "Adam7" : "no");
+
+	struct ci_ihdr ihdr = {
+		.width = w,
+		.height = h,
+		.bit_depth = ctx->bit_depth,
+		.color_type = ctx->color_type,
+		.compression = data[10],
+		.filter = data[11],
+		.interlace = data[12],
+		.channels = chan[ctx->color_type],
+		.bits_per_pixel = chan[ctx->color_type] * ctx->bit_depth
+	};
+
+	ctx->width = w, ctx->height = h;
+	ctx->pixel_bits = ihdr.bits_per_pixel, ctx->interlace = interlace;
+
+	emit(ctx, ihdr, &ihdr);
+}
+
+/**
+ * PLTE
+ *
+ * n = chunk length
+ * palette entry = n / 3
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      red color
+ *   1      uint8     1      green color
+ *   2      uint8     1      blue color
+ *   3      uint8     1      red color
+ *   4      uint8     1      green color
+ *   5      uint8     1      blue color
+ *  ...
+ *   n      uint8     1      blue color
+ */
+static void decode_plte(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len % 3 != 0)
+		die(ctx, "PLTE: invalid chunk length: (%u)", len);
+
+	uint32_t i, col;
+
+	ctx->plt_entry = len / 3;
+	if (ctx->plt_entry > ctx->bit_depth_max)
+		die(ctx, "PLTE: palette entries too large: (%u)", len);
+
+	field(ctx, "Entries", "%u", ctx->plt_entry);
+
+	for (i = 0, col = 0; i < ctx->plt_entry; i++, col += 3) {
+		ctx->plt[i][0] = data[col];      /* red */
+		ctx->plt[i][1] = data[col + 1];  /* green */
+		ctx->plt[i][2] = data[col + 2];  /* blue */
+	}
+
+	for (i = 0; i < ctx->plt_entry; i++)
+		entry(ctx, i, "#%02x%02x%02x",
+		      ctx->plt[i][0], ctx->plt[i][1], ctx->plt[i][2]);
+
+	struct ci_plte plte = {
+		.entries = ctx->plt_entry,
+		.rgb = (const uint8_t (*)[3])ctx->plt
+	};
+
+	emit(ctx, plte, &plte);
+}
+
+/*
+ * IDAT and fdAT
+ *
+ * the chunks of one image are a single zlib stream, inflated as they
+ * come. the first chunk shows the zlib header, the one that ends the
+ * stream the sizes and the Adler-32, which zlib already checked, and
+ * with CI_VERIFY_FULL how the scanlines were filtered. with threads
+ * the stream is kept until the chunk after it, see idat.h.
+ */
+
+/* report the stream once idat_feed() or idat_finish() returned ret */
+static void image_end(struct ci_ctx *ctx, int ret)
+{
+	struct idat *s = &ctx->img;
+	const char *name = s->tag == TAG_IDAT ? "IDAT" : "fdAT";
+	const char *from = s->tag == TAG_IDAT ? "IHDR" : "fcTL";
+	struct ci_image img;
+
+	switch (ret) {
+	case IDAT_OK:
+		return;
+	case IDAT_END:
+		break;
+	case IDAT_ERR_NOMEM:
+		fail(ctx, CI_ERR_NOMEM, "%s: out of memory", name);
+	case IDAT_ERR_DICT:
+		die(ctx, "%s: zlib preset dictionary is not allowed", name);
+	case IDAT_ERR_LONG:
+		die(ctx, "%s: more image data than %s gives: (%llu bytes)",
+		    name, from, (unsigned long long)s->expect);
+	case IDAT_ERR_EXTRA:
+		die(ctx, "%s: data after the end of the zlib stream", name);
+	case IDAT_ERR_SHORT:
+		die(ctx, "%s: zlib stream is truncated", name);
+	default:
+		die(ctx, "%s: %s", name, idat_msg(s));
+	}
+
+	field(ctx, "Compressed", "%llu bytes in %u chunks",
+	      (unsigned long long)s->in, s->chunks);
+	field(ctx, "Decompressed", "%llu bytes",
+	      (unsigned long long)s->out);
+	field(ctx, "Adler-32", "%08x", s->adler);
+	if (s->pieces > 0)
+		field(ctx, "Inflated", "%u pieces in parallel, cut at full flushes",
+		      s->pieces);
+
+	if (s->out != s->expect)
+		die(ctx, "%s: %llu bytes of image data, %s gives %llu",
+		    name, (unsigned long long)s->out, from,
+		    (unsigned long long)s->expect);
+
+	if (ctx->verify >= CI_VERIFY_FULL) {
+		field(ctx, "Scanlines", "%llu, pixels CRC-32 %08x",
+		      (unsigned long long)s->rows, s->pixels_crc);
+		if (s->deinterlaced)
+			field(ctx, "Deinterlaced", "%u threads, raster CRC-32 %08x",
+			      s->threads, s->raster_crc);
+		field(ctx, "Filters", "None %llu, Sub %llu, Up %llu, "
+		      "Average %llu, Paeth %llu",
+		      (unsigned long long)s->filters[FILTER_NONE],
+		      (unsigned long long)s->filters[FILTER_SUB],
+		      (unsigned long long)s->filters[FILTER_UP],
+		      (unsigned long long)s->filters[FILTER_AVG],
+		      (unsigned long long)s->filters[FILTER_PAETH]);
+
+		if (s->bad > 0)
+			die(ctx, "%s: invalid filter type in %llu rows, "
+			    "first in row %llu: (%u)", name,
+			    (unsigned long long)s->bad,
+			    (unsigned long long)s->first_bad, s->bad_type);
+	}
+
+	memset(&img, 0, sizeof(img));
+	memcpy(img.type, name, 5);
+	img.chunks = s->chunks;
+	img.compressed = s->in;
+	img.decompressed = s->out;
+	img.adler32 = s->adler;
+	img.pieces = s->pieces;
+	img.rows = s->rows;
+	img.pixels_crc = s->pixels_crc;
+	img.deinterlaced = s->deinterlaced;
+	img.raster_crc = s->interlace ? s->raster_crc : s->pixels_crc;
+	memcpy(img.filters, s->filters, sizeof(img.filters));
+
+	emit(ctx, image, &img);
+}
+
+/* the stream starts with its first chunk */
+static void image_begin(struct ci_ctx *ctx, uint32_t tag)
+{
+	struct idat *s = &ctx->img;
+	struct idat_image im;
+
+	if (s->state != IDAT_NONE)
+		return;
+
+	im.width = tag == TAG_IDAT ? ctx->width : ctx->frame_width;
+	im.height = tag == TAG_IDAT ? ctx->height : ctx->frame_height;
+	im.bits = ctx->pixel_bits;
+	im.interlace = ctx->interlace;
+	im.unfilter = ctx->verify >= CI_VERIFY_FULL;
+	im.threads = ctx->threads;
+
+	if (idat_begin(s, tag, &im) != IDAT_OK)
+		fail(ctx, CI_ERR_NOMEM, "%s: out of memory",
+		     tag == TAG_IDAT ? "IDAT" : "fdAT");
+}
+
+/* the fields of a chunk, nhdr zlib header bytes were seen before it */
+static void image_report(struct ci_ctx *ctx, uint8_t nhdr, int ret)
+{
+	static const char *level[] = { "fastest", "fast", "default", "maximum" };
+	struct idat *s = &ctx->img;
+
+	if (nhdr < 2 && s->nhdr == 2)
+		field(ctx, "zlib", "%u byte window, %s compression",
+		      1u << ((s->hdr[0] >> 4) + 8), level[s->hdr[1] >> 6]);
+
+	image_end(ctx, ret);
+}
+
+static void image_data(struct ci_ctx *ctx, uint32_t tag, const uint8_t *data,
+		       const uint32_t len)
+{
+	uint8_t nhdr;
+	int ret;
+
+	if (ctx->verify < CI_VERIFY_INFLATE || ctx->damaged)
+		return;
+
+	image_begin(ctx, tag);
+
+	nhdr = ctx->img.nhdr;
+	ret = idat_feed(&ctx->img, data, len, 1);
+	image_report(ctx, nhdr, ret);
+}
+
+static void decode_idat(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	note(ctx, "Image data");
+	image_data(ctx, TAG_IDAT, data, len);
+}
+
+/**
+ * tIME
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      year (example: 20,20)
+ *   2      uint8     1      month (min=1,max=12)
+ *   3      uint8     1      day (min=1,max=31)
+ *   4      uint8     1      hour (min=0,max=23)
+ *   5      uint8     1      minute (min=0,max=59)
+ *   6      uint8     1      second (min=0,max=60)
+ */
+static void decode_time(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 7)
+		die(ctx, "tIME: invalid chunk length: (%u)", len);
+
+	struct tm t;
+	uint16_t year;
+	char buf[100] = {0};
+
+	year = 0;
+	memcpy(&year, data, 2);
+	year = __builtin_bswap16(year) - 1900;
+
+	t.tm_sec = data[6] <= 60 ? data[6] : 0;
+	t.tm_min = data[5] <= 59 ? data[5] : 0;
+	t.tm_hour = data[4] <= 23 ? data[4] : 0;
+	t.tm_mday = (data[3] >= 1 && data[3] <= 31) ? data[3] : 1;
+	t.tm_mon = (data[2] >= 1 && data[2] <= 12) ? data[2] : 1;
+	t.tm_year = year;
+
+	if (strftime(buf, 99, "%d %b %Y - %H:%M", &t))
+		field(ctx, "Last modification", "%s", buf);
+
+	struct ci_time time = {
+		.year = year + 1900,
+		.month = data[2],
+		.day = data[3],
+		.hour = data[4],
+		.minute = data[5],
+		.second = data[6]
+	};
+
+	emit(ctx, time, &time);
+}
+
+/**
+ * pHYs
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      x axis
+ *   4      uint32    4      y axis
+ *   8      uint8     1      unit (0=pixel,1=meter)
+ */
+static void decode_phys(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 9)
+		die(ctx, "pHYs: invalid chunk length: (%u)", len);
+
+	char *unit;
+	uint32_t x, y, dpi;
+
+	x = y = 0;
+	unit = !!data[8] ? " per meter" : "";
+
+	memcpy(&x, data, 4);
+	x = __builtin_bswap32(x);
+
+	memcpy(&y, data + 4, 4);
+	y = __builtin_bswap32(y);
+
+	dpi = x * 0.0254;
+
+	note(ctx, "%u x %u pixels%s (approx. %u DPI)", x, y, unit, dpi);
+
+	struct ci_phys phys = { .x = x, .y = y, .unit = data[8] };
+
+	emit(ctx, phys, &phys);
+}
+
+/**
+ * sRGB
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      rendering intent (0,1,2,3)
+ */
+static void decode_srgb(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 1)
+		die(ctx, "sRGB: invalid chunk length: (%u)", len);
+
+	if (data[0] > 3)
+		die(ctx, "sRGB: invalid sRGB value: (%u)", data[0]);
+
+	const char *srgb_data[5] = {
+		"Perceptual",
+		"Relative colorimetric",
+		"Saturation",
+		"Absolute colorimetric",
+		NULL
+	};
+
+	note(ctx, "%s intent", srgb_data[data[0]]);
+	emit(ctx, srgb, data[0]);
+}
+
+/**
+ * gAMA
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      gamma value
+ */
+static void decode_gama(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 4)
+		die(ctx, "gAMA: invalid chunk length: (%u)", len);
+
+	uint32_t gama = 0;
+
+	memcpy(&gama, data, 4);
+	gama = __builtin_bswap32(gama);
+	if (gama == 0)
+		die(ctx, "gAMA: invalid gamma value: (%u)", gama);
+
+	field(ctx, "Gamma", "%01.05f", (float)gama / 100000);
+	emit(ctx, gama, gama);
+}
+
+/**
+ * cHRM
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      white point x
+ *   4      uint32    4      white point y
+ *   8      uint32    4      red x
+ *   12     uint32    4      red y
+ *   16     uint32    4      green x
+ *   20     uint32    4      green y
+ *   24     uint32    4      blue x
+ *   28     uint32    4      blue y
+ */
+static void decode_chrm(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 32)
+		die(ctx, "cHRM: invalid chunk length: (%u)", len);
+
+	int offset, i;
+	uint32_t res[8] = {0};
+	uint32_t wx, wy, rx, ry, gx, gy, bx, by;
+
+	offset = 0;
+
+	for (i = 0; i < 8; i++) {
+		memcpy(&res[i], data + offset, 4);
+		res[i] = __builtin_bswap32(res[i]);
+		offset += 4;
+	}
+
+	wx = res[0], wy = res[1];
+	if (wx > 80000 || wy > 80000 || (wx + wy) > 100000)
+		die(ctx, "cHRM: invalid white point: (x=%u,y=%u)", wx, wy);
+
+	rx = res[2], ry = res[3];
+	if (rx > 80000 || ry > 80000 || (rx + ry) > 100000)
+		die(ctx, "cHRM: invalid red point: (x=%u,y=%u)", rx, ry);
+
+	gx = res[4], gy = res[5];
+	if (gx > 80000 || gx > 80000 || (gx + gy) > 100000)
+		die(ctx, "cHRM: invalid green point: (x=%u,y=%u)", gx, gy);
+
+	bx = res[6], by = res[7];
+	if (bx > 80000 || by > 80000 || (bx + by) > 100000)
+		die(ctx, "cHRM: invalid blue point: (x=%u,y=%u)", bx, by);
+
+	field(ctx, "White point x", "%01.05f", (float)wx / 100000);
+	field(ctx, "White point y", "%01.05f", (float)wy / 100000);
+	field(ctx, "Red x", "%01.05f", (float)rx / 100000);
+	field(ctx, "Red y", "%01.05f", (float)ry / 100000);
+	field(ctx, "Blue x", "%01.05f", (float)gx / 100000);
+	field(ctx, "Blue y", "%01.05f", (float)gy / 100000);
+	field(ctx, "Green x", "%01.05f", (float)bx / 100000);
+	field(ctx, "Green y", "%01.05f", (float)by / 100000);
+
+	struct ci_chrm chrm = {
+		.white_x = wx, .white_y = wy,
+		.red_x = rx, .red_y = ry,
+		.green_x = gx, .green_y = gy,
+		.blue_x = bx, .blue_y = by
+	};
+
+	emit(ctx, chrm, &chrm);
+}
+
+/*
+ * zTXt, iTXt and iCCP content
+ *
+ * inflated a window at a time and handed out piece by piece, never kept
+ * whole: no more than the limits of ci_set_inflate_limits() is inflated,
+ * so a bomb costs what the limit does. the fields only get a preview,
+ * the first window. the z_stream is kept for the whole file.
+ *
+ * UTF-8 is checked as it comes: a character cut by the end of a window
+ * is carried to the next one, so each piece is whole characters.
+ */
+#define INFLATE_WINDOW	16384
+
+struct unzipped {
+	uint64_t len;      /* inflated */
+	int stopped;       /* at a limit */
+	uint8_t head[20];  /* the first bytes */
+	size_t head_len;
+};
+
+/* key is the field of the preview, none if NULL */
+static void inflate_meta(struct ci_ctx *ctx, const char *type, const char *key,
+			 int utf8, const uint8_t *data, uint32_t len,
+			 struct unzipped *u)
+{
+	z_stream *z = &ctx->meta_z;
+	struct ci_inflated piece;
+	uint64_t max, total = 0;
+	uint8_t *out;
+	char *preview;
+	size_t n, got, valid, cut = 0;
+	int ret, first = 1;
+
+	max = ctx->inflate_max;
+	if (ctx->inflate_ratio && (uint64_t)ctx->inflate_ratio * len < max)
+		max = (uint64_t)ctx->inflate_ratio * len;
+
+	if (!ctx->meta_z_ready) {
+		if (inflateInit(z) != Z_OK)
+			fail(ctx, CI_ERR_NOMEM, "out of memory");
+		ctx->meta_z_ready = 1;
+	} else {
+		inflateReset(z);
+	}
+
+	/* and room for a cut character before the window */
+	out = arena_alloc(ctx, INFLATE_WINDOW + 3);
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+
+	memset(&piece, 0, sizeof(piece));
+	memcpy(piece.type, type, 4);
+	piece.data = out;
+
+	do {
+		n = max - total < INFLATE_WINDOW ? max - total : INFLATE_WINDOW;
+		z->next_out = out + cut;
+		z->avail_out = n;
+		ret = n > 0 ? inflate(z, Z_NO_FLUSH) : Z_OK;
+		if (ret == Z_BUF_ERROR)
+			die(ctx, "%s: compressed data is cut short", type);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			die(ctx, "%s: invalid compressed data", type);
+
+		got = cut + n - z->avail_out;
+		total += n - z->avail_out;
+		piece.stopped = ret != Z_STREAM_END && total == max;
+		piece.last = ret == Z_STREAM_END || piece.stopped;
+		piece.len = got;
+
+		if (utf8) {
+			valid = utf8_valid(out, got, &cut);
+			if (valid + cut < got || (cut && ret == Z_STREAM_END))
+				die(ctx, "%s: invalid UTF-8 in the text at byte %llu",
+				    type, (unsigned long long)(piece.offset + valid));
+
+			/* a character the limit cut is left out */
+			piece.len = valid;
+		}
+
+		if (first) {
+			first = 0;
+			u->head_len = piece.len < sizeof(u->head) ?
+				      piece.len : sizeof(u->head);
+			memcpy(u->head, out, u->head_len);
+
+			if (key && ctx->cb.field) {
+				preview = arena_alloc(ctx, piece.len + 1);
+				field_text(ctx, key, preview, utf8 ?
+					   copy_utf8(preview, out, piece.len) :
+					   copy_printable(preview, out, piece.len));
+			}
+		}
+
+		if (piece.len || piece.last)
+			emit(ctx, inflated, &piece);
+		piece.offset += piece.len;
+		memmove(out, out + piece.len, cut);
+	} while (!piece.last);
+
+	u->len = total;
+	u->stopped = piece.stopped;
+}
+
+/* the size of what inflate_meta() gave */
+static void inflated_size(struct ci_ctx *ctx, const struct unzipped *u)
+{
+	field(ctx, "Inflated", "%llu bytes%s", (unsigned long long)u->len,
+	      u->stopped ? ", stopped at the limit" : "");
+}
+
+/**
+ * iCCP
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   profile name (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     uint8     1      compression method (0)
+ *  n+2     uint8     m      compressed ICC profile
+ */
+static void decode_iccp(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	uint32_t i, l, n;
+
+	l = len;
+
+	n = keyword_len(data, l, &i);
+	if (i >= l)
+		die(ctx, "iCCP: invalid chunk length: (%u)", len);
+
+	struct ci_iccp iccp = {
+		.name = (const char *)data,
+		.name_len = n
+	};
+
+	field(ctx, "Profile name", "%.*s", (int)n, (const char *)data);
+	data += i; l -= i;
+
+	field(ctx, "Compression method", "%u (zlib deflate/inflate)", data[0]);
+
+	iccp.method = data[0];
+	data++; l--;
+
+	iccp.profile = data;
+	iccp.profile_len = l;
+	emit(ctx, iccp, &iccp);
+
+	if (ctx->verify < CI_VERIFY_INFLATE) {
+		field(ctx, "Profile (compressed)", "%u bytes", l);
+		return;
+	}
+
+	if (iccp.method != 0)
+		die(ctx, "iCCP: unknown compression method: (%u)", iccp.method);
+
+	struct unzipped u;
+	char class[5], space[5];
+
+	inflate_meta(ctx, "iCCP", NULL, 0, data, l, &u);
+	inflated_size(ctx, &u);
+
+	/* from the ICC profile header */
+	if (u.head_len == sizeof(u.head)) {
+		copy_printable(class, u.head + 12, 4);
+		copy_printable(space, u.head + 16, 4);
+		field(ctx, "Profile class", "%s", class);
+		field(ctx, "Color space", "%s", space);
+	}
+}
+
+/**
+ * tEXt (may appear more than one)
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   keyword (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     char      m      text (printable ascii)
+ */
+static void decode_text(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	uint32_t i, l, n;
+
+	l = len;
+
+	n = keyword_len(data, l, &i);
+	if (i > l)
+		die(ctx, "tEXt: invalid chunk length: (%u)", len);
+
+	struct ci_text text = {
+		.type = "tEXt",
+		.keyword = (const char *)data,
+		.keyword_len = n,
+		.text = data + i,
+		.text_len = l - i
+	};
+
+	field(ctx, "Keyword", "%.*s", (int)n, (const char *)data);
+	data += i; l -= i;
+
+	if (ctx->cb.field) {
+		char *buf = arena_alloc(ctx, (size_t)l + 1);
+
+		field_text(ctx, "Text", buf, copy_printable(buf, data, l));
+	}
+
+	emit(ctx, text, &text);
+}
+
+/* the offset of invalid UTF-8 is in the field, not the chunk */
+static void check_utf8(struct ci_ctx *ctx, const char *what,
+		       const uint8_t *s, size_t len)
+{
+	size_t n, cut;
+
+	n = utf8_valid(s, len, &cut);
+	if (n < len)
+		die(ctx, "iTXt: invalid UTF-8 in the %s at byte %zu", what, n);
+}
+
+/**
+ * iTXt (may appear more than one)
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   keyword (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     uint8     1      compression flag (0=uncompress,1=compress)
+ *  n+2     uint8     1      compression method
+ *  n+3     char    0 - m    language tag (printable ascii)
+ *   m      uint8     1      null separator (\0)
+ *  m+1     utf8    0 - o    translated keyword (utf8)
+ *   o      uint8     1      null separator (\0)
+ *  o+1     utf8    0 - p    text (utf8 or compressed utf8)
+ */
+static void decode_itxt(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	uint32_t i, l, n;
+	uint8_t comp_flag;
+	char *comp;
+
+	l = len;
+
+	n = keyword_len(data, l, &i);
+	if (i + 2 > l)
+		die(ctx, "iTXt: invalid chunk length: (%u)", len);
+
+	struct ci_text text = {
+		.type = "iTXt",
+		.keyword = (const char *)data,
+		.keyword_len = n,
+		.compressed = data[i],
+		.method = data[i + 1]
+	};
+
+	field(ctx, "Keyword", "%.*s", (int)n, (const char *)data);
+	data += i; l -= i;
+
+	comp_flag = !!data[0];
+	comp = comp_flag ? "compressed" : "uncompressed";
+	field(ctx, "Compression flag", "%u (%s)", comp_flag, comp);
+
+	data++; l--;
+	if (comp_flag)
+		field(ctx, "Compression method", "%u (zlib deflate/inflate)", data[0]);
+
+	data++; l--;
+	n = keyword_len(data, l, &i);
+
+	text.language = (const char *)data;
+	text.language_len = n;
+
+	field(ctx, "Language tag", "%.*s", (int)n, (const char *)data);
+
+	if (i > l)
+		die(ctx, "iTXt: invalid chunk length: (%u)", len);
+
+	data += i; l -= i;
+
+	const uint8_t *nul = memchr(data, 0, l);
+
+	text.translated = (const char *)data;
+	text.translated_len = nul ? (size_t)(nul - data) : l;
+	text.text = nul ? nul + 1 : data + l;
+	text.text_len = nul ? l - (nul - data) - 1 : 0;
+
+	check_utf8(ctx, "translated keyword", data, text.translated_len);
+	if (ctx->cb.field) {
+		char *buf = arena_alloc(ctx, text.translated_len + 1);
+
+		field_text(ctx, "Translated keyword (UTF-8)", buf,
+			   copy_utf8(buf, data, text.translated_len));
+	}
+
+	if (!comp_flag) {
+		check_utf8(ctx, "text", text.text, text.text_len);
+		if (ctx->cb.field) {
+			char *buf = arena_alloc(ctx, text.text_len + 1);
+
+			field_text(ctx, "Text (UTF-8)", buf,
+				   copy_utf8(buf, text.text, text.text_len));
+		}
+	}
+	emit(ctx, text, &text);
+
+	if (!comp_flag)
+		return;
+
+	if (ctx->verify < CI_VERIFY_INFLATE) {
+		field(ctx, "Text (compressed)", "%zu bytes", text.text_len);
+		return;
+	}
+
+	if (text.method != 0)
+		die(ctx, "iTXt: unknown compression method: (%u)", text.method);
+
+	struct unzipped u;
+
+	inflate_meta(ctx, "iTXt", "Text (UTF-8)", 1, text.text, text.text_len, &u);
+	inflated_size(ctx, &u);
+}
+
+/**
+ * zTXt (may appear more than one)
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   keyword (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     uint8     1      compression method
+ *  n+2     uint8     m      compressed text (ascii)
+ */
+static void decode_ztxt(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	uint32_t i, l, n;
+
+	l = len;
+
+	n = keyword_len(data, l, &i);
+	if (i >= l)
+		die(ctx, "zTXt: invalid chunk length: (%u)", len);
+
+	struct ci_text text = {
+		.type = "zTXt",
+		.keyword = (const char *)data,
+		.keyword_len = n,
+		.compressed = 1,
+		.method = data[i],
+		.text = data + i + 1,
+		.text_len = l - i - 1
+	};
+
+	field(ctx, "Keyword", "%.*s", (int)n, (const char *)data);
+	data += i; l -= i;
+
+	field(ctx, "Compression method", "%u (zlib deflate/inflate)", data[0]);
+
+	data++; l--;
+	emit(ctx, text, &text);
+
+	if (ctx->verify < CI_VERIFY_INFLATE) {
+		field(ctx, "Text (compressed)", "%u bytes", l);
+		return;
+	}
+
+	if (text.method != 0)
+		die(ctx, "zTXt: unknown compression method: (%u)", text.method);
+
+	struct unzipped u;
+
+	inflate_meta(ctx, "zTXt", "Text", 0, data, l, &u);
+	inflated_size(ctx, &u);
+}
+
+/**
+ * bKGD
+ *
+ * if indexed color
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      palette index
+ *
+ * if grayscale or grayscale+alpha
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      gray level
+ *
+ * if rgb or rgb+alpha
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      red color
+ *   2      uint16    2      green color
+ *   4      uint16    2      blue color
+ */
+static void decode_bkgd(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len != 1 && len != 2 && len != 6)
+		die(ctx, "bKGD: invalid chunk length: (%u)", len);
+
+	uint8_t idx;
+	uint32_t max;
+	uint16_t gray, r, g, b;
+
+	max = ctx->bit_depth_max - 1;
+
+	switch (ctx->color_type) {
+	case GRAY: case GRAY_ALPHA:
+		memcpy(&gray, data, 2);
+		gray = __builtin_bswap16(gray);
+		if (gray > max)
+			die(ctx, "bKGD: gray level out of range: (%u)", gray);
+
+		field(ctx, "Gray level", "%u", gray);
+		break;
+	case RGB: case RGB_ALPHA:
+		memcpy(&r, data, 2);
+		r = __builtin_bswap16(r);
+		if (r > max)
+			die(ctx, "bKGD: red colour out of range: (%u)", r);
+
+		memcpy(&g, data + 2, 2);
+		g = __builtin_bswap16(g);
+		if (g > max)
+			die(ctx, "bKGD: green colour out of range: (%u)", g);
+
+		memcpy(&b, data + 4, 2);
+		b = __builtin_bswap16(b);
+		if (b > max)
+			die(ctx, "bKGD: blue colour out of range: (%u)", b);
+
+		if (ctx->bit_depth < 16)
+			note(ctx, "#%02x%02x%02x", r, g, b);
+		else
+			note(ctx, "#%04x%04x%04x", r, g, b);
+		break;
+	case INDEXED:
+		idx = data[0];
+		if (idx > ctx->plt_entry)
+			die(ctx, "bKGD: palette index out of range: (%u)", idx);
+
+		r = ctx->plt[idx][0];
+		g = ctx->plt[idx][1];
+		b = ctx->plt[idx][2];
+
+		note(ctx, "[%03u] #%02x%02x%02x", idx, r, g, b);
+		break;
+	default:
+		die(ctx, "bKGD: invalid color type: (%u)", ctx->color_type);
+		break;
+	}
+}
+
+/**
+ * sBIT
+ *
+ * if grayscale
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      significant bits for gray
+ *
+ * if grayscale+alpha
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      significant bits for gray
+ *   1      uint8     1      significant bits for alpha
+ *
+ * if indexed or rgb
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      significant bits for red
+ *   1      uint8     1      significant bits for green
+ *   2      uint8     1      significant bits for blue
+ *
+ * if rgb+alpha
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      significant bits for red
+ *   1      uint8     1      significant bits for green
+ *   2      uint8     1      significant bits for blue
+ *   3      uint8     1      significant bits for alpha
+ */
+static void decode_sbit(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len < 1 && len > 4)
+		die(ctx, "sBIT: invalid chunk length: (%u)", len);
+
+	uint32_t i;
+	uint8_t max;
+	uint8_t bit[4];
+	uint8_t gray, r, g, b, alpha;
+
+	max = (ctx->color_type == INDEXED) ? 8 : ctx->bit_depth;
+
+	for (i = 0; i < len; i++) {
+		bit[i] = data[i];
+		if (bit[i] > max)
+			die(ctx, "sBIT: bit value out of range: (%u)", bit[i]);
+	}
+
+	if (ctx->color_type == GRAY && i == 1) {
+		gray = bit[0];
+		note(ctx, "gray(%u)", gray);
+	} else if (ctx->color_type == GRAY_ALPHA && i == 2) {
+		gray = bit[0];
+		alpha = bit[1];
+		note(ctx, "gray(%u), alpha(%u)", gray, alpha);
+	} else if ((ctx->color_type == INDEXED || ctx->color_type == RGB) && i == 3) {
+		r = bit[0];
+		g = bit[1];
+		b = bit[2];
+		note(ctx, "red(%u), green(%u), blue(%u)", r, g, b);
+	} else if (ctx->color_type == RGB_ALPHA && i == 4) {
+		r = bit[0];
+		g = bit[1];
+		b = bit[2];
+		alpha = bit[3];
+		note(ctx, "red(%u), green(%u), blue(%u), alpha(%u)", r, g, b, alpha);
+	} else {
+		die(ctx, "sBIT: invalid color type: (%u)", ctx->color_type);
+	}
+}
+
+/**
+ * tRNS
+ *
+ * if grayscale
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      transparency level for gray
+ *
+ * if indexed
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      transparency level for palette index 0
+ *   1      uint8     1      transparency level for palette index 1
+ *  ...
+ *   n      uint8     1      transparency level for palette index n
+ *
+ * if rgb
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      transparency level for red
+ *   2      uint16    2      transparency level for green
+ *   4      uint16    2      transparency level for blue
+ */
+static void decode_trns(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (ctx->color_type != INDEXED && (len != 2 && len != 6))
+		die(ctx, "tRNS: invalid chunk length: (%u)", len);
+
+	uint32_t i, max;
+	uint16_t gray, r, g, b;
+
+	max = ctx->bit_depth_max - 1;
+
+	switch (ctx->color_type) {
+	case GRAY:
+		memcpy(&gray, data, 2);
+		gray = __builtin_bswap16(gray);
+		if (gray > max)
+			die(ctx, "tRNS: gray value out of range: (%u)", gray);
+
+		note(ctx, "gray(%u)", gray);
+		break;
+	case RGB:
+		memcpy(&r, data, 2);
+		r = __builtin_bswap16(r);
+		if (r > max)
+			die(ctx, "tRNS: red value out of range: (%u)", r);
+
+		memcpy(&g, data + 2, 2);
+		g = __builtin_bswap16(g);
+		if (g > max)
+			die(ctx, "tRNS: green value out of range: (%u)", g);
+
+		memcpy(&b, data + 4, 2);
+		b = __builtin_bswap16(b);
+		if (b > max)
+			die(ctx, "tRNS: blue value out of range: (%u)", b);
+
+		if (ctx->bit_depth < 16)
+			note(ctx, "red(%02x), green(%02x), blue(%02x)", r, g, b);
+		else
+			note(ctx, "red(%04x), green(%04x), blue(%04x)", r, g, b);
+		break;
+	case INDEXED:
+		for (i = 0; i < len; i++)
+			entry(ctx, i, "%02x", data[i]);
+		break;
+	default:
+		die(ctx, "tRNS: invalid color type: (%u)", ctx->color_type);
+		break;
+	}
+}
+
+/**
+ * sPLT (may appear more than one)
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   palette name (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     uint8     1      sample depth (8,16)
+ *  n+2    uint8/16  1/2     red color *
+ *  n+3    uint8/16  1/2     green color *
+ *  n+4    uint8/16  1/2     blue color *
+ *  n+5    uint8/16  1/2     alpha *
+ *  n+6    uint16     2      frequency
+ *
+ *  * = if sample depth is 8, then type is uint8 and each length is 1
+ *      otherwise, it's 16, then type is uint16 and each length is 2
+ */
+static void decode_splt(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	/* at least 1 character palette name, null, and sample depth */
+	if (len < 3)
+		die(ctx, "sPLT: invalid chunk length: (%u)", len);
+
+	uint8_t sample_depth;
+	uint32_t col, nentry, i, l, n, step;
+
+	l = len;
+	col = 0;
+
+	n = keyword_len(data, l, &i);
+	if (i >= l)
+		die(ctx, "sPLT: invalid chunk length: (%u)", len);
+
+	field(ctx, "Palette name", "%.*s", (int)n, (const char *)data);
+	data += i;
+	l -= i;
+
+	sample_depth = data[0];
+	if (sample_depth != 8 && sample_depth != 16)
+		die(ctx, "sPLT: invalid sample depth: (%u)", sample_depth);
+
+	field(ctx, "Sample depth", "%u", sample_depth);
+
+	data++; l--;
+	if ((l % 6) != 0 && (l % 10) != 0)
+		die(ctx, "sPLT: invalid palette length: (%u)", l);
+
+	if (sample_depth == 8) {
+		nentry = l / 6;
+		step = 6;
+	} else {
+		nentry = l / 10;
+		step = 10;
+	}
+
+	field(ctx, "Entries", "%u", nentry);
+
+	for (i = 0; i < nentry; i++, col += step) {
+		if (sample_depth == 8)
+			entry(ctx, i, "#%02x%02x%02x%02x (%02x%02x)",
+			      data[col], data[col+1], data[col+2],
+			      data[col+3], data[col+4], data[col+5]);
+		else
+			entry(ctx, i, "#%02x%02x%02x%02x%02x%02x%02x%02x (%02x%02x)",
+			      data[col], data[col+1], data[col+2],
+			      data[col+3], data[col+4], data[col+5],
+			      data[col+6], data[col+7], data[col+8],
+			      data[col+9]);
+	}
+}
+
+/**
+ * hIST
+ *
+ * entry = chunk length / 2
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint16    2      frequency of used for palette index 0
+ *   2      uint16    2      frequency of used for palette index 1
+ *   4      uint16    2      frequency of used for palette index 2
+ *  ...
+ *   n      uint16    2      frequency of used for palette index n
+ */
+static void decode_hist(struct ci_ctx *ctx, const uint8_t *data,
+			const uint32_t len)
+{
+	if (len % 2 != 0)
+		die(ctx, "hIST: invalid chunk length: (%u)", len);
+
+	if (ctx->plt_entry == 0)
+		die(ctx, "hIST: cannot find PLTE chunk");
+
+	int off;
+	uint16_t h;
+	uint32_t i, nentry;
+
+	h = 0;
+	off = 0;
+	nentry = len / 2;
+
+	field(ctx, "Entries", "%u", nentry);
+
+	for (i = 0; i < nentry; i++) {
+		memcpy(&h, data + off, 2);
+		h = __builtin_bswap16(h);
+		off += 2;
+		entry(ctx, i, "%u", h);
+	}
+}
+
+/**
+ * oFFs
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      int32     4      x position
+ *   4      int32     4      y position
+ *   8      uint8     1      unit (0=pixel,1=micrometer)
+ */
+static void decode_ext_offs(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	if (len != 9)
+		die(ctx, "oFFs: invalid chunk length: (%u)", len);
+
+	char *unit;
+	uint32_t x, y;
+
+	x = y = 0;
+	unit = !!data[8] ? "micrometres" : "pixels";
+
+	memcpy(&x, data, 4);
+	x = __builtin_bswap32(x);
+
+	memcpy(&y, data + 4, 4);
+	y = __builtin_bswap32(y);
+
+	field(ctx, "Image position", "%d x %d %s", (int32_t)x, (int32_t)y, unit);
+}
+
+/**
+ * sCAL
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      unit (1=meter,2=radian)
+ *   1      char    1 - n    pixel width (ascii floating-point)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     char    1 - m    pixel height (ascii floating-point)
+ */
+static void decode_ext_scal(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	if (data[0] < 1 && data[0] > 2)
+		die(ctx, "sCAL: invalid unit specifier: (%u)", len);
+
+	const uint8_t *nul;
+	char *unit, *buf;
+	uint32_t l, k;
+	size_t n;
+
+	if (!ctx->cb.field)
+		return;
+
+	unit = data[0] == 1 ? "meters" : "radians";
+	l = len;
+
+	buf = arena_alloc(ctx, (size_t)len + 16);
+
+	data++; l--; /* next */
+	nul = memchr(data, 0, l);
+	k = nul ? (uint32_t)(nul - data) : l;
+	n = copy_printable(buf, data, k);
+	data += k; l -= k;
+
+	if (l > 0) {
+		data++; l--; /* next */
+	}
+
+	n += sprintf(buf + n, " x ");
+	n += copy_printable(buf + n, data, l);
+
+	n += sprintf(buf + n, " (%s)", unit);
+	field_text(ctx, "Physical scale", buf, n);
+}
+
+/**
+ * pCAL
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      char    1 - 79   calibration name (printable ascii)
+ *   n      uint8     1      null separator (\0)
+ *  n+1     int32     4      original zero (x0)
+ *  n+5     int32     4      original max (x1)
+ *  n+9     uint8     1      equation type (0,1,2,3)
+ *  n+10    uint8     1      number of parameters
+ *  n+11    char    0 - m    unit name (printable ascii)
+ *   m      uint8     1      null separator (\0)
+ *  m+1     char    1 - p    parameter 0 (p0) (floating-point ascii)
+ *   p      uint8     1      null separator (\0)
+ *  p+1     char    1 - o    parameter 1 (p1) (floating-point ascii)
+ */
+static void decode_ext_pcal(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	uint8_t eq_type, params;
+	const char *eq_str;
+	uint32_t i, l, n, x0, x1;
+	const char *eq_arr[5] = {
+		"linear", "exponential",
+		"exponential arbitrary base", "hyperbolic sinusoidal",
+		NULL
+	};
+
+	l = len;
+	x0 = x1 = 0;
+
+	/* get calibration name */
+	n = keyword_len(data, l, &i);
+	field(ctx, "Calibration name", "%.*s", (int)n, (const char *)data);
+	data += i; l -= i;
+
+	/* get x0 and x1 */
+	memcpy(&x0, data, 4);
+	x0 = __builtin_bswap32(x0);
+	data += 4; l-= 4;
+
+	memcpy(&x1, data, 4);
+	x1 = __builtin_bswap32(x1);
+	data += 4; l-= 4;
+
+	field(ctx, "Linear conversion", "%d x %d", (int32_t)x0, (int32_t)x1);
+
+	/* get equation type */
+	eq_type = data[0];
+	if (eq_type > 3)
+		die(ctx, "pCAL: invalid equation type: (%u)", eq_type);
+
+	eq_str = eq_arr[eq_type];
+	field(ctx, "Equation type", "%u (%s)", eq_type, eq_str);
+
+	data++; l--; /* next */
+
+	/* get total of parameters */
+	params = data[0];
+	field(ctx, "Parameters", "%u", params);
+
+	data++; l--; /* next */
+
+	/* get unit name */
+	n = keyword_len(data, l, &i);
+	field(ctx, "Unit name", "%.*s", (int)n, (const char *)data);
+
+	data += i; l -= i;
+	if (l > len)
+		die(ctx, "pCAL: invalid chunk length: (%u)", len);
+
+	/* print all values */
+	if (ctx->cb.field) {
+		char *buf;
+		size_t n;
+
+		buf = arena_alloc(ctx, (size_t)l * 2 + 1);
+		for (n = 0; l > 0; data++, l--) {
+			if (valid_keyword(*data)) {
+				buf[n++] = *data;
+			} else {
+				buf[n++] = ',';
+				buf[n++] = ' ';
+			}
+		}
+
+		buf[n] = 0;
+		field_text(ctx, "Values", buf, n);
+	}
+}
+
+/**
+ * gIFg
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      disposal method
+ *   1      uint8     1      user input flag
+ *   2      uint16    2      delay time
+ */
+static void decode_ext_gifg(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	if (len != 4)
+		die(ctx, "gIFg: invalid chunk length: (%u)", len);
+
+	uint8_t dis, input;
+	uint16_t delay_time;
+
+	dis = data[0];
+	input = data[1];
+	delay_time = 0;
+
+	memcpy(&delay_time, data + 2, 2);
+	delay_time = __builtin_bswap16(delay_time);
+
+	field(ctx, "Disposal method", "%u", dis);
+	field(ctx, "User input", "%u", input);
+	field(ctx, "Delay time", "%lf seconds", (double).01 * delay_time);
+}
+
+/**
+ * sTER
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     1      layout mode (0=cross-fuse,1=diverging-fuse)
+ */
+static void decode_ext_ster(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	if (len != 1)
+		die(ctx, "sTER: invalid chunk length: (%u)", len);
+
+	if (data[0] > 1)
+		die(ctx, "sTER: invalid layout: (%u)", data[0]);
+
+	char *layout = !!data[0] ? "Diverging-fuse" : "Cross-fuse";
+
+	field(ctx, "Layout", "%s layout", layout);
+}
+
+/**
+ * gIFx
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint8     8      application identifier (printable ascii)
+ *   8      uint8     3      authentication code
+ *   11     ?????     n      application data
+ */
+static void decode_ext_gifx(struct ci_ctx *ctx, const uint8_t *data,
+			    const uint32_t len)
+{
+	if (len < 11)
+		die(ctx, "gIFx: invalid chunk length: (%u)", len);
+
+	field(ctx, "Application ID", "%.*s", 8, (char *)data);
+	field(ctx, "Authentication code", "%02x%02x%02x", data[8], data[9], data[10]);
+	field(ctx, "Application data", ".....");
+}
+
+/* fcTL and fdAT share a sequence, from 0 */
+static void apng_sequence(struct ci_ctx *ctx, const char *name, uint32_t seq)
+{
+	if (seq != ctx->ord.sequence && !ctx->damaged)
+		fail(ctx, CI_ERR_ORDER, "%s: sequence number %u, %u expected",
+		     name, seq, ctx->ord.sequence);
+	ctx->ord.sequence = seq + 1;
+}
+
+/**
+ * acTL
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      number of frames
+ *   4      uint32    4      number of looping (0=infinite looping)
+ */
+static void decode_apng_actl(struct ci_ctx *ctx, const uint8_t *data,
+			     const uint32_t len)
+{
+	if (len != 8)
+		die(ctx, "acTL: invalid chunk length: (%u)", len);
+
+	uint32_t nframes, nplays;
+
+	nframes = nplays = 0;
+
+	memcpy(&nframes, data, 4);
+	nframes = __builtin_bswap32(nframes);
+
+	memcpy(&nplays, data + 4, 4);
+	nplays = __builtin_bswap32(nplays);
+
+	field(ctx, "Number of frames", "%u", nframes);
+	field(ctx, "Number of plays", "%u %s", nplays, nplays ? "" : "(infinite)");
+
+	ctx->ord.frames = nframes;
+	ctx->ord.has_frames = 1;
+
+	struct ci_actl actl = { .frames = nframes, .plays = nplays };
+
+	emit(ctx, actl, &actl);
+}
+
+/**
+ * fcTL
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      sequence of chunk animation, start from 0
+ *   4      uint32    4      width frame
+ *   8      uint32    4      height frame
+ *   12     uint32    4      X position
+ *   16     uint32    4      Y position
+ *   20     uint16    2      frame delay fraction numerator
+ *   23     uint16    2      frame delay fraction denominator
+ *   24     uint8     1      frame disposal type (0,1,2)
+ *   25     uint8     1      frame blend type (0,1)
+ */
+static void decode_apng_fctl(struct ci_ctx *ctx, const uint8_t *data,
+			     const uint32_t len)
+{
+	if (len != 26)
+		die(ctx, "fcTL: invalid chunk length: (%u)", len);
+
+	apng_sequence(ctx, "fcTL", be32(data));
+
+	uint8_t i;
+	int offset;
+	const char *dispose, *blend;
+	const char *bl_str[3] = { "Source", "Over", NULL };
+	const char *dis_str[4] = { "None", "Background", "Previous", NULL };
+
+	uint32_t buf1[4] = {0}; /* width, height, x_offset, y_offset */
+	uint16_t buf2[2] = {0}; /* delay_nums, delay_den */
+	uint8_t buf3[2] = {0}; /* dispose_op, blend_op */
+
+	offset = 4; /* skip sequence_number for now */
+	for (i = 0; i < 4; i++) {
+		memcpy(&buf1[i], data + offset, 4);
+		buf1[i] = __builtin_bswap32(buf1[i]);
+		offset += 4;
+	}
+
+	for (i = 0; i < 2; i++) {
+		memcpy(&buf2[i], data + offset, 2);
+		buf2[i] = __builtin_bswap16(buf2[i]);
+		offset += 2;
+	}
+
+	buf3[0] = data[offset];
+	if (buf3[0] > 3)
+		die(ctx, "fcTL: invalid disposal method");
+	dispose = dis_str[buf3[0]];
+
+	buf3[1] = data[offset + 1];
+	if (buf3[1] > 1)
+		die(ctx, "fcTL: invalid blend method");
+	blend = bl_str[buf3[1]];
+
+	ctx->frame_width = buf1[0], ctx->frame_height = buf1[1];
+
+	field(ctx, "Width", "%u", buf1[0]);
+	field(ctx, "Height", "%u", buf1[1]);
+	field(ctx, "X offset", "%u", buf1[2]);
+	field(ctx, "Y offset", "%u", buf1[3]);
+	field(ctx, "Delays", "%u (denominator %u)", buf2[0], buf2[1]);
+	field(ctx, "Disposal", "%u (%s)", buf3[0], dispose);
+	field(ctx, "Blend", "%u (%s)", buf3[1], blend);
+
+	struct ci_fctl fctl = {
+		.sequence = be32(data),
+		.width = buf1[0],
+		.height = buf1[1],
+		.x_offset = buf1[2],
+		.y_offset = buf1[3],
+		.delay_num = buf2[0],
+		.delay_den = buf2[1],
+		.dispose = buf3[0],
+		.blend = buf3[1]
+	};
+
+	emit(ctx, fctl, &fctl);
+}
+
+/**
+ * fdAT
+ *
+ * offset   type    length   value
+ * -------------------------------
+ *   0      uint32    4      sequence of chunk animation
+ *   4      uint8     n      frame data, same as IDAT
+ */
+static void decode_apng_fdat(struct ci_ctx *ctx, const uint8_t *data,
+			     const uint32_t len)
+{
+	if (len < 4)
+		die(ctx, "fdAT: invalid chunk length: (%u)", len);
+
+	apng_sequence(ctx, "fdAT", be32(data));
+	field(ctx, "Sequence", "%u", be32(data));
+	image_data(ctx, TAG_FDAT, data + 4, len - 4);
+}
+
+/*
+ * built-in decoders, found by a perfect hash of the chunk tag
+ *
+ * PH_MULT was searched offline so that every tag below, plus fdAT, IEND
+ * and eXIf, lands in its own slot of a 64 entry table: a lookup is one
+ * multiply, one shift and one compare. adding a decoder may need a new
+ * multiplier, a collision is a compile error (-Woverride-init).
+ */
+#define PH_BITS	6
+#define PH_MULT	0x550fe08du
+#define PH(tag)	((uint32_t)((uint32_t)(tag) * PH_MULT) >> (32 - PH_BITS))
+
+struct decoder {
+	uint32_t tag;
+	void (*fn)(struct ci_ctx *, const uint8_t *, const uint32_t);
+};
+
+#define DECODER(a, b, c, d, fn)	[PH(TAG(a, b, c, d))] = { TAG(a, b, c, d), fn }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct decoder decoders[1 << PH_BITS] = {
+	/* critical chunks */
+	DECODER('I', 'H', 'D', 'R', decode_ihdr),
+	DECODER('P', 'L', 'T', 'E', decode_plte),
+	DECODER('I', 'D', 'A', 'T', decode_idat),
+
+	/* ancillary chunks */
+	DECODER('t', 'I', 'M', 'E', decode_time),
+	DECODER('p', 'H', 'Y', 's', decode_phys),
+	DECODER('s', 'R', 'G', 'B', decode_srgb),
+	DECODER('g', 'A', 'M', 'A', decode_gama),
+	DECODER('c', 'H', 'R', 'M', decode_chrm),
+	DECODER('i', 'C', 'C', 'P', decode_iccp),
+	DECODER('t', 'E', 'X', 't', decode_text),
+	DECODER('i', 'T', 'X', 't', decode_itxt),
+	DECODER('z', 'T', 'X', 't', decode_ztxt),
+	DECODER('b', 'K', 'G', 'D', decode_bkgd),
+	DECODER('s', 'B', 'I', 'T', decode_sbit),
+	DECODER('t', 'R', 'N', 'S', decode_trns),
+	DECODER('s', 'P', 'L', 'T', decode_splt),
+	DECODER('h', 'I', 'S', 'T', decode_hist),
+
+	/* official PNG extension chunks */
+	DECODER('o', 'F', 'F', 's', decode_ext_offs),
+	DECODER('s', 'C', 'A', 'L', decode_ext_scal),
+	DECODER('p', 'C', 'A', 'L', decode_ext_pcal),
+	DECODER('g', 'I', 'F', 'x', decode_ext_gifx),
+	DECODER('g', 'I', 'F', 'g', decode_ext_gifg),
+	DECODER('s', 'T', 'E', 'R', decode_ext_ster),
+
+	/* APNG */
+	DECODER('a', 'c', 'T', 'L', decode_apng_actl),
+	DECODER('f', 'c', 'T', 'L', decode_apng_fctl),
+	DECODER('f', 'd', 'A', 'T', decode_apng_fdat),
+};
+#pragma GCC diagnostic pop
+
+static void decode_chunk_data(struct ci_ctx *ctx, const struct ci_chunk *c)
+{
+	const struct decoder *d;
+	size_t i;
+	int err;
+
+	arena_reset(ctx);
+
+	/* the user's decoders come first, they can replace ours */
+	for (i = 0; i < ctx->ncustom; i++) {
+		if (ctx->custom[i].tag != c->tag)
+			continue;
+
+		err = ctx->custom[i].fn(ctx, c, ctx->custom[i].arg);
+		if (err != CI_OK)
+			fail(ctx, err, "%s: decoder failed", c->type);
+		return;
+	}
+
+	if (c->length == 0) {
+		note(ctx, "No data");
+		return;
+	}
+
+	d = &decoders[PH(c->tag)];
+	if (d->tag == c->tag && d->fn) {
+		d->fn(ctx, c->data, c->length);
+		return;
+	}
+
+	/* no decoder yet... */
+	note(ctx, ".....");
+}
+
+/*
+ * chunk order, checked from the type alone as the chunks go by
+ *
+ * the rules are keyed by the perfect hash of the decoders, so a chunk
+ * is looked up the same way, and a bit per slot tells which ones were
+ * seen. a chunk without a rule can be anywhere, any number of times.
+ * what goes missing with damage is not asked for once it was skipped.
+ */
+#define R_ONCE		0x01  /* at most one */
+#define R_PRE_PLTE	0x02  /* before PLTE and IDAT */
+#define R_POST_PLTE	0x04  /* after PLTE, if there is one */
+#define R_PRE_IDAT	0x08  /* before IDAT */
+#define R_APNG		0x10  /* after acTL */
+
+struct rule {
+	uint32_t tag;
+	uint8_t flags;
+};
+
+#define RULE(a, b, c, d, flags)	[PH(TAG(a, b, c, d))] = { TAG(a, b, c, d), flags }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct rule rules[1 << PH_BITS] = {
+	RULE('I', 'H', 'D', 'R', R_ONCE),
+	RULE('P', 'L', 'T', 'E', R_ONCE | R_PRE_IDAT),
+	RULE('I', 'E', 'N', 'D', R_ONCE),
+
+	RULE('c', 'H', 'R', 'M', R_ONCE | R_PRE_PLTE),
+	RULE('g', 'A', 'M', 'A', R_ONCE | R_PRE_PLTE),
+	RULE('i', 'C', 'C', 'P', R_ONCE | R_PRE_PLTE),
+	RULE('s', 'B', 'I', 'T', R_ONCE | R_PRE_PLTE),
+	RULE('s', 'R', 'G', 'B', R_ONCE | R_PRE_PLTE),
+	RULE('b', 'K', 'G', 'D', R_ONCE | R_POST_PLTE | R_PRE_IDAT),
+	RULE('h', 'I', 'S', 'T', R_ONCE | R_POST_PLTE | R_PRE_IDAT),
+	RULE('t', 'R', 'N', 'S', R_ONCE | R_POST_PLTE | R_PRE_IDAT),
+	RULE('p', 'H', 'Y', 's', R_ONCE | R_PRE_IDAT),
+	RULE('s', 'P', 'L', 'T', R_PRE_IDAT),
+	RULE('t', 'I', 'M', 'E', R_ONCE),
+	RULE('e', 'X', 'I', 'f', R_ONCE),
+
+	RULE('o', 'F', 'F', 's', R_ONCE | R_PRE_IDAT),
+	RULE('p', 'C', 'A', 'L', R_ONCE | R_PRE_IDAT),
+	RULE('s', 'C', 'A', 'L', R_ONCE | R_PRE_IDAT),
+	RULE('s', 'T', 'E', 'R', R_ONCE | R_PRE_IDAT),
+
+	RULE('a', 'c', 'T', 'L', R_ONCE | R_PRE_IDAT),
+	RULE('f', 'c', 'T', 'L', R_APNG),
+	RULE('f', 'd', 'A', 'T', R_APNG),
+};
+#pragma GCC diagnostic pop
+
+#define SEEN(o, a, b, c, d)	((o)->seen >> PH(TAG(a, b, c, d)) & 1)
+
+/* checks that only need the chunk type, done if it is the place to stop */
+static void check_type(struct ci_ctx *ctx, const struct ci_chunk *c)
+{
+	const struct rule *r = &rules[PH(c->tag)];
+	struct order *o = &ctx->ord;
+	uint8_t flags = r->tag == c->tag ? r->flags : 0;
+
+	if (ctx->stop == CI_STOP_IDAT && c->tag == TAG_IDAT) {
+		ctx->done = 1;
+		return;
+	}
+
+	if (ctx->table.n == 0 && c->tag != TAG_IHDR)
+		fail(ctx, CI_ERR_ORDER, "first chunk found is not IHDR");
+
+	if (o->state == ORD_IDAT && c->tag != TAG_IDAT)
+		o->state = ORD_TAIL;
+
+	if ((flags & R_ONCE) && (o->seen >> PH(c->tag) & 1))
+		fail(ctx, CI_ERR_ORDER, "%s: more than one", c->type);
+	if ((flags & R_PRE_PLTE) && o->state >= ORD_PLTE)
+		fail(ctx, CI_ERR_ORDER, "%s: after %s", c->type,
+		     o->state == ORD_PLTE ? "PLTE" : "IDAT");
+	if ((flags & R_PRE_IDAT) && o->state >= ORD_IDAT)
+		fail(ctx, CI_ERR_ORDER, "%s: after IDAT", c->type);
+	if ((flags & R_POST_PLTE) && o->state == ORD_HEAD && !o->post_plte[0])
+		memcpy(o->post_plte, c->type, 5);
+	if ((flags & R_APNG) && !SEEN(o, 'a', 'c', 'T', 'L'))
+		fail(ctx, CI_ERR_ORDER, "%s: no acTL before it", c->type);
+
+	if (flags)
+		o->seen |= (uint64_t)1 << PH(c->tag);
+
+	switch (c->tag) {
+	case TAG_PLTE:
+		if (o->post_plte[0])
+			fail(ctx, CI_ERR_ORDER, "PLTE: after %s", o->post_plte);
+		o->state = ORD_PLTE;
+		break;
+
+	case TAG_IDAT:
+		if (o->state == ORD_TAIL)
+			fail(ctx, CI_ERR_ORDER, "IDAT: chunks are not consecutive");
+		if (o->state != ORD_IDAT && ctx->color_type == INDEXED &&
+		    !SEEN(o, 'P', 'L', 'T', 'E') && !ctx->damaged)
+			fail(ctx, CI_ERR_ORDER, "IDAT: no PLTE chunk before it");
+		o->state = ORD_IDAT;
+		break;
+
+	case TAG_FCTL:
+		if (++o->fctl > 1 && o->state < ORD_IDAT)
+			fail(ctx, CI_ERR_ORDER, "fcTL: more than one before IDAT");
+		o->frame = o->state == ORD_TAIL;
+		break;
+
+	case TAG_FDAT:
+		if (o->state < ORD_IDAT)
+			fail(ctx, CI_ERR_ORDER, "fdAT: before IDAT");
+		if (!o->frame && !ctx->damaged)
+			fail(ctx, CI_ERR_ORDER, "fdAT: no fcTL before it");
+		break;
+
+	case TAG_IEND:
+		if (ctx->damaged)
+			break;
+		if (o->state < ORD_IDAT)
+			fail(ctx, CI_ERR_ORDER, "IEND: no IDAT chunk");
+		if (o->has_frames && o->fctl != o->frames)
+			fail(ctx, CI_ERR_ORDER, "IEND: %u fcTL chunks for the "
+			     "%u frames of acTL", o->fctl, o->frames);
+		break;
+	}
+}
+
+
+/*
+ * the image data stream must end with its last chunk, a stream kept
+ * for threads is only inflated now
+ */
+static void end_image(struct ci_ctx *ctx, uint32_t tag)
+{
+	if (ctx->img.state != IDAT_NONE && tag != ctx->img.tag) {
+		if (ctx->img.state == IDAT_OPEN)
+			image_end(ctx, idat_finish(&ctx->img));
+		idat_close(&ctx->img);
+	}
+}
+
+/*
+ * chunks that are not kept whole when they are not all in memory: image
+ * data and chunks nobody decodes bigger than the read window, and any
+ * chunk bigger than MAX_KEEP, which is then not decoded.
+ */
+static int windowed(const struct ci_ctx *ctx, const struct ci_chunk *c)
+{
+	const struct decoder *d;
+	size_t i;
+
+	if (ctx->r.map || c->length <= READ_WINDOW)
+		return 0;
+
+	if (c->length > MAX_KEEP)
+		return 1;
+
+	for (i = 0; i < ctx->ncustom; i++) {
+		if (ctx->custom[i].tag == c->tag)
+			return 0;
+	}
+
+	d = &decoders[PH(c->tag)];
+	return c->tag == TAG_IDAT || c->tag == TAG_FDAT ||
+	       d->tag != c->tag || !d->fn;
+}
+
+/*
+ * image data that is not even CRC'd is not read, but for the fdAT
+ * sequence number. it goes through the window path, without the CRC.
+ */
+static int skipped(const struct ci_ctx *ctx, const struct ci_chunk *c)
+{
+	return ctx->verify < CI_VERIFY_CRC &&
+	       (c->tag == TAG_IDAT || (c->tag == TAG_FDAT && c->length >= 4));
+}
+
+/*
+ * a windowed chunk is CRC'd and fed to the image stream a piece at a
+ * time, by window_data(). its fields still wait for the CRC.
+ */
+static void window_begin(struct ci_ctx *ctx, const struct ci_chunk *c)
+{
+	struct part *w = &ctx->part;
+
+	memset(w, 0, sizeof(*w));
+	w->c = *c;
+	w->left = c->length;
+	w->skip = skipped(ctx, c);
+	w->crc = !w->skip && ctx->verify >= CI_VERIFY_META;
+	if (w->crc)
+		w->check = pd_crc32(0u, c->type, 4);
+	w->image = !w->skip && ctx->verify >= CI_VERIFY_INFLATE &&
+		   !ctx->damaged && (c->tag == TAG_IDAT || c->tag == TAG_FDAT);
+
+	if (w->image) {
+		end_image(ctx, c->tag);
+		image_begin(ctx, c->tag);
+	}
+	w->nhdr = ctx->img.nhdr;
+	w->ret = IDAT_OK;
+}
+
+static void window_data(struct ci_ctx *ctx, const uint8_t *p, uint32_t n)
+{
+	struct part *w = &ctx->part;
+	uint32_t off, k;
+
+	if (w->crc)
+		w->check = pd_crc32(w->check, p, n);
+	off = w->c.length - w->left;
+	w->left -= n;
+
+	/* fdAT: the sequence number first */
+	if (w->c.tag == TAG_FDAT && off < 4) {
+		k = 4 - off < n ? 4 - off : n;
+		memcpy(w->seq + off, p, k);
+		p += k;
+		n -= k;
+	}
+
+	if (!w->image)
+		return;
+
+	if (w->ret == IDAT_OK && (n > 0 || w->left == 0)) {
+		w->ret = idat_feed(&ctx->img, p, n, !w->fed);
+		w->fed = 1;
+	}
+}
+
+static void window_end(struct ci_ctx *ctx, uint32_t chunk_crc)
+{
+	struct part *w = &ctx->part;
+	struct ci_chunk *c = &w->c;
+	const struct decoder *d;
+
+	if (w->crc && chunk_crc != w->check)
+		fail(ctx, CI_ERR_CRC, "%s: corrupted crc", c->type);
+
+	end_image(ctx, c->tag);
+
+	c->crc = chunk_crc;
+	table_add(ctx, c, (w->crc || ctx->checked ? CI_CHUNK_CRC : 0) |
+		  (w->skip ? CI_CHUNK_SKIPPED : CI_CHUNK_WINDOWED));
+	emit(ctx, chunk, c);
+
+	d = &decoders[PH(c->tag)];
+	if (c->tag == TAG_IDAT) {
+		note(ctx, "Image data");
+	} else if (c->tag == TAG_FDAT) {
+		apng_sequence(ctx, "fdAT", be32(w->seq));
+		field(ctx, "Sequence", "%u", be32(w->seq));
+	} else if (d->tag == c->tag && d->fn) {
+		note(ctx, "Not decoded, too big to keep");
+	} else {
+		note(ctx, ".....");
+	}
+	if (w->image)
+		image_report(ctx, w->nhdr, w->ret);
+}
+
+/* pull a windowed chunk */
+static void handle_window(struct ci_ctx *ctx, struct ci_chunk *c)
+{
+	struct reader *r = &ctx->r;
+	const uint8_t *p;
+	uint32_t chunk_crc, n;
+
+	window_begin(ctx, c);
+
+	if (ctx->part.skip) {
+		n = c->tag == TAG_FDAT ? 4 : 0;
+		p = reader_get(r, n);
+		if (!p || !reader_skip(r, c->length - n))
+			fail(ctx, CI_ERR_IO, "failed to read chunk data");
+
+		window_data(ctx, p, n);
+		ctx->part.left = 0;
+	}
+
+	while (ctx->part.left > 0) {
+		n = ctx->part.left < READ_WINDOW ? ctx->part.left : READ_WINDOW;
+		p = reader_get(r, n);
+		if (!p)
+			fail(ctx, CI_ERR_IO, "failed to read chunk data");
+
+		window_data(ctx, p, n);
+	}
+
+	chunk_crc = reader_u32(r);
+	if (errno)
+		fail(ctx, CI_ERR_IO, "failed to get chunk crc");
+
+	window_end(ctx, chunk_crc);
+	*c = ctx->part.c;
+}
+
+/* check and decode one chunk whose bytes are all in memory */
+static void handle_chunk(struct ci_ctx *ctx, struct ci_chunk *c,
+			 uint32_t chunk_crc)
+{
+	uint32_t check;
+	int crc = ctx->verify >= CI_VERIFY_META || ctx->checked;
+
+	/* crc chunk type and data to check */
+	if (crc && !ctx->checked) {
+		check = pd_crc32(0u, c->type, 4);
+		if (c->length > 0)
+			check = pd_crc32(check, c->data, c->length);
+
+		if (chunk_crc != check)
+			fail(ctx, CI_ERR_CRC, "%s: corrupted crc", c->type);
+	}
+
+	end_image(ctx, c->tag);
+
+	c->crc = chunk_crc;
+	table_add(ctx, c, crc ? CI_CHUNK_CRC : 0);
+	emit(ctx, chunk, c);
+
+	decode_chunk_data(ctx, c);
+
+	if (c->tag == TAG_IEND || ctx->stop == CI_STOP_IHDR)
+		ctx->done = 1;
+}
+
+/*
+ * recovery
+ *
+ * the chunk at the read position is checked whole before anything is
+ * done with it. a damaged one is skipped up to the next plausible chunk
+ * start: a length that fits, a type of four letters, the third one upper
+ * case, and a matching CRC. the letters are looked for 16 bytes at a
+ * time, which leaves few places to CRC.
+ */
+static int letter(uint8_t c)
+{
+	return (uint8_t)((c | 0x20) - 'a') < 26;
+}
+
+/* CI_OK if a whole chunk is at p, else what is wrong with it */
+static int whole_chunk(const uint8_t *p, size_t left)
+{
+	uint32_t len;
+
+	if (left < 12)
+		return CI_ERR_IO;
+
+	len = be32(p);
+	if (len > MAX_LENGTH)
+		return CI_ERR_LENGTH;
+	if (len > left - 12)
+		return CI_ERR_IO;
+	if (pd_crc32(0u, p + 4, len + 4) != be32(p + 8 + len))
+		return CI_ERR_CRC;
+
+	return CI_OK;
+}
+
+static int plausible(const uint8_t *p, size_t left)
+{
+	return left >= 12 && letter(p[4]) && letter(p[5]) && letter(p[6]) &&
+	       letter(p[7]) && !(p[6] & 0x20) && whole_chunk(p, left) == CI_OK;
+}
+
+#ifdef __SSE2__
+/* bit i set if q[i] is a letter */
+static uint32_t letters16(const uint8_t *q)
+{
+	__m128i x;
+
+	x = _mm_loadu_si128((const __m128i *)q);
+	x = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)),
+			 _mm_set1_epi8('a'));
+	x = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(25)), x);
+	return _mm_movemask_epi8(x);
+}
+#endif
+
+/* offset of the first plausible chunk in p[0..n), n if there is none */
+static size_t find_chunk(const uint8_t *p, size_t n)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	uint32_t m, cand;
+
+	/* types at i + 4, the next 16 bytes for the ones that straddle */
+	for (; i + 36 <= n; i += 16) {
+		m = letters16(p + i + 4) | letters16(p + i + 20) << 16;
+		cand = m & m >> 1 & m >> 2 & m >> 3 & 0xffff;
+
+		for (; cand; cand &= cand - 1) {
+			if (plausible(p + i + __builtin_ctz(cand),
+				      n - i - __builtin_ctz(cand)))
+				return i + __builtin_ctz(cand);
+		}
+	}
+#endif
+
+	for (; i + 12 <= n; i++) {
+		if (plausible(p + i, n - i))
+			return i;
+	}
+
+	return n;
+}
+
+/* skip what is damaged at the read position, if a good chunk follows */
+static void recover(struct ci_ctx *ctx)
+{
+	static const char *what[] = {
+		[CI_ERR_IO] = "chunk goes past the end of the file",
+		[CI_ERR_LENGTH] = "chunk length out of range",
+		[CI_ERR_CRC] = "corrupted crc"
+	};
+	struct reader *r = &ctx->r;
+	struct ci_damage d;
+	size_t left, skip;
+	int err;
+
+	/* not even a chunk header left: it fails the usual way */
+	left = r->map_len - r->pos;
+	if (left < 12) {
+		ctx->checked = 0;
+		return;
+	}
+
+	err = whole_chunk(r->map + r->pos, left);
+	ctx->checked = err == CI_OK;
+	if (err == CI_OK)
+		return;
+
+	/* nothing good after it: it fails the usual way */
+	skip = 1 + find_chunk(r->map + r->pos + 1, left - 1);
+	if (skip == left)
+		return;
+
+	d.error = err;
+	d.msg = what[err];
+	d.offset = r->pos;
+	d.length = skip;
+	emit(ctx, damage, &d);
+
+	if (ctx->ndamage++ == 0)
+		ctx->damage_err = err;
+
+	/* the image may have lost data, it can't be inflated anymore */
+	idat_close(&ctx->img);
+	ctx->damaged = 1;
+
+	r->pos += skip;
+	ctx->checked = 1;
+	ctx->resync = 1;
+}
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static pthread_once_t filter_once = PTHREAD_ONCE_INIT;
+static pthread_once_t utf8_once = PTHREAD_ONCE_INIT;
+
+struct ci_ctx *ci_new(const struct ci_callbacks *cb, void *user)
+{
+	struct ci_ctx *ctx;
+
+	pthread_once(&crc_once, crc32_init);
+	pthread_once(&filter_once, filter_init);
+	pthread_once(&utf8_once, utf8_init);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	if (cb)
+		ctx->cb = *cb;
+	ctx->user = user;
+	ctx->verify = CI_VERIFY_INFLATE;
+	ctx->threads = 1;
+	ctx->inflate_max = 1 << 20;
+	ctx->fd = -1;
+
+	return ctx;
+}
+
+void ci_free(struct ci_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	reader_close(&ctx->r);
+	idat_close(&ctx->img);
+	if (ctx->meta_z_ready)
+		inflateEnd(&ctx->meta_z);
+	if (ctx->fd >= 0)
+		close(ctx->fd);
+
+	while (ctx->arena) {
+		struct arena_block *b = ctx->arena;
+
+		ctx->arena = b->next;
+		free(b);
+	}
+
+	free(ctx->table.tag);
+	free(ctx->table.offset);
+	free(ctx->table.length);
+	free(ctx->table.crc);
+	free(ctx->table.flags);
+	free(ctx->pend);
+	free(ctx->custom);
+	free(ctx);
+}
+
+int ci_register(struct ci_ctx *ctx, const char *type, ci_decoder fn,
+		void *arg)
+{
+	struct custom *tmp;
+	uint32_t tag;
+	size_t i;
+
+	if (!type || strlen(type) != 4 || !fn)
+		return CI_ERR_USAGE;
+
+	tag = be32((const uint8_t *)type);
+	for (i = 0; i < ctx->ncustom; i++) {
+		if (ctx->custom[i].tag == tag)
+			break;
+	}
+
+	if (i == ctx->ncustom) {
+		tmp = realloc(ctx->custom, (i + 1) * sizeof(*tmp));
+		if (!tmp)
+			return CI_ERR_NOMEM;
+
+		ctx->custom = tmp;
+		ctx->ncustom++;
+	}
+
+	ctx->custom[i].tag = tag;
+	ctx->custom[i].fn = fn;
+	ctx->custom[i].arg = arg;
+	return CI_OK;
+}
+
+void ci_field(struct ci_ctx *ctx, const char *key, const char *msg, ...)
+{
+	va_list ap;
+	size_t n;
+
+	if (!ctx->cb.field)
+		return;
+
+	va_start(ap, msg);
+	n = format_value(ctx, msg, ap);
+	va_end(ap);
+
+	send_field(ctx, key ? CI_FIELD_VALUE : CI_FIELD_NOTE, key, 0,
+		   ctx->fmt, n);
+}
+
+/*
+ * the signature and IHDR in one read, 0 if IHDR is not 13 bytes long:
+ * the file is then read the usual way to tell what is wrong
+ */
+static int open_head(struct ci_ctx *ctx, const char *path)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		fail(ctx, CI_ERR_IO, "failed to open file");
+
+	n = pread(fd, ctx->head, sizeof(ctx->head), 0);
+	close(fd);
+	if (n < 0)
+		fail(ctx, CI_ERR_IO, "failed to read file");
+
+	if (n >= 12 && be32(ctx->head + 8) != 13)
+		return 0;
+
+	reader_open_mem(&ctx->r, ctx->head, n);
+	return 1;
+}
+
+int ci_open_file(struct ci_ctx *ctx, const char *path)
+{
+	if (ctx->mode != MODE_NONE)
+		return CI_ERR_USAGE;
+
+	ctx->mode = MODE_PULL;
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	errno = 0;
+
+	if (ctx->stop != CI_STOP_IHDR || !open_head(ctx, path)) {
+		ctx->fd = open(path, O_RDONLY);
+		if (ctx->fd < 0)
+			fail(ctx, CI_ERR_IO, "failed to open file");
+
+		if (!reader_open(&ctx->r, ctx->fd, ctx->stop == CI_STOP_IEND,
+				 ctx->threads > 1))
+			fail(ctx, CI_ERR_NOMEM, "out of memory");
+	}
+	errno = 0;
+
+	if (!png_ok(&ctx->r))
+		fail(ctx, CI_ERR_SIGNATURE, "not a valid PNG file");
+
+	return CI_OK;
+}
+
+int ci_open_fd(struct ci_ctx *ctx, int fd)
+{
+	if (ctx->mode != MODE_NONE)
+		return CI_ERR_USAGE;
+
+	ctx->mode = MODE_PULL;
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	errno = 0;
+	if (!reader_open(&ctx->r, fd, ctx->stop == CI_STOP_IEND,
+			 ctx->threads > 1))
+		fail(ctx, CI_ERR_NOMEM, "out of memory");
+	errno = 0;
+
+	if (!png_ok(&ctx->r))
+		fail(ctx, CI_ERR_SIGNATURE, "not a valid PNG file");
+
+	return CI_OK;
+}
+
+int ci_open_mem(struct ci_ctx *ctx, const void *buf, size_t len)
+{
+	if (ctx->mode != MODE_NONE)
+		return CI_ERR_USAGE;
+
+	ctx->mode = MODE_PULL;
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	errno = 0;
+	reader_open_mem(&ctx->r, buf, len);
+
+	if (!png_ok(&ctx->r))
+		fail(ctx, CI_ERR_SIGNATURE, "not a valid PNG file");
+
+	return CI_OK;
+}
+
+int ci_next(struct ci_ctx *ctx, struct ci_chunk *chunk)
+{
+	struct reader *r;
+	struct ci_chunk c;
+	const uint8_t *p;
+
+	if (ctx->mode != MODE_PULL)
+		return CI_ERR_USAGE;
+
+	if (ctx->error)
+		return ctx->error;
+
+	if (ctx->done)
+		return CI_END;
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	r = &ctx->r;
+	if (ctx->table.n > 0 && reader_eof(r))
+		fail(ctx, CI_ERR_IO, "failed to read chunk");
+
+	if (ctx->recover && r->map)
+		recover(ctx);
+
+	memset(&c, 0, sizeof(c));
+	errno = 0;
+
+	/* read chunk length */
+	c.length = reader_u32(r);
+	if (errno)
+		fail(ctx, CI_ERR_IO, "failed to get chunk length");
+
+	if (c.length > MAX_LENGTH)
+		fail(ctx, CI_ERR_LENGTH, "chunk length out of range: (%u)",
+		     c.length);
+
+	/* get current chunk offset */
+	c.offset = r->pos;
+
+	/* read chunk type */
+	if (!reader_read(r, c.type, 4))
+		fail(ctx, CI_ERR_IO, "failed to get chunk type");
+
+	c.tag = be32((const uint8_t *)c.type);
+
+	check_type(ctx, &c);
+	if (ctx->done)
+		return CI_END;
+
+	if (skipped(ctx, &c) || windowed(ctx, &c)) {
+		handle_window(ctx, &c);
+	} else {
+		/* chunk data and crc, together so that the data stays put */
+		p = reader_get(r, (size_t)c.length + 4);
+		if (!p)
+			fail(ctx, CI_ERR_IO, r->got < c.length ?
+			     "failed to read chunk data" :
+			     "failed to get chunk crc");
+
+		c.data = c.length > 0 ? p : NULL;
+		handle_chunk(ctx, &c, be32(p + c.length));
+	}
+	ctx->checked = 0;
+
+	if (chunk)
+		*chunk = c;
+
+	return CI_OK;
+}
+
+int ci_push(struct ci_ctx *ctx, const void *buf, size_t len)
+{
+	struct ci_chunk c;
+	const uint8_t *p;
+	size_t n, k, need;
+	int whole;
+
+	if (ctx->mode == MODE_NONE)
+		ctx->mode = MODE_PUSH;
+
+	if (ctx->mode != MODE_PUSH)
+		return CI_ERR_USAGE;
+
+	if (ctx->error)
+		return ctx->error;
+
+	if (ctx->done)
+		return CI_END;  /* anything after IEND is ignored */
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	errno = 0;
+
+	if (len > ctx->pend_cap - ctx->pend_len) {
+		size_t cap = ctx->pend_cap ? ctx->pend_cap : 4096;
+		uint8_t *tmp;
+
+		while (cap - ctx->pend_len < len)
+			cap *= 2;
+
+		tmp = realloc(ctx->pend, cap);
+		if (!tmp)
+			fail(ctx, CI_ERR_NOMEM, "failed to buffer input");
+
+		ctx->pend = tmp;
+		ctx->pend_cap = cap;
+	}
+
+	memcpy(ctx->pend + ctx->pend_len, buf, len);
+	ctx->pend_len += len;
+
+	p = ctx->pend;
+	n = ctx->pend_len;
+
+	if (!ctx->sig_ok) {
+		if (n < 8)
+			return CI_OK;
+
+		if (memcmp(p, "\x89\x50\x4e\x47\x0d\x0a\x1a\x0a", 8)) {
+			errno = EINVAL;
+			fail(ctx, CI_ERR_SIGNATURE, "not a valid PNG file");
+		}
+
+		ctx->sig_ok = 1;
+		p += 8;
+		n -= 8;
+	}
+
+	/* every chunk that is complete, windowed ones as they come */
+	while (!ctx->done && n > 0) {
+		if (ctx->in_part) {
+			if (ctx->part.left > 0) {
+				k = n < ctx->part.left ? n : ctx->part.left;
+				window_data(ctx, p, k);
+				p += k;
+				n -= k;
+				continue;
+			}
+
+			if (n < 4)
+				break;
+
+			window_end(ctx, be32(p));
+			ctx->in_part = 0;
+			p += 4;
+			n -= 4;
+			continue;
+		}
+
+		if (n < 8)
+			break;
+
+		memset(&c, 0, sizeof(c));
+		c.length = be32(p);
+		if (c.length > MAX_LENGTH)
+			fail(ctx, CI_ERR_LENGTH, "chunk length out of range: (%u)",
+			     c.length);
+
+		memcpy(c.type, p + 4, 4);
+		c.tag = be32(p + 4);
+		c.offset = ctx->pend_off + (p - ctx->pend) + 4;
+		whole = !skipped(ctx, &c) && !windowed(ctx, &c);
+		need = whole ? (size_t)c.length + 12 : 8;
+
+		/* the order is checked once, when the chunk can be taken */
+		if (n < need && (ctx->stop != CI_STOP_IDAT || c.tag != TAG_IDAT))
+			break;
+
+		check_type(ctx, &c);
+		if (ctx->done)
+			break;
+
+		if (!whole) {
+			window_begin(ctx, &c);
+			ctx->in_part = 1;
+			p += 8;
+			n -= 8;
+			continue;
+		}
+
+		c.data = c.length > 0 ? p + 8 : NULL;
+		handle_chunk(ctx, &c, be32(p + 8 + c.length));
+
+		p += need;
+		n -= need;
+	}
+
+	ctx->pend_off += p - ctx->pend;
+	memmove(ctx->pend, p, n);
+	ctx->pend_len = n;
+
+	return ctx->done ? CI_END : CI_OK;
+}
+
+int ci_push_end(struct ci_ctx *ctx)
+{
+	if (ctx->mode != MODE_PUSH)
+		return CI_ERR_USAGE;
+
+	if (ctx->error || ctx->done)
+		return ctx->error;
+
+	if (setjmp(ctx->fail))
+		return ctx->error;
+
+	errno = EIO;
+	fail(ctx, CI_ERR_IO, ctx->sig_ok ? "failed to read chunk" :
+				       "not a valid PNG file");
+}
+
+int ci_check_file(struct ci_ctx *ctx, const char *path)
+{
+	int err;
+
+	err = ci_open_file(ctx, path);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+
+	return err == CI_END ? ctx->damage_err : err;
+}
+
+int ci_set_verify(struct ci_ctx *ctx, enum ci_verify level)
+{
+	if (level < CI_VERIFY_NONE || level > CI_VERIFY_FULL)
+		return CI_ERR_USAGE;
+
+	ctx->verify = level;
+	return CI_OK;
+}
+
+int ci_set_threads(struct ci_ctx *ctx, unsigned threads)
+{
+	if (threads < 1)
+		return CI_ERR_USAGE;
+
+	ctx->threads = threads;
+	return CI_OK;
+}
+
+int ci_set_inflate_limits(struct ci_ctx *ctx, uint64_t max, unsigned ratio)
+{
+	ctx->inflate_max = max;
+	ctx->inflate_ratio = ratio;
+	return CI_OK;
+}
+
+int ci_set_recover(struct ci_ctx *ctx, int on)
+{
+	ctx->recover = !!on;
+	return CI_OK;
+}
+
+int ci_set_stop(struct ci_ctx *ctx, enum ci_stop stop)
+{
+	if (stop < CI_STOP_IEND || stop > CI_STOP_IDAT || ctx->mode != MODE_NONE)
+		return CI_ERR_USAGE;
+
+	ctx->stop = stop;
+	return CI_OK;
+}
+
+uint32_t ci_chunk_count(const struct ci_ctx *ctx)
+{
+	return ctx->table.n;
+}
+
+void ci_chunk_table(const struct ci_ctx *ctx, struct ci_table *t)
+{
+	t->count = ctx->table.n;
+	t->tag = ctx->table.tag;
+	t->offset = ctx->table.offset;
+	t->length = ctx->table.length;
+	t->crc = ctx->table.crc;
+	t->flags = ctx->table.flags;
+}
+
+uint32_t ci_damage_count(const struct ci_ctx *ctx)
+{
+	return ctx->ndamage;
+}
+
+const char *ci_errmsg(const struct ci_ctx *ctx)
+{
+	return ctx->err;
+}
+
+const char *ci_strerror(int err)
+{
+	static const char *str[] = {
+		[CI_OK] = "no error",
+		[CI_END] = "end of PNG stream",
+		[CI_ERR_IO] = "read error",
+		[CI_ERR_NOMEM] = "out of memory",
+		[CI_ERR_SIGNATURE] = "not a PNG file",
+		[CI_ERR_LENGTH] = "chunk length out of range",
+		[CI_ERR_CRC] = "corrupted chunk",
+		[CI_ERR_ORDER] = "chunk out of order",
+		[CI_ERR_CHUNK] = "invalid chunk",
+		[CI_ERR_USAGE] = "invalid use of the API"
+	};
+
+	if (err < 0 || (size_t)err >= sizeof(str) / sizeof(str[0]))
+		return "unknown error";
+
+	return str[err];
+}
+
+/* private util functions */
+static uint32_t reader_u32(struct reader *r)
+{
+	uint32_t ret;
+
+	ret = 0;
+	if (!reader_read(r, &ret, 4))
+		errno = EIO;
+
+	return __builtin_bswap32(ret);
+}
+
+/*
+ * length of the keyword or name at data, its printable bytes up to 79
+ * within len. *used is that and the separator after it, which is then
+ * past len if there is none.
+ */
+static uint32_t keyword_len(const uint8_t *data, uint32_t len, uint32_t *used)
+{
+	uint32_t i, max;
+
+	max = len < 79 ? len : 79;
+	for (i = 0; i < max && data[i] && valid_keyword(data[i]); i++)
+		;
+
+	*used = i + 1;
+	return i;
+}
+
+/* grow each array to n, they stay as they are if one can't be */
+#define GROW(a, n)					\
+	do {						\
+		void *tmp_ = realloc(a, (n) * sizeof(*(a)));	\
+		if (!tmp_)				\
+			fail(ctx, CI_ERR_NOMEM, "out of memory");	\
+		a = tmp_;				\
+	} while (0)
+
+/* record a checked chunk, which gives it its index */
+static void table_add(struct ci_ctx *ctx, struct ci_chunk *c, uint8_t flags)
+{
+	struct chunk_table *t = &ctx->table;
+	uint32_t cap;
+
+	if (t->n == t->cap) {
+		if (t->cap == UINT32_MAX)
+			fail(ctx, CI_ERR_NOMEM, "too many chunks");
+		cap = t->cap == 0 ? 256 :
+		      t->cap > UINT32_MAX / 2 ? UINT32_MAX : t->cap * 2;
+		GROW(t->tag, cap);
+		GROW(t->offset, cap);
+		GROW(t->length, cap);
+		GROW(t->crc, cap);
+		GROW(t->flags, cap);
+		t->cap = cap;
+	}
+
+	if (ctx->resync)
+		flags |= CI_CHUNK_RESYNC;
+	ctx->resync = 0;
+
+	c->index = t->n++;
+	t->tag[c->index] = c->tag;
+	t->offset[c->index] = c->offset;
+	t->length[c->index] = c->length;
+	t->crc[c->index] = c->crc;
+	t->flags[c->index] = flags;
+}
+
+#undef GROW
+
+/* n bytes of scratch memory, valid until the next chunk */
+static void *arena_alloc(struct ci_ctx *ctx, size_t n)
+{
+	struct arena_block *b, **link;
+	size_t size;
+	void *p;
+
+	n = (n + 15) & ~(size_t)15;
+	for (b = ctx->arena_at; b && b->size - b->used < n; b = b->next)
+		;
+
+	if (!b) {
+		size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+		b = malloc(sizeof(*b) + size);
+		if (!b)
+			fail(ctx, CI_ERR_NOMEM, "out of memory");
+
+		b->size = size;
+		b->used = 0;
+		b->next = NULL;
+		for (link = &ctx->arena; *link; link = &(*link)->next)
+			;
+		*link = b;
+	}
+
+	ctx->arena_at = b;
+	p = b->data + b->used;
+	b->used += n;
+	return p;
+}
+
+static void arena_reset(struct ci_ctx *ctx)
+{
+	struct arena_block *b;
+
+	for (b = ctx->arena; b; b = b->next)
+		b->used = 0;
+	ctx->arena_at = ctx->arena;
+}
+
+/* the printable bytes of src, in runs, nul terminated: the count */
+static size_t copy_printable(char *dst, const uint8_t *src, size_t len)
+{
+	size_t i, k, n;
+
+	for (i = n = 0; i < len; i = k) {
+		for (k = i; k < len && valid_keyword(src[k]); k++)
+			;
+		memcpy(dst + n, src + i, k - i);
+		n += k - i;
+
+		while (k < len && !valid_keyword(src[k]))
+			k++;
+	}
+
+	dst[n] = 0;
+	return n;
+}
+
+/* copy_printable() for checked UTF-8: all but the control bytes */
+static size_t copy_utf8(char *dst, const uint8_t *src, size_t len)
+{
+	size_t i, k, n;
+
+	for (i = n = 0; i < len; i = k) {
+		for (k = i; k < len && src[k] >= 0x20 && src[k] != 0x7f; k++)
+			;
+		memcpy(dst + n, src + i, k - i);
+		n += k - i;
+
+		while (k < len && (src[k] < 0x20 || src[k] == 0x7f))
+			k++;
+	}
+
+	dst[n] = 0;
+	return n;
+}
+
+static void fail(struct ci_ctx *ctx, int error, const char *msg, ...)
+{
+	va_list ap;
+	int n, saved;
+
+	saved = errno;
+
+	va_start(ap, msg);
+	n = vsnprintf(ctx->err, sizeof(ctx->err), msg, ap);
+	va_end(ap);
+
+	if (saved && n >= 0 && (size_t)n < sizeof(ctx->err))
+		snprintf(ctx->err + n, sizeof(ctx->err) - n, " (%s)",
+			 strerror(saved));
+
+	ctx->error = error;
+	longjmp(ctx->fail, 1);
+}
+
+static void send_field(struct ci_ctx *ctx, enum ci_field_kind kind,
+		       const char *key, uint32_t index,
+		       const char *value, size_t len)
+{
+	struct ci_field f;
+
+	f.kind = kind;
+	f.key = key;
+	f.value = value;
+	f.value_len = len;
+	f.index = index;
+
+	ctx->cb.field(ctx->user, &f);
+}
+
+static size_t format_value(struct ci_ctx *ctx, const char *msg, va_list ap)
+{
+	int n;
+
+	n = vsnprintf(ctx->fmt, sizeof(ctx->fmt), msg, ap);
+	if (n < 0)
+		n = 0;
+	else if ((size_t)n >= sizeof(ctx->fmt))
+		n = sizeof(ctx->fmt) - 1;
+
+	return n;
+}
+
+static void field(struct ci_ctx *ctx, const char *key, const char *msg, ...)
+{
+	va_list ap;
+	size_t n;
+
+	if (!ctx->cb.field)
+		return;
+
+	va_start(ap, msg);
+	n = format_value(ctx, msg, ap);
+	va_end(ap);
+
+	send_field(ctx, CI_FIELD_VALUE, key, 0, ctx->fmt, n);
+}
+
+/* value is nul terminated */
+static void field_text(struct ci_ctx *ctx, const char *key,
+		       const char *value, size_t len)
+{
+	if (ctx->cb.field)
+		send_field(ctx, CI_FIELD_VALUE, key, 0, value, len);
+}
+
+static void note(struct ci_ctx *ctx, const char *msg, ...)
+{
+	va_list ap;
+	size_t n;
+
+	if (!ctx->cb.field)
+		return;
+
+	va_start(ap, msg);
+	n = format_value(ctx, msg, ap);
+	va_end(ap);
+
+	send_field(ctx, CI_FIELD_NOTE, NULL, 0, ctx->fmt, n);
+}
+
+static void entry(struct ci_ctx *ctx, uint32_t index, const char *msg, ...)
+{
+	va_list ap;
+	size_t n;
+
+	if (!ctx->cb.field)
+		return;
+
+	va_start(ap, msg);
+	n = format_value(ctx, msg, ap);
+	va_end(ap);
+
+	send_field(ctx, CI_FIELD_ENTRY, NULL, index, ctx->fmt, n);
+}
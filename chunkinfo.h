@@ -0,0 +1,367 @@
+/*
+ * libchunkinfo - decode and check PNG chunks
+ *
+ * A context checks one PNG stream. Chunks can be pulled one at a time
+ * with ci_next() from a file or a memory buffer, or the stream can be
+ * pushed in pieces of any size with ci_push(). Either way the decoded
+ * content of each chunk is delivered through the callbacks, and every
+ * problem is returned as an error code, the library never exits.
+ *
+ * A context is not thread-safe, but any number of contexts can be used
+ * at the same time from different threads.
+ */
+
+#ifndef CHUNKINFO_H
+#define CHUNKINFO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(CHUNKINFO_BUILD) && defined(__GNUC__)
+#define CI_API __attribute__((visibility("default")))
+#else
+#define CI_API
+#endif
+
+enum ci_error {
+	CI_OK = 0,
+	CI_END,            /* IEND was read, no more chunks */
+	CI_ERR_IO,         /* read error or unexpected end of file */
+	CI_ERR_NOMEM,
+	CI_ERR_SIGNATURE,  /* not a PNG file */
+	CI_ERR_LENGTH,     /* chunk length out of range */
+	CI_ERR_CRC,        /* corrupted chunk */
+	CI_ERR_ORDER,      /* chunk in the wrong place */
+	CI_ERR_CHUNK,      /* invalid chunk content */
+	CI_ERR_USAGE       /* API misuse, e.g. ci_next() on a push context */
+};
+
+enum ci_color_type {
+	CI_GRAY = 0,
+	CI_RGB = 2,
+	CI_INDEXED = 3,
+	CI_GRAY_ALPHA = 4,
+	CI_RGB_ALPHA = 6
+};
+
+struct ci_chunk {
+	char type[5];         /* nul terminated */
+	uint32_t tag;         /* type as a big-endian number, 'IHDR' */
+	uint32_t length;
+	uint32_t crc;
+	uint64_t offset;      /* file offset of the chunk type */
+	const uint8_t *data;  /* length bytes, valid until the next call, NULL
+				 if the chunk was read a window at a time
+				 or skipped, see ci_set_verify() */
+	uint32_t index;       /* 0 for IHDR */
+};
+
+/*
+ * Human readable description of a chunk, one field at a time:
+ *
+ *   CI_FIELD_VALUE   key = value
+ *   CI_FIELD_NOTE    value only
+ *   CI_FIELD_ENTRY   entry number index of a list (palette, histogram...)
+ */
+enum ci_field_kind {
+	CI_FIELD_VALUE,
+	CI_FIELD_NOTE,
+	CI_FIELD_ENTRY
+};
+
+struct ci_field {
+	enum ci_field_kind kind;
+	const char *key;    /* CI_FIELD_VALUE only */
+	const char *value;  /* nul terminated */
+	size_t value_len;
+	uint32_t index;     /* CI_FIELD_ENTRY only */
+};
+
+struct ci_ihdr {
+	uint32_t width, height;
+	uint8_t bit_depth, color_type;
+	uint8_t compression, filter, interlace;
+	uint8_t channels;        /* samples per pixel */
+	uint8_t bits_per_pixel;
+};
+
+struct ci_plte {
+	uint32_t entries;
+	const uint8_t (*rgb)[3];
+};
+
+struct ci_time {
+	uint16_t year;
+	uint8_t month, day, hour, minute, second;
+};
+
+struct ci_phys {
+	uint32_t x, y;
+	uint8_t unit;  /* 0 = unknown, 1 = meter */
+};
+
+struct ci_chrm {
+	uint32_t white_x, white_y;
+	uint32_t red_x, red_y;
+	uint32_t green_x, green_y;
+	uint32_t blue_x, blue_y;  /* all times 100000 */
+};
+
+/* tEXt, zTXt and iTXt, strings are not nul terminated */
+struct ci_text {
+	char type[5];
+	const char *keyword;
+	size_t keyword_len;
+	uint8_t compressed;
+	uint8_t method;
+	const char *language;     /* iTXt only */
+	size_t language_len;
+	const char *translated;   /* iTXt only */
+	size_t translated_len;
+	const uint8_t *text;      /* raw, still compressed if compressed */
+	size_t text_len;
+};
+
+struct ci_iccp {
+	const char *name;
+	size_t name_len;
+	uint8_t method;
+	const uint8_t *profile;  /* compressed */
+	size_t profile_len;
+};
+
+struct ci_actl {
+	uint32_t frames;
+	uint32_t plays;  /* 0 = infinite */
+};
+
+struct ci_fctl {
+	uint32_t sequence;
+	uint32_t width, height;
+	uint32_t x_offset, y_offset;
+	uint16_t delay_num, delay_den;
+	uint8_t dispose, blend;
+};
+
+/* an IDAT or fdAT stream, once it was checked */
+struct ci_image {
+	char type[5];
+	uint32_t chunks;
+	uint64_t compressed, decompressed;
+	uint32_t adler32;
+	uint32_t pieces;      /* inflated in parallel, 0 if in one go */
+	uint64_t rows;        /* CI_VERIFY_FULL only, like what follows */
+	uint32_t pixels_crc;  /* CRC-32 of the unfiltered rows, pass by pass */
+	uint64_t filters[5];  /* rows per filter type, None to Paeth */
+	uint8_t deinterlaced;
+	uint32_t raster_crc;  /* of the final rows: pixels_crc if not Adam7 */
+};
+
+/*
+ * a piece of zTXt, iTXt or iCCP content as it is inflated, after the
+ * text or iccp callback of its chunk. see ci_set_inflate_limits().
+ */
+struct ci_inflated {
+	char type[5];
+	const uint8_t *data;  /* valid during the callback */
+	size_t len;
+	uint64_t offset;      /* of data in the inflated content */
+	uint8_t last;         /* the end, or a limit was reached */
+	uint8_t stopped;      /* at a limit, the rest is not inflated */
+};
+
+/* bytes skipped to get past a damaged chunk, see ci_set_recover() */
+struct ci_damage {
+	int error;        /* what was wrong with it, CI_ERR_* */
+	const char *msg;
+	uint64_t offset;  /* file offset of its length */
+	uint64_t length;  /* up to the next good chunk */
+};
+
+/* how far each chunk is checked, every level adds to the one before */
+enum ci_verify {
+	CI_VERIFY_NONE,     /* chunk structure and metadata, no CRC */
+	CI_VERIFY_META,     /* CRCs, but image data is seeked over */
+	CI_VERIFY_CRC,      /* CRCs of image data too */
+	CI_VERIFY_INFLATE,  /* inflate, check Adler-32 and size (default) */
+	CI_VERIFY_FULL      /* and unfilter every scanline */
+};
+
+/* where to stop, for callers that only want the metadata */
+enum ci_stop {
+	CI_STOP_IEND,  /* the whole stream (default) */
+	CI_STOP_IHDR,  /* CI_END after IHDR, a file is read in one pread() */
+	CI_STOP_IDAT   /* CI_END at the first IDAT, before its data is read */
+};
+
+/*
+ * All callbacks are optional. chunk is called once the CRC of a chunk
+ * was checked and before it is decoded, then its fields and its typed
+ * callback follow.
+ */
+struct ci_callbacks {
+	void (*chunk)(void *user, const struct ci_chunk *c);
+	void (*field)(void *user, const struct ci_field *f);
+	void (*ihdr)(void *user, const struct ci_ihdr *ihdr);
+	void (*plte)(void *user, const struct ci_plte *plte);
+	void (*time)(void *user, const struct ci_time *time);
+	void (*phys)(void *user, const struct ci_phys *phys);
+	void (*gama)(void *user, uint32_t gamma);  /* times 100000 */
+	void (*chrm)(void *user, const struct ci_chrm *chrm);
+	void (*srgb)(void *user, uint8_t intent);
+	void (*text)(void *user, const struct ci_text *text);
+	void (*iccp)(void *user, const struct ci_iccp *iccp);
+	void (*actl)(void *user, const struct ci_actl *actl);
+	void (*fctl)(void *user, const struct ci_fctl *fctl);
+	void (*image)(void *user, const struct ci_image *image);
+	void (*damage)(void *user, const struct ci_damage *damage);
+	void (*inflated)(void *user, const struct ci_inflated *piece);
+};
+
+struct ci_ctx;
+
+/*
+ * Decoder for a chunk type, a private one or to replace a built-in one.
+ * It is called after the CRC check, for any chunk length, and can
+ * describe the chunk with ci_field(). Anything but CI_OK stops the
+ * stream with that error.
+ */
+typedef int (*ci_decoder)(struct ci_ctx *ctx, const struct ci_chunk *c,
+			  void *arg);
+
+/* cb may be NULL, it is copied */
+CI_API struct ci_ctx *ci_new(const struct ci_callbacks *cb, void *user);
+CI_API void ci_free(struct ci_ctx *ctx);
+
+/* type is the 4 letter chunk type, registering it again replaces fn */
+CI_API int ci_register(struct ci_ctx *ctx, const char *type, ci_decoder fn,
+		       void *arg);
+
+/* key = value field for ci_decoder, a note if key is NULL */
+CI_API void ci_field(struct ci_ctx *ctx, const char *key, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 3, 4)))
+#endif
+	;
+
+/*
+ * for the streams that start after the call. below CI_VERIFY_CRC the
+ * data of IDAT and fdAT chunks, but the fdAT sequence number, is not
+ * read: a file is only checked to be long enough for it.
+ */
+CI_API int ci_set_verify(struct ci_ctx *ctx, enum ci_verify level);
+
+/*
+ * threads for one image, 1 by default. a stream with full-flush points
+ * is then inflated in pieces in parallel, it is kept in memory until
+ * the chunk after its last one, which is when it is reported. that
+ * compressed stream and a 32 KB window per thread is all it holds: the
+ * output of the pieces is only counted. with CI_VERIFY_FULL the passes
+ * of an Adam7 image are also unfiltered in parallel and deinterlaced,
+ * which needs the whole image and its raster in memory, the pieces go
+ * straight into it. a non-interlaced image is unfiltered row by row at
+ * that level, its stream is inflated as it comes and not kept. a pipe
+ * opened then is also read ahead, up to 256 KB, by one more thread, see
+ * ci_open_fd().
+ */
+CI_API int ci_set_threads(struct ci_ctx *ctx, unsigned threads);
+
+/*
+ * zTXt, iTXt and iCCP content is inflated from CI_VERIFY_INFLATE on, a
+ * window at a time and never kept whole: at most max bytes of a chunk,
+ * 1 MB by default, and no more than ratio times its compressed size, 0
+ * for no such limit (default). what is past a limit is not inflated and
+ * the chunk is not an error for it, only invalid compressed data is.
+ */
+CI_API int ci_set_inflate_limits(struct ci_ctx *ctx, uint64_t max,
+				 unsigned ratio);
+
+/*
+ * go on after a damaged chunk, one with a bad CRC or length, from the
+ * next place that holds a good one: four letters, a length that fits
+ * and a matching CRC. each stretch skipped is given to the damage
+ * callback, ci_check_file() then returns the error of the first one.
+ * every chunk is CRC'd first, and once a stream was damaged its image
+ * data is no longer inflated. only files and memory are recovered, not
+ * a pipe or what is pushed, they can't be searched.
+ */
+CI_API int ci_set_recover(struct ci_ctx *ctx, int on);
+
+/* before a source is opened or pushed */
+CI_API int ci_set_stop(struct ci_ctx *ctx, enum ci_stop stop);
+
+/* pull: open a source and check the PNG signature */
+CI_API int ci_open_file(struct ci_ctx *ctx, const char *path);
+
+/*
+ * a pipe or socket is read in order, through a fixed window, and is
+ * never seeked: image data and unknown chunks of any size are checked
+ * a window at a time, their ci_chunk.data is then NULL. so is any chunk
+ * over 16 MB, which is only CRC'd. a regular file is mapped if its
+ * offset is 0, else read the same way with pread() from that offset,
+ * which is not moved: offsets are then counted from there. fd is not
+ * closed by ci_free(). what was read of a pipe past the point where
+ * the check stopped (IEND, ci_set_stop(), an error) is lost to the
+ * caller: up to 64 KB, and 256 KB more if it was read ahead, see
+ * ci_set_threads().
+ */
+CI_API int ci_open_fd(struct ci_ctx *ctx, int fd);
+CI_API int ci_open_mem(struct ci_ctx *ctx, const void *buf, size_t len);
+
+/* pull: read, check and decode the next chunk, CI_END after IEND */
+CI_API int ci_next(struct ci_ctx *ctx, struct ci_chunk *chunk);
+
+/*
+ * push: feed the stream in pieces of any size, starting with the PNG
+ * signature. CI_END once IEND was seen. ci_push_end() returns CI_ERR_IO
+ * if the stream stopped before IEND. big chunks are checked as they
+ * come, like with ci_open_fd(), only the pieces are kept.
+ */
+CI_API int ci_push(struct ci_ctx *ctx, const void *buf, size_t len);
+CI_API int ci_push_end(struct ci_ctx *ctx);
+
+/* ci_next() until IEND, for callers that only want the callbacks */
+CI_API int ci_check_file(struct ci_ctx *ctx, const char *path);
+
+/* chunks checked so far */
+CI_API uint32_t ci_chunk_count(const struct ci_ctx *ctx);
+
+/* how a chunk of the table was checked */
+enum {
+	CI_CHUNK_CRC = 1,       /* its CRC matched, it was not checked if unset */
+	CI_CHUNK_WINDOWED = 2,  /* read a window at a time, see ci_open_fd() */
+	CI_CHUNK_SKIPPED = 4,   /* its data was not read, see ci_set_verify() */
+	CI_CHUNK_RESYNC = 8     /* the first one after damage */
+};
+
+/*
+ * every chunk checked so far, an array per field, entry i is the chunk
+ * of index i. the arrays are valid until the next call on the context.
+ */
+struct ci_table {
+	uint32_t count;
+	const uint32_t *tag;
+	const uint64_t *offset;  /* of the chunk type, like ci_chunk */
+	const uint32_t *length;
+	const uint32_t *crc;
+	const uint8_t *flags;    /* CI_CHUNK_* */
+};
+
+CI_API void ci_chunk_table(const struct ci_ctx *ctx, struct ci_table *t);
+
+/* damaged stretches skipped so far */
+CI_API uint32_t ci_damage_count(const struct ci_ctx *ctx);
+
+/* details of the last error, "" if none */
+CI_API const char *ci_errmsg(const struct ci_ctx *ctx);
+CI_API const char *ci_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * crc32 - CRC-32 (ISO 3309 / ITU-T V.42) used by PNG chunks
+ *
+ * The byte-at-a-time table is the reference, every other engine must
+ * give exactly the same result for any buffer (see test.c).
+ */
+
+#if defined(__aarch64__) && defined(__linux__)
+#define _DEFAULT_SOURCE
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <string.h>
+
+#include "crc32.h"
+
+/* the slicing engines read words in little-endian order */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_SLICING	1
+#else
+#define CRC32_SLICING	0
+#endif
+
+static const uint32_t crc32_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419,
+	0x706af48f, 0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4,
+	0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07,
+	0x90bf1d91, 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7, 0x136c9856,
+	0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4,
+	0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3,
+	0x45df5c75, 0xdcd60dcf, 0xabd13d59, 0x26d930ac, 0x51de003a,
+	0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599,
+	0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190,
+	0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f,
+	0x9fbfe4a5, 0xe8b8d433, 0x7807c9a2, 0x0f00f934, 0x9609a88e,
+	0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed,
+	0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3,
+	0xfbd44c65, 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a,
+	0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5,
+	0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa, 0xbe0b1010,
+	0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17,
+	0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6,
+	0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615,
+	0x73dc1683, 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1, 0xf00f9344,
+	0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a,
+	0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1,
+	0xa6bc5767, 0x3fb506dd, 0x48b2364b, 0xd80d2bda, 0xaf0a1b4c,
+	0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef,
+	0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe,
+	0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31,
+	0x2cd99e8b, 0x5bdeae1d, 0x9b64c2b0, 0xec63f226, 0x756aa39c,
+	0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b,
+	0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1,
+	0x18b74777, 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45, 0xa00ae278,
+	0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7,
+	0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc, 0x40df0b66,
+	0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605,
+	0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8,
+	0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b,
+	0x2d02ef8d
+};
+
+static uint32_t slice_table[16][256];
+static enum crc32_engine engine = CRC32_TABLE;
+static int ready;
+
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static void slice_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		slice_table[0][i] = crc32_table[i];
+
+	for (i = 0; i < 256; i++) {
+		crc = slice_table[0][i];
+		for (k = 1; k < 16; k++) {
+			crc = slice_table[0][crc & 0xff] ^ (crc >> 8);
+			slice_table[k][i] = crc;
+		}
+	}
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+#define S(t, v)	slice_table[t][(v) & 0xff]
+#define SLICE4(t, v) \
+	(S(t + 3, v) ^ S(t + 2, (v) >> 8) ^ S(t + 1, (v) >> 16) ^ S(t, (v) >> 24))
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t a, b;
+
+	while (len >= 8) {
+		a = load32(p) ^ crc;
+		b = load32(p + 4);
+		crc = SLICE4(4, a) ^ SLICE4(0, b);
+		p += 8;
+		len -= 8;
+	}
+
+	return crc32_bytes(crc, p, len);
+}
+
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t a, b, c, d;
+
+	while (len >= 16) {
+		a = load32(p) ^ crc;
+		b = load32(p + 4);
+		c = load32(p + 8);
+		d = load32(p + 12);
+		crc = SLICE4(12, a) ^ SLICE4(8, b) ^ SLICE4(4, c) ^ SLICE4(0, d);
+		p += 16;
+		len -= 16;
+	}
+
+	return crc32_bytes(crc, p, len);
+}
+
+#undef SLICE4
+#undef S
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Fold 4x128 bits at a time with carry-less multiplication, then fold
+ * down to 128 and 64 bits and finish with a Barrett reduction, as
+ * described in Intel's "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction". The constants are for the bit-reflected
+ * polynomial. len must be a multiple of 16 and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul_fold(uint32_t crc, const uint8_t *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	/* fold 64 bytes per round into four accumulators */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				_mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				_mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				_mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* fold the accumulators into one */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* remaining 16 byte blocks */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	size_t n;
+
+	if (len >= 64) {
+		n = len & ~(size_t)15;
+		crc = crc32_clmul_fold(crc, p, n);
+		p += n;
+		len -= n;
+	}
+
+	return crc32_slice16(crc, p, len);
+}
+
+static int have_clmul(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+}
+#else
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t len)
+{
+	return crc32_slice16(crc, p, len);
+}
+
+static int have_clmul(void)
+{
+	return 0;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32d(crc, v);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+
+static int have_armv8(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	return crc32_slice16(crc, p, len);
+}
+
+static int have_armv8(void)
+{
+	return 0;
+}
+#endif
+
+int crc32_engine_ok(enum crc32_engine e)
+{
+	switch (e) {
+	case CRC32_TABLE:
+		return 1;
+	case CRC32_SLICE8: case CRC32_SLICE16:
+		return CRC32_SLICING;
+	case CRC32_CLMUL:
+		return CRC32_SLICING && have_clmul();
+	case CRC32_ARMV8:
+		return have_armv8();
+	default:
+		return 0;
+	}
+}
+
+const char *crc32_engine_name(enum crc32_engine e)
+{
+	static const char *name[CRC32_ENGINES] = {
+		[CRC32_TABLE] = "table",
+		[CRC32_SLICE8] = "slicing-by-8",
+		[CRC32_SLICE16] = "slicing-by-16",
+		[CRC32_CLMUL] = "pclmulqdq",
+		[CRC32_ARMV8] = "armv8-crc32"
+	};
+
+	return (unsigned)e < CRC32_ENGINES ? name[e] : "unknown";
+}
+
+void crc32_init(void)
+{
+	if (ready)
+		return;
+
+	slice_init();
+
+	if (crc32_engine_ok(CRC32_CLMUL))
+		engine = CRC32_CLMUL;
+	else if (crc32_engine_ok(CRC32_ARMV8))
+		engine = CRC32_ARMV8;
+	else if (crc32_engine_ok(CRC32_SLICE16))
+		engine = CRC32_SLICE16;
+	else
+		engine = CRC32_TABLE;
+
+	ready = 1;
+}
+
+enum crc32_engine crc32_engine_used(void)
+{
+	crc32_init();
+	return engine;
+}
+
+static uint32_t crc32_run(enum crc32_engine e, uint32_t crc,
+			  const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc ^= 0xffffffff;
+
+	switch (e) {
+	case CRC32_SLICE8:
+		crc = crc32_slice8(crc, p, len);
+		break;
+	case CRC32_SLICE16:
+		crc = crc32_slice16(crc, p, len);
+		break;
+	case CRC32_CLMUL:
+		crc = crc32_clmul(crc, p, len);
+		break;
+	case CRC32_ARMV8:
+		crc = crc32_armv8(crc, p, len);
+		break;
+	default:
+		crc = crc32_bytes(crc, p, len);
+		break;
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+uint32_t crc32_with(enum crc32_engine e, uint32_t crc,
+		    const void *buf, size_t len)
+{
+	crc32_init();
+	if (!crc32_engine_ok(e))
+		e = CRC32_TABLE;
+
+	return crc32_run(e, crc, buf, len);
+}
+
+uint32_t pd_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	if (!ready)
+		crc32_init();
+
+	return crc32_run(engine, crc, buf, len);
+}
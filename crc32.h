@@ -0,0 +1,33 @@
+/*
+ * crc32 - CRC-32 (ISO 3309 / ITU-T V.42) used by PNG chunks
+ */
+
+#ifndef CHUNKINFO_CRC32_H
+#define CHUNKINFO_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum crc32_engine {
+	CRC32_TABLE,    /* byte at a time, the reference */
+	CRC32_SLICE8,   /* slicing-by-8 */
+	CRC32_SLICE16,  /* slicing-by-16 */
+	CRC32_CLMUL,    /* x86 PCLMULQDQ folding */
+	CRC32_ARMV8,    /* ARMv8 CRC32 instructions */
+	CRC32_ENGINES
+};
+
+/* pick the fastest engine for this cpu, call it once before using threads */
+void crc32_init(void);
+
+/* crc is the value returned by the previous call, or 0 to start */
+uint32_t pd_crc32(uint32_t crc, const void *buf, size_t len);
+
+/* force one engine, for testing and benchmarking */
+int crc32_engine_ok(enum crc32_engine e);
+const char *crc32_engine_name(enum crc32_engine e);
+enum crc32_engine crc32_engine_used(void);
+uint32_t crc32_with(enum crc32_engine e, uint32_t crc,
+		    const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,480 @@
+/*
+ * filter - undo the PNG scanline filters (None, Sub, Up, Average, Paeth)
+ *
+ * The scalar engine is the reference, every other engine must give
+ * exactly the same rows (see test.c). Sub, Average and Paeth depend on
+ * the pixel to the left, so besides Sub for 1, 2, 4 and 8 byte pixels
+ * (a prefix sum over 16 bytes) the vector engines work one pixel at a
+ * time with all its channels in one register, as libpng does. Only Up
+ * is fully data parallel, AVX2 widens it to 32 bytes.
+ */
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+static int ready;
+static enum filter_engine engine = FILTER_SCALAR;
+
+static void sub_scalar(uint8_t *row, size_t len, unsigned bpp)
+{
+	size_t i;
+
+	for (i = bpp; i < len; i++)
+		row[i] += row[i - bpp];
+}
+
+static void up_scalar(uint8_t *row, const uint8_t *prev, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		row[i] += prev[i];
+}
+
+static void avg_scalar(uint8_t *row, const uint8_t *prev, size_t len,
+		       unsigned bpp)
+{
+	size_t i;
+
+	for (i = 0; i < bpp && i < len; i++)
+		row[i] += prev[i] >> 1;
+
+	for (; i < len; i++)
+		row[i] += (row[i - bpp] + prev[i]) >> 1;
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p, pa, pb, pc;
+
+	p = a + b - c;
+	pa = abs(p - a);
+	pb = abs(p - b);
+	pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+static void paeth_scalar(uint8_t *row, const uint8_t *prev, size_t len,
+			 unsigned bpp)
+{
+	size_t i;
+
+	/* no left pixel: paeth(0, b, 0) is b */
+	for (i = 0; i < bpp && i < len; i++)
+		row[i] += prev[i];
+
+	for (; i < len; i++)
+		row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+}
+
+#ifdef __SSE2__
+#define INLINE	static inline __attribute__((always_inline))
+
+/*
+ * one pixel of 3 to 8 bytes in the low half of a register, built in a
+ * general purpose register: a partial copy through memory would stall
+ * on store forwarding, as the pixel just stored is read back at once.
+ */
+INLINE uint64_t get_bytes(const uint8_t *p, unsigned n)
+{
+	uint64_t v = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return v;
+}
+
+INLINE void put_bytes(uint8_t *p, uint64_t v, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++)
+		p[i] = v >> (8 * i);
+}
+
+INLINE __m128i load_px(const uint8_t *p, unsigned bpp)
+{
+	uint32_t v;
+
+	if (bpp == 8)
+		return _mm_loadl_epi64((const __m128i *)p);
+
+	if (bpp == 4) {
+		memcpy(&v, p, 4);
+		return _mm_cvtsi32_si128(v);
+	}
+
+	if (bpp > 4) {
+		v = get_bytes(p + 4, bpp - 4);
+		return _mm_unpacklo_epi32(_mm_cvtsi32_si128(get_bytes(p, 4)),
+					  _mm_cvtsi32_si128(v));
+	}
+
+	return _mm_cvtsi32_si128(get_bytes(p, bpp));
+}
+
+INLINE void store_px(uint8_t *p, __m128i x, unsigned bpp)
+{
+	if (bpp == 8) {
+		_mm_storel_epi64((__m128i *)p, x);
+		return;
+	}
+
+	if (bpp > 4) {
+		put_bytes(p, _mm_cvtsi128_si32(x), 4);
+		x = _mm_srli_si128(x, 4);
+		p += 4;
+		bpp -= 4;
+	}
+
+	put_bytes(p, _mm_cvtsi128_si32(x), bpp);
+}
+
+/* add every pixel to the ones after it, bpp is 1, 2, 4 or 8 */
+INLINE __m128i prefix_px(__m128i v, unsigned bpp)
+{
+	if (bpp <= 1)
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+	if (bpp <= 2)
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+	if (bpp <= 4)
+		v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+	return _mm_add_epi8(v, _mm_slli_si128(v, 8));
+}
+
+/* the last pixel of v in every pixel */
+INLINE __m128i last_px(__m128i v, unsigned bpp)
+{
+	if (bpp == 8)
+		return _mm_unpackhi_epi64(v, v);
+	if (bpp == 4)
+		return _mm_shuffle_epi32(v, 0xff);
+	if (bpp == 1)
+		v = _mm_unpackhi_epi8(v, v);
+
+	v = _mm_shufflehi_epi16(v, 0xff);
+	return _mm_unpackhi_epi64(v, v);
+}
+
+INLINE void sub_block(uint8_t *row, size_t len, unsigned bpp)
+{
+	__m128i v, carry = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(row + i));
+		v = _mm_add_epi8(prefix_px(v, bpp), carry);
+		_mm_storeu_si128((__m128i *)(row + i), v);
+		carry = last_px(v, bpp);
+	}
+
+	for (; i < len; i++)
+		row[i] += i >= bpp ? row[i - bpp] : 0;
+}
+
+INLINE void sub_px(uint8_t *row, size_t len, unsigned bpp)
+{
+	__m128i a = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + bpp <= len; i += bpp) {
+		a = _mm_add_epi8(load_px(row + i, bpp), a);
+		store_px(row + i, a, bpp);
+	}
+
+	/* a partial pixel, only in a row that is not a whole image row */
+	for (; i < len; i++)
+		row[i] += i >= bpp ? row[i - bpp] : 0;
+}
+
+static void sub_sse2(uint8_t *row, size_t len, unsigned bpp)
+{
+	switch (bpp) {
+	case 1: sub_block(row, len, 1); break;
+	case 2: sub_block(row, len, 2); break;
+	case 3: sub_px(row, len, 3); break;
+	case 4: sub_block(row, len, 4); break;
+	case 6: sub_px(row, len, 6); break;
+	case 8: sub_block(row, len, 8); break;
+	default: sub_scalar(row, len, bpp); break;
+	}
+}
+
+static void up_sse2(uint8_t *row, const uint8_t *prev, size_t len)
+{
+	__m128i x, b;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(row + i));
+		b = _mm_loadu_si128((const __m128i *)(prev + i));
+		_mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+	}
+
+	up_scalar(row + i, prev + i, len - i);
+}
+
+INLINE void avg_px(uint8_t *row, const uint8_t *prev, size_t len,
+		   unsigned bpp)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a, b, avg;
+	size_t i;
+
+	a = _mm_setzero_si128();
+	for (i = 0; i + bpp <= len; i += bpp) {
+		b = load_px(prev + i, bpp);
+
+		/* pavgb rounds up, (a + b) >> 1 rounds down */
+		avg = _mm_avg_epu8(a, b);
+		avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+
+		a = _mm_add_epi8(load_px(row + i, bpp), avg);
+		store_px(row + i, a, bpp);
+	}
+
+	for (; i < len; i++)
+		row[i] += ((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1;
+}
+
+static void avg_sse2(uint8_t *row, const uint8_t *prev, size_t len,
+		     unsigned bpp)
+{
+	switch (bpp) {
+	case 3: avg_px(row, prev, len, 3); break;
+	case 4: avg_px(row, prev, len, 4); break;
+	case 6: avg_px(row, prev, len, 6); break;
+	case 8: avg_px(row, prev, len, 8); break;
+	default: avg_scalar(row, prev, len, bpp); break;
+	}
+}
+
+INLINE __m128i abs16(__m128i x)
+{
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+INLINE __m128i select16(__m128i mask, __m128i x, __m128i y)
+{
+	return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+/* channels widened to 16 bits, p - a is b - c and p - b is a - c */
+INLINE void paeth_px(uint8_t *row, const uint8_t *prev, size_t len,
+		     unsigned bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a, b, c, x, pa, pb, pc, min, near;
+	size_t i;
+
+	a = c = zero;
+	for (i = 0; i + bpp <= len; i += bpp) {
+		b = _mm_unpacklo_epi8(load_px(prev + i, bpp), zero);
+
+		pa = _mm_sub_epi16(b, c);
+		pb = _mm_sub_epi16(a, c);
+		pc = abs16(_mm_add_epi16(pa, pb));
+		pa = abs16(pa);
+		pb = abs16(pb);
+		min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+		/* ties go to a, then b */
+		near = select16(_mm_cmpeq_epi16(min, pb), b, c);
+		near = select16(_mm_cmpeq_epi16(min, pa), a, near);
+
+		x = _mm_add_epi8(load_px(row + i, bpp),
+				 _mm_packus_epi16(near, near));
+		store_px(row + i, x, bpp);
+
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
+	}
+
+	for (; i < len; i++)
+		row[i] += i >= bpp ?
+			paeth(row[i - bpp], prev[i], prev[i - bpp]) : prev[i];
+}
+
+static void paeth_sse2(uint8_t *row, const uint8_t *prev, size_t len,
+		       unsigned bpp)
+{
+	switch (bpp) {
+	case 3: paeth_px(row, prev, len, 3); break;
+	case 4: paeth_px(row, prev, len, 4); break;
+	case 6: paeth_px(row, prev, len, 6); break;
+	case 8: paeth_px(row, prev, len, 8); break;
+	default: paeth_scalar(row, prev, len, bpp); break;
+	}
+}
+
+__attribute__((target("avx2")))
+static void up_avx2(uint8_t *row, const uint8_t *prev, size_t len)
+{
+	__m256i x, b;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(row + i));
+		b = _mm256_loadu_si256((const __m256i *)(prev + i));
+		_mm256_storeu_si256((__m256i *)(row + i), _mm256_add_epi8(x, b));
+	}
+
+	up_sse2(row + i, prev + i, len - i);
+}
+
+static int have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#else
+static void sub_sse2(uint8_t *row, size_t len, unsigned bpp)
+{
+	sub_scalar(row, len, bpp);
+}
+
+static void up_sse2(uint8_t *row, const uint8_t *prev, size_t len)
+{
+	up_scalar(row, prev, len);
+}
+
+static void avg_sse2(uint8_t *row, const uint8_t *prev, size_t len,
+		     unsigned bpp)
+{
+	avg_scalar(row, prev, len, bpp);
+}
+
+static void paeth_sse2(uint8_t *row, const uint8_t *prev, size_t len,
+		       unsigned bpp)
+{
+	paeth_scalar(row, prev, len, bpp);
+}
+
+static void up_avx2(uint8_t *row, const uint8_t *prev, size_t len)
+{
+	up_scalar(row, prev, len);
+}
+
+static int have_avx2(void)
+{
+	return 0;
+}
+#endif
+
+int filter_engine_ok(enum filter_engine e)
+{
+	switch (e) {
+	case FILTER_SCALAR:
+		return 1;
+#ifdef __SSE2__
+	case FILTER_SSE2:
+		return 1;
+#endif
+	case FILTER_AVX2:
+		return have_avx2();
+	default:
+		return 0;
+	}
+}
+
+const char *filter_engine_name(enum filter_engine e)
+{
+	static const char *name[FILTER_ENGINES] = {
+		[FILTER_SCALAR] = "scalar",
+		[FILTER_SSE2] = "sse2",
+		[FILTER_AVX2] = "avx2"
+	};
+
+	return (unsigned)e < FILTER_ENGINES ? name[e] : "unknown";
+}
+
+void filter_init(void)
+{
+	if (ready)
+		return;
+
+	if (filter_engine_ok(FILTER_AVX2))
+		engine = FILTER_AVX2;
+	else if (filter_engine_ok(FILTER_SSE2))
+		engine = FILTER_SSE2;
+	else
+		engine = FILTER_SCALAR;
+
+	ready = 1;
+}
+
+enum filter_engine filter_engine_used(void)
+{
+	filter_init();
+	return engine;
+}
+
+static int unfilter_run(enum filter_engine e, unsigned type, uint8_t *row,
+			const uint8_t *prev, size_t len, unsigned bpp)
+{
+	switch (type) {
+	case FILTER_NONE:
+		break;
+	case FILTER_SUB:
+		if (e == FILTER_SCALAR)
+			sub_scalar(row, len, bpp);
+		else
+			sub_sse2(row, len, bpp);
+		break;
+	case FILTER_UP:
+		if (e == FILTER_AVX2)
+			up_avx2(row, prev, len);
+		else if (e == FILTER_SSE2)
+			up_sse2(row, prev, len);
+		else
+			up_scalar(row, prev, len);
+		break;
+	case FILTER_AVG:
+		if (e == FILTER_SCALAR)
+			avg_scalar(row, prev, len, bpp);
+		else
+			avg_sse2(row, prev, len, bpp);
+		break;
+	case FILTER_PAETH:
+		if (e == FILTER_SCALAR)
+			paeth_scalar(row, prev, len, bpp);
+		else
+			paeth_sse2(row, prev, len, bpp);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int unfilter_with(enum filter_engine e, unsigned type, uint8_t *row,
+		  const uint8_t *prev, size_t len, unsigned bpp)
+{
+	filter_init();
+	if (!filter_engine_ok(e))
+		e = FILTER_SCALAR;
+
+	return unfilter_run(e, type, row, prev, len, bpp);
+}
+
+int unfilter_row(unsigned type, uint8_t *row, const uint8_t *prev,
+		 size_t len, unsigned bpp)
+{
+	if (!ready)
+		filter_init();
+
+	return unfilter_run(engine, type, row, prev, len, bpp);
+}
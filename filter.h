@@ -0,0 +1,45 @@
+/*
+ * filter - undo the PNG scanline filters (None, Sub, Up, Average, Paeth)
+ */
+
+#ifndef CHUNKINFO_FILTER_H
+#define CHUNKINFO_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum filter_type {
+	FILTER_NONE,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVG,
+	FILTER_PAETH,
+	FILTER_TYPES
+};
+
+enum filter_engine {
+	FILTER_SCALAR,  /* byte at a time, the reference */
+	FILTER_SSE2,
+	FILTER_AVX2,    /* SSE2, with wider Up */
+	FILTER_ENGINES
+};
+
+/* pick the fastest engine for this cpu, call it once before using threads */
+void filter_init(void);
+
+/*
+ * undo filter type of one row in place, prev is the unfiltered row above
+ * (zeros for the first row of an image or pass), bpp is the number of
+ * bytes per complete pixel rounded up to 1. -1 if type is invalid.
+ */
+int unfilter_row(unsigned type, uint8_t *row, const uint8_t *prev,
+		 size_t len, unsigned bpp);
+
+/* force one engine, for testing and benchmarking */
+int filter_engine_ok(enum filter_engine e);
+const char *filter_engine_name(enum filter_engine e);
+enum filter_engine filter_engine_used(void);
+int unfilter_with(enum filter_engine e, unsigned type, uint8_t *row,
+		  const uint8_t *prev, size_t len, unsigned bpp);
+
+#endif
@@ -0,0 +1,636 @@
+/*
+ * idat - streaming inflate of the image data (IDAT and fdAT)
+ *
+ * The compressed stream of an image is cut into chunks at arbitrary
+ * places, so it is inflated one chunk at a time into a fixed buffer.
+ * zlib checks the header and the Adler-32 trailer, the decompressed
+ * size is checked against the size IHDR (or fcTL) predicts.
+ *
+ * To unfilter, the output is cut into scanlines pass by pass and each
+ * one is unfiltered against the row above it, so only two rows of the
+ * widest pass are kept whatever the size of the image.
+ *
+ * An Adam7 image is seven independent sub-images one after the other.
+ * With threads the whole image is inflated in place, every pass goes to
+ * a thread once its last byte is out while inflate goes on with the
+ * next ones, then threads scatter the passes into the final raster, a
+ * band of rows each. The image and the raster must fit in memory, if
+ * not the passes are unfiltered one by one as they come.
+ *
+ * Threads also inflate a stream with full-flush points in pieces, see
+ * zsync.c. The stream must then be kept until its last chunk. Pieces
+ * that are only counted go through a fixed window each, an Adam7 image
+ * for the threads is copied in whole once all the pieces are checked.
+ * Rows unfiltered one at a time are not worth keeping the pieces for,
+ * their stream is inflated as it comes.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "idat.h"
+
+#define MAX_THREADS	64
+
+/* Adam7 pass origins and steps: x0, y0, dx, dy */
+static const uint8_t adam7[7][4] = {
+	{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+	{ 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+};
+
+/* bytes of one row, without the filter type byte */
+static uint64_t row_bytes(uint64_t width, unsigned bits)
+{
+	return (width * bits + 7) / 8;
+}
+
+/* pixels of pass p (0 to 6) of an Adam7 image */
+static void pass_size(uint32_t width, uint32_t height, int p,
+		      uint32_t *w, uint32_t *h)
+{
+	*w = width > adam7[p][0] ?
+		(width - adam7[p][0] + adam7[p][2] - 1) / adam7[p][2] : 0;
+	*h = height > adam7[p][1] ?
+		(height - adam7[p][1] + adam7[p][3] - 1) / adam7[p][3] : 0;
+}
+
+static uint64_t scanlines(uint64_t width, uint64_t height, unsigned bits)
+{
+	if (width == 0 || height == 0)
+		return 0;
+
+	/* one filter type byte per row */
+	return height * (1 + row_bytes(width, bits));
+}
+
+uint64_t idat_image_size(uint32_t width, uint32_t height, unsigned bits,
+			 int interlace)
+{
+	uint64_t size;
+	uint32_t w, h;
+	int p;
+
+	if (!interlace)
+		return scanlines(width, height, bits);
+
+	size = 0;
+	for (p = 0; p < 7; p++) {
+		pass_size(width, height, p, &w, &h);
+		size += scanlines(w, h, bits);
+	}
+
+	return size;
+}
+
+/* first pass from p on that has pixels, the rows start from zero */
+static void next_pass(struct idat *s, int p)
+{
+	uint32_t w = 0, h = 0;
+
+	for (; p < 7; p++) {
+		if (s->interlace)
+			pass_size(s->width, s->height, p, &w, &h);
+		else if (p == 0)
+			w = s->width, h = s->height;
+		else
+			w = h = 0;
+
+		if (w > 0 && h > 0)
+			break;
+	}
+
+	s->pass = p;
+	if (p == 7)
+		return;
+
+	s->row_len = 1 + row_bytes(w, s->bits);
+	s->row_fill = 0;
+	s->pass_height = h;
+	s->y = 0;
+	memset(s->prev, 0, s->row_len);
+}
+
+static int adam7_alloc(struct idat *s);
+
+int idat_begin(struct idat *s, uint32_t tag, const struct idat_image *im)
+{
+	uint64_t max;
+
+	idat_close(s);
+
+	s->tag = tag;
+	s->chunks = 0;
+	s->in = s->out = 0;
+	s->adler = 0;
+	s->expect = idat_image_size(im->width, im->height, im->bits,
+				    im->interlace);
+	s->nhdr = 0;
+
+	s->width = im->width, s->height = im->height;
+	s->bits = im->bits, s->bpp = im->bits < 8 ? 1 : im->bits / 8;
+	s->interlace = im->interlace;
+	s->rows = s->bad = 0;
+	s->pixels_crc = 0;
+	memset(s->filters, 0, sizeof(s->filters));
+
+	s->threads = im->threads > MAX_THREADS ? MAX_THREADS : im->threads;
+	s->passes_sent = 0;
+	s->deinterlaced = 0;
+	s->raster_crc = 0;
+	memset(s->passes, 0, sizeof(s->passes));
+	s->pieces = 0;
+
+	if (im->unfilter) {
+		max = 1 + row_bytes(im->width, im->bits);
+		if (max > SIZE_MAX / 2)
+			return IDAT_ERR_NOMEM;
+
+		s->row = malloc(max);
+		s->prev = malloc(max);
+		if (!s->row || !s->prev) {
+			idat_close(s);
+			return IDAT_ERR_NOMEM;
+		}
+
+		/* the passes as they come if they don't fit */
+		if (!(s->interlace && s->threads > 1 && adam7_alloc(s)))
+			next_pass(s, 0);
+	}
+
+	/*
+	 * rows unfiltered one by one gain nothing from pieces that would
+	 * all have to be kept for them: only a stream that is counted, or
+	 * goes whole to the Adam7 threads, is kept to be cut
+	 */
+	s->keep = s->threads > 1 && (!s->row || s->whole);
+
+	memset(&s->z, 0, sizeof(s->z));
+	if (inflateInit(&s->z) != Z_OK) {
+		idat_close(s);
+		return IDAT_ERR_NOMEM;
+	}
+
+	s->state = IDAT_OPEN;
+	return IDAT_OK;
+}
+
+static void unfilter_scanline(struct idat *s)
+{
+	uint8_t *tmp;
+
+	if (unfilter_row(s->row[0], s->row + 1, s->prev + 1, s->row_len - 1,
+			 s->bpp) == 0) {
+		s->filters[s->row[0]]++;
+		s->pixels_crc = pd_crc32(s->pixels_crc, s->row + 1,
+					 s->row_len - 1);
+	} else if (s->bad++ == 0) {
+		s->first_bad = s->rows;
+		s->bad_type = s->row[0];
+	}
+
+	tmp = s->prev;
+	s->prev = s->row;
+	s->row = tmp;
+	s->row_fill = 0;
+	s->rows++;
+
+	if (++s->y == s->pass_height)
+		next_pass(s, s->pass + 1);
+}
+
+/* n is never more than the image needs */
+static void scanlines_feed(struct idat *s, const uint8_t *p, size_t n)
+{
+	size_t take;
+
+	while (n > 0) {
+		take = s->row_len - s->row_fill;
+		if (take > n)
+			take = n;
+
+		memcpy(s->row + s->row_fill, p, take);
+		s->row_fill += take;
+		p += take;
+		n -= take;
+
+		if (s->row_fill == s->row_len)
+			unfilter_scanline(s);
+	}
+}
+
+/* the whole image and the raster, 0 if they don't fit */
+static int adam7_alloc(struct idat *s)
+{
+	uint64_t raster;
+	uint32_t w, h;
+	int p;
+
+	raster = row_bytes(s->width, s->bits) * s->height;
+	if (s->expect > SIZE_MAX || raster > SIZE_MAX)
+		return 0;
+
+	s->whole = malloc(s->expect);
+	s->raster = malloc(raster);
+	if (!s->whole || !s->raster) {
+		free(s->whole);
+		free(s->raster);
+		s->whole = s->raster = NULL;
+		return 0;
+	}
+
+	/* zeros, the row above the first row of every pass */
+	memset(s->prev, 0, 1 + row_bytes(s->width, s->bits));
+
+	s->pass_off[0] = 0;
+	for (p = 0; p < 7; p++) {
+		pass_size(s->width, s->height, p, &w, &h);
+		s->pass_off[p + 1] = s->pass_off[p] + scanlines(w, h, s->bits);
+
+		s->passes[p].s = s;
+		s->passes[p].data = s->whole + s->pass_off[p];
+		s->passes[p].row_len = 1 + row_bytes(w, s->bits);
+		s->passes[p].height = w > 0 ? h : 0;
+	}
+
+	return 1;
+}
+
+/* unfilter one pass in place */
+static void *adam7_unfilter(void *arg)
+{
+	struct adam7_pass *pass = arg;
+	const uint8_t *prev;
+	uint8_t *row;
+	uint32_t y;
+
+	prev = pass->s->prev;
+	row = pass->data;
+	for (y = 0; y < pass->height; y++) {
+		if (unfilter_row(row[0], row + 1, prev + 1, pass->row_len - 1,
+				 pass->s->bpp) == 0) {
+			pass->filters[row[0]]++;
+			pass->crc = pd_crc32(pass->crc, row + 1,
+					     pass->row_len - 1);
+			pass->crc_len += pass->row_len - 1;
+		} else if (pass->bad++ == 0) {
+			pass->first_bad = y;
+			pass->bad_type = row[0];
+		}
+
+		prev = row;
+		row += pass->row_len;
+	}
+
+	return NULL;
+}
+
+static void adam7_join(struct adam7_pass *pass)
+{
+	if (pass->running)
+		pthread_join(pass->tid, NULL);
+	pass->running = 0;
+}
+
+/* hand every pass that is all out to a thread, the oldest ones first */
+static void adam7_send(struct idat *s)
+{
+	struct adam7_pass *pass;
+	unsigned running;
+	int p;
+
+	while (s->passes_sent < 7 && s->pass_off[s->passes_sent + 1] <= s->out) {
+		pass = &s->passes[s->passes_sent++];
+		if (pass->height == 0)
+			continue;
+
+		/* the calling thread inflates, threads - 1 passes at a time */
+		running = 0;
+		for (p = 0; p < 7; p++)
+			running += s->passes[p].running;
+		for (p = 0; p < 7 && running >= s->threads - 1; p++) {
+			if (s->passes[p].running) {
+				adam7_join(&s->passes[p]);
+				running--;
+			}
+		}
+
+		pass->used = 1;
+		if (pthread_create(&pass->tid, NULL, adam7_unfilter, pass) == 0)
+			pass->running = 1;
+		else
+			adam7_unfilter(pass);
+	}
+}
+
+struct band {
+	struct idat *s;
+	pthread_t tid;
+	int running;
+	uint32_t y0, y1;
+	uint32_t crc;
+};
+
+/* pixel i of a row of sub-byte pixels, the first one in the high bits */
+static unsigned get_bits(const uint8_t *row, uint64_t i, unsigned bits)
+{
+	uint64_t bit = i * bits;
+
+	return row[bit / 8] >> (8 - bits - bit % 8) & ((1u << bits) - 1);
+}
+
+static void set_bits(uint8_t *row, uint64_t i, unsigned bits, unsigned v)
+{
+	uint64_t bit = i * bits;
+
+	row[bit / 8] |= v << (8 - bits - bit % 8);
+}
+
+#define SCATTER(n)							\
+	for (i = 0; i < w; i++)						\
+		memcpy(dst + (x0 + i * dx) * (n), src + i * (n), (n))
+
+/* put the rows of the passes that fall in a band of the raster */
+static void *adam7_scatter(void *arg)
+{
+	struct band *b = arg;
+	struct idat *s = b->s;
+	const uint8_t *src;
+	uint8_t *dst;
+	uint64_t i, rb, x0, dx;
+	uint32_t y, w, h;
+	unsigned bpp;
+	int p;
+
+	rb = row_bytes(s->width, s->bits);
+	bpp = s->bpp;
+	for (y = b->y0; y < b->y1; y++) {
+		dst = s->raster + y * rb;
+		if (s->bits < 8)
+			memset(dst, 0, rb);
+
+		for (p = 0; p < 7; p++) {
+			if (y < adam7[p][1] || (y - adam7[p][1]) % adam7[p][3])
+				continue;
+
+			pass_size(s->width, s->height, p, &w, &h);
+			if (w == 0)
+				continue;
+
+			src = s->passes[p].data + 1 +
+				(uint64_t)(y - adam7[p][1]) / adam7[p][3] *
+				s->passes[p].row_len;
+			x0 = adam7[p][0], dx = adam7[p][2];
+
+			switch (s->bits < 8 ? 0 : bpp) {
+			case 0:
+				for (i = 0; i < w; i++)
+					set_bits(dst, x0 + i * dx, s->bits,
+						 get_bits(src, i, s->bits));
+				break;
+			case 1: SCATTER(1); break;
+			case 2: SCATTER(2); break;
+			case 3: SCATTER(3); break;
+			case 4: SCATTER(4); break;
+			case 6: SCATTER(6); break;
+			default: SCATTER(8); break;
+			}
+		}
+
+		b->crc = pd_crc32(b->crc, dst, rb);
+	}
+
+	return NULL;
+}
+
+/* wait for the passes, then deinterlace if the image is good */
+static void adam7_finish(struct idat *s)
+{
+	struct band band[MAX_THREADS];
+	struct adam7_pass *pass;
+	uint32_t step;
+	unsigned n, t;
+	int p;
+
+	for (p = 0; p < 7; p++) {
+		pass = &s->passes[p];
+		adam7_join(pass);
+		if (!pass->used)
+			continue;
+
+		for (t = 0; t < FILTER_TYPES; t++)
+			s->filters[t] += pass->filters[t];
+
+		if (pass->bad > 0 && s->bad == 0) {
+			s->first_bad = s->rows + pass->first_bad;
+			s->bad_type = pass->bad_type;
+		}
+		s->bad += pass->bad;
+
+		s->pixels_crc = crc32_combine(s->pixels_crc, pass->crc,
+					      pass->crc_len);
+		s->rows += pass->height;
+	}
+
+	if (s->out != s->expect || s->bad > 0)
+		return;
+
+	n = s->threads;
+	step = s->height / n + (s->height % n != 0);
+	for (t = 0; t < n; t++) {
+		band[t].s = s;
+		band[t].y0 = step * t < s->height ? step * t : s->height;
+		band[t].y1 = s->height - band[t].y0 > step ?
+			band[t].y0 + step : s->height;
+		band[t].crc = 0;
+	}
+
+	/* the last band is for this thread */
+	for (t = 0; t < n; t++) {
+		band[t].running = t + 1 < n &&
+			pthread_create(&band[t].tid, NULL, adam7_scatter,
+				       &band[t]) == 0;
+		if (!band[t].running)
+			adam7_scatter(&band[t]);
+	}
+
+	for (t = 0; t < n; t++) {
+		if (band[t].running)
+			pthread_join(band[t].tid, NULL);
+
+		s->raster_crc = crc32_combine(s->raster_crc, band[t].crc,
+				(band[t].y1 - band[t].y0) *
+				row_bytes(s->width, s->bits));
+	}
+
+	s->deinterlaced = 1;
+}
+
+/* inflate the next piece of the stream as it comes */
+static int inflate_data(struct idat *s, const uint8_t *data, size_t len)
+{
+	size_t n;
+	int ret;
+
+	s->z.next_in = (Bytef *)data;
+	s->z.avail_in = len;
+
+	do {
+		if (s->whole && s->out < s->expect) {
+			/* in place, anything past the end goes to buf */
+			n = s->expect - s->out < UINT_MAX ?
+				s->expect - s->out : UINT_MAX;
+			s->z.next_out = s->whole + s->out;
+		} else {
+			n = sizeof(s->buf);
+			s->z.next_out = s->buf;
+		}
+		s->z.avail_out = n;
+
+		ret = inflate(&s->z, Z_NO_FLUSH);
+		n -= s->z.avail_out;
+		s->out += n;
+
+		if (ret == Z_NEED_DICT)
+			return IDAT_ERR_DICT;
+		if (ret == Z_MEM_ERROR)
+			return IDAT_ERR_NOMEM;
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			return IDAT_ERR_DATA;
+		if (s->out > s->expect)
+			return IDAT_ERR_LONG;
+		if (s->whole)
+			adam7_send(s);
+		else if (s->row)
+			scanlines_feed(s, s->buf, n);
+
+		if (ret == Z_STREAM_END) {
+			if (s->whole)
+				adam7_finish(s);
+
+			s->in += len - s->z.avail_in;
+			s->adler = s->z.adler;
+			s->state = IDAT_ENDED;
+			return s->z.avail_in > 0 ? IDAT_ERR_EXTRA : IDAT_END;
+		}
+	} while (s->z.avail_out == 0);
+
+	s->in += len;
+	return IDAT_OK;
+}
+
+/* the stream kept so far goes the usual way, 0 if it is not over */
+static int inflate_kept(struct idat *s)
+{
+	int ret;
+
+	s->keep = 0;
+	ret = inflate_data(s, s->zs.data, s->zs.len);
+	zsync_free(&s->zs);
+
+	return ret;
+}
+
+/* inflate the stream kept in pieces, 0 if it can't be cut */
+static int inflate_pieces(struct idat *s)
+{
+	struct zsync_piece piece[ZSYNC_MAX];
+	uint32_t adler;
+	unsigned n, k;
+
+	/* only counted without the Adam7 threads, see idat_begin() */
+	n = zsync_inflate(&s->zs, s->threads, s->expect, s->whole != NULL,
+			  piece, &adler);
+	if (n == 0)
+		return 0;
+
+	for (k = 0; k < n; k++) {
+		if (s->whole)
+			memcpy(s->whole + s->out, piece[k].out, piece[k].out_len);
+		s->out += piece[k].out_len;
+	}
+	zsync_release(piece, n);
+
+	if (s->whole) {
+		adam7_send(s);
+		adam7_finish(s);
+	}
+
+	s->in = s->zs.len;
+	s->adler = adler;
+	s->pieces = n;
+	s->state = IDAT_ENDED;
+	s->keep = 0;
+	zsync_free(&s->zs);
+
+	return 1;
+}
+
+int idat_feed(struct idat *s, const uint8_t *data, size_t len, int chunk)
+{
+	size_t i;
+
+	s->chunks += chunk != 0;
+	for (i = 0; s->nhdr < 2 && i < len; i++)
+		s->hdr[s->nhdr++] = data[i];
+
+	if (s->state == IDAT_ENDED)
+		return len > 0 ? IDAT_ERR_EXTRA : IDAT_OK;
+
+	if (!s->keep)
+		return inflate_data(s, data, len);
+
+	if (!zsync_add(&s->zs, data, len))
+		return IDAT_ERR_NOMEM;
+
+	/* no full flush in sight */
+	if (s->zs.ncut == 0 && s->zs.len >= IDAT_PROBE)
+		return inflate_kept(s);
+
+	return IDAT_OK;
+}
+
+int idat_finish(struct idat *s)
+{
+	int ret;
+
+	if (s->state != IDAT_OPEN)
+		return IDAT_END;
+
+	if (!s->keep)
+		return IDAT_ERR_SHORT;
+
+	if (inflate_pieces(s))
+		return IDAT_END;
+
+	ret = inflate_kept(s);
+	return ret == IDAT_OK ? IDAT_ERR_SHORT : ret;
+}
+
+const char *idat_msg(const struct idat *s)
+{
+	return s->z.msg ? s->z.msg : "invalid deflate data";
+}
+
+void idat_close(struct idat *s)
+{
+	int p;
+
+	if (s->state != IDAT_NONE)
+		inflateEnd(&s->z);
+	s->state = IDAT_NONE;
+
+	/* threads may still be at work if the stream failed */
+	for (p = 0; p < 7; p++)
+		adam7_join(&s->passes[p]);
+
+	free(s->row);
+	free(s->prev);
+	free(s->whole);
+	free(s->raster);
+	s->row = s->prev = s->whole = s->raster = NULL;
+
+	zsync_free(&s->zs);
+	s->keep = 0;
+}
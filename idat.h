@@ -0,0 +1,131 @@
+/*
+ * idat - streaming inflate of the image data (IDAT and fdAT)
+ */
+
+#ifndef CHUNKINFO_IDAT_H
+#define CHUNKINFO_IDAT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zlib.h>
+
+#include "filter.h"
+#include "zsync.h"
+
+#define IDAT_BUF	32768
+#define IDAT_PROBE	(4 << 20)  /* compressed bytes kept to find a cut */
+
+enum idat_state {
+	IDAT_NONE,   /* no stream yet, or closed */
+	IDAT_OPEN,   /* inflating */
+	IDAT_ENDED   /* Adler-32 checked, more data is an error */
+};
+
+enum idat_result {
+	IDAT_OK,
+	IDAT_END,        /* the zlib stream ended in this piece */
+	IDAT_ERR_NOMEM,
+	IDAT_ERR_DATA,   /* bad header, deflate data or Adler-32, see msg */
+	IDAT_ERR_DICT,   /* preset dictionary, not allowed in PNG */
+	IDAT_ERR_LONG,   /* more data than the image needs */
+	IDAT_ERR_EXTRA,  /* data after the end of the stream */
+	IDAT_ERR_SHORT   /* the stream was not over with its last chunk */
+};
+
+/* what to do with the image data, see idat_begin() */
+struct idat_image {
+	uint32_t width, height;
+	unsigned bits;      /* per pixel */
+	int interlace;
+	int unfilter;
+	unsigned threads;   /* more than 1: inflate at full-flush points and
+			       Adam7 passes in parallel */
+};
+
+struct idat;
+
+/* one Adam7 pass unfiltered by a thread */
+struct adam7_pass {
+	struct idat *s;
+	pthread_t tid;
+	int used, running;
+	uint8_t *data;
+	size_t row_len;
+	uint32_t height;
+	uint64_t filters[FILTER_TYPES];
+	uint64_t bad, first_bad;
+	uint8_t bad_type;
+	uint32_t crc;
+	uint64_t crc_len;
+};
+
+/*
+ * one zlib stream, the output is counted and thrown away, or with
+ * unfilter cut into scanlines that are unfiltered with only the row
+ * above kept. Adam7 images with threads are kept whole instead, each
+ * pass is unfiltered by a thread as soon as it was inflated, then the
+ * passes are put together in a raster.
+ *
+ * With threads the compressed stream is kept until its last chunk, to
+ * be inflated in pieces at once if it has full-flush points. If there
+ * is none in its first IDAT_PROBE bytes, or the rows are unfiltered one
+ * by one, it is inflated as it comes.
+ */
+struct idat {
+	z_stream z;
+	enum idat_state state;
+	uint32_t tag;        /* IDAT or fdAT */
+	uint32_t chunks;
+	uint64_t in, out;
+	uint32_t adler;
+	uint64_t expect;     /* filtered image size */
+	uint8_t hdr[2];      /* zlib header, may span two chunks */
+	uint8_t nhdr;
+
+	/* scanlines, unfilter only */
+	uint8_t *row, *prev;  /* filter type byte, then the row */
+	size_t row_len, row_fill;
+	uint32_t width, height;
+	unsigned bits, bpp;   /* bits per pixel, bytes per pixel (min 1) */
+	int interlace, pass;
+	uint32_t pass_height, y;
+	uint64_t rows;
+	uint32_t pixels_crc;  /* CRC-32 of the unfiltered rows */
+	uint64_t filters[FILTER_TYPES];
+	uint64_t bad;         /* rows with an invalid filter type */
+	uint64_t first_bad;
+	uint8_t bad_type;
+
+	/* Adam7 with threads */
+	unsigned threads;
+	uint8_t *whole, *raster;
+	uint64_t pass_off[8];  /* pass p is whole[pass_off[p]...pass_off[p + 1]] */
+	int passes_sent;
+	struct adam7_pass passes[7];
+	int deinterlaced;
+	uint32_t raster_crc;
+
+	/* parallel inflate */
+	int keep;            /* the stream goes to zs until idat_finish() */
+	struct zsync zs;
+	unsigned pieces;     /* inflated in parallel, 0 if not */
+
+	uint8_t buf[IDAT_BUF];
+};
+
+/* bytes of filtered image data, filter bytes and Adam7 passes included */
+uint64_t idat_image_size(uint32_t width, uint32_t height, unsigned bits,
+			 int interlace);
+
+int idat_begin(struct idat *s, uint32_t tag, const struct idat_image *im);
+/* chunk if data starts a chunk, not if it is the rest of one */
+int idat_feed(struct idat *s, const uint8_t *data, size_t len, int chunk);
+
+/* after the last chunk of the stream: IDAT_END, IDAT_ERR_SHORT or error */
+int idat_finish(struct idat *s);
+const char *idat_msg(const struct idat *s);
+void idat_close(struct idat *s);
+
+#endif
@@ -2,1531 +2,692 @@
  * chunkinfo - show information of PNG chunks
  */
 
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/stat.h>
+
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-
-#define MAX_CHUNK	8192
-#define MAX_IDAT_PATH	512
-#define valid_keyword(c) ((c >= 0x20 && c <= 0x7e))
-
-/* private util functions */
-static uint32_t pd_crc32(uint32_t, const void *, size_t);
-static uint32_t fread_u32(FILE *);
-static char *get_name_or_keyword(const uint8_t *, uint32_t *);
-static void die(const char *, ...);
-static void out(const char *, ...);
-
-enum COLOR_TYPE {
-	GRAY = 0,
-	RGB = 2,
-	INDEXED = 3,
-	GRAY_ALPHA = 4,
-	RGB_ALPHA = 6
-};
-
-static const char *pngf;
-static uint8_t plt[256][3];
-static uint8_t bit_depth, color_type;
-static uint32_t plt_entry, bit_depth_max;
-static const char *cstr[] = {
-	[GRAY] = "Grayscale",
-	NULL,
-	[RGB] = "RGB",
-	[INDEXED] = "Indexed-color",
-	[GRAY_ALPHA] = "Grayscale with Alpha channel",
-	NULL,
-	[RGB_ALPHA] = "RGB with Alpha channel"
-};
-
-static int png_ok(FILE *f)
-{
-	uint8_t buf[8];
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunkinfo.h"
+#include "output.h"
+#include "scan.h"
+
+static void fatal(const char *, ...)
+	__attribute__((noreturn, format(printf, 1, 2)));
+
+/* command line options, read-only once the files are checked */
+static struct options {
+	enum ci_verify verify;
+	unsigned threads;  /* per image */
+	enum ci_stop stop;
+	enum out_format format;
+	int recover;
+	unsigned long long inflate_max;  /* zTXt, iTXt and iCCP */
+	unsigned inflate_ratio;
+} opt = { .verify = CI_VERIFY_INFLATE, .threads = 1, .inflate_max = 1 << 20 };
+
+/* --cache, NULL without it */
+static struct cache *cache;
+
+/* what changes the callbacks of a file, for the cache: FNV-1a */
+static uint64_t options_hash(void)
+{
+	uint64_t v[] = {
+		opt.verify, opt.stop, opt.recover, opt.inflate_max,
+		opt.inflate_ratio, opt.format == OUT_BINARY,
+		opt.threads  /* said in the fields from 2 on */
+	};
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i, k;
 
-	if (fread(buf, 1, 8, f) != 8) {
-		errno = EIO;  /* reached EOF or I/O error */
-		return 0;
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+		for (k = 0; k < 8; k++) {
+			h ^= (uint8_t)(v[i] >> k * 8);
+			h *= 0x100000001b3ull;
+		}
 	}
 
-	if (!memcmp(buf, "\x89\x50\x4e\x47\x0d\x0a\x1a\x0a", 8))
-		return 1;
-
-	errno = EINVAL;  /* invalid PNG signature */
-	return 0;
+	return h;
 }
 
-#define valid_bdepth_gray(d) \
-	((d == 1) || (d == 2) || (d == 4) || (d == 8) || (d == 16))
-#define valid_bdepth_indexed(d) \
-	((d == 1) || (d == 2) || (d == 4) || (d == 8))
-#define valid_bdepth_rgb(d) ((d == 8) || (d == 16))
-
-static void check_bit_depth_and_color_type(void)
+/* the file of st need not be read, for the scan */
+static int in_cache(void *user, const struct stat *st)
 {
-	switch (color_type) {
-	case GRAY:
-		if (!valid_bdepth_gray(bit_depth))
-			die("IHDR: invalid bit depth for grayscale: (%u)", bit_depth);
-		break;
-	case RGB: case RGB_ALPHA: case GRAY_ALPHA:
-		if (!valid_bdepth_rgb(bit_depth))
-			die("IHDR: invalid bit depth for %s: (%u)",
-					cstr[color_type], bit_depth);
-		break;
-	case INDEXED:
-		if (!valid_bdepth_indexed(bit_depth))
-			die("IHDR: invalid bit depth for indexed-color: (%u)", bit_depth);
-		break;
-	default:
-		die("IHDR: invalid color type: (%u)", color_type);
-		break;
-	}
+	const uint8_t *ev;
+	size_t len;
+
+	(void)user;
+	return cache_lookup(cache, st, &ev, &len);
 }
 
-/**
- * IHDR
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      width (min=1,max=2^31)
- *   4      uint32    4      height (min=1,max=2^31)
- *   8      uint8     1      bit depth (1,2,4,8,16)
- *   9      uint8     1      color type (0,2,3,4,6)
- *  10      uint8     1      compression method (0)
- *  11      uint8     1      filter method (0)
- *  12      uint8     1      interlace method (0,1)
- */
-static void decode_ihdr(const uint8_t *data, const uint32_t len)
+/* the end of a file, from the library or the cache */
+static int end_file(struct report *rep, int ret, uint32_t chunks, char *err,
+		    size_t errlen)
 {
-	if (len != 13)
-		die("IHDR: invalid chunk length: (%u)", len);
-
-	bit_depth = data[8], color_type = data[9];
-	check_bit_depth_and_color_type();
-
-	bit_depth_max = 1 << bit_depth;
-
-	uint32_t w, h;
-	uint8_t chan_bits, comp, filter, interlace;
-	const uint8_t chan[] = {
-		[GRAY] = 1,
-		[RGB] = 3,
-		[INDEXED] = 1,
-		[GRAY_ALPHA] = 2,
-		[RGB_ALPHA] = 4
-	};
+	if (ret == CI_END && rep->damages > 0)
+		snprintf(err, errlen, "%u damaged parts skipped, the first: %s",
+			 rep->damages, rep->damage_msg);
 
-	comp = !!data[10];
-	if (comp)
-		die("IHDR: invalid compression method: (%u)", data[10]);
-
-	filter = !!data[11];
-	if (filter)
-		die("IHDR: invalid filter method: (%u)", data[11]);
-
-	interlace = !!data[12];
-	if (interlace > 1)
-		die("IHDR: invalid interlace method: (%u)", data[12]);
-
-	w = h = 0;
-	chan_bits = chan[color_type] * ((color_type == INDEXED) ? 8 : bit_depth);
-
-	memcpy(&w, data, 4);
-	w = __builtin_bswap32(w);
-	if (w > INT_MAX - 1)
-		die("IHDR: width is too large: (%u)", w);
-
-	memcpy(&h, data + 4, 4);
-	h = __builtin_bswap32(h);
-	if (h > INT_MAX - 1)
-		die("IHDR: height is too large: (%u)", h);
-
-	out("Width = %u", w);
-	out("Height = %u", h);
-	out("Bit depth = %u bits per %s", bit_depth,
-			(color_type == INDEXED) ? "palette index" : "channel");
-	out("Color type = %s", cstr[color_type]);
-	out("Channels = %u per pixel (%u bits)", chan[color_type], chan_bits);
-	out("Compression = zlib deflate/inflate)");
-	out("Filter = adaptive filtering");
-	out("Interlace = %s interlace", interlace ? "Adam7" : "no");
+	report_end(rep, ret, chunks, err);
+	return ret != CI_END || rep->damages > 0;
 }
 
-/**
- * PLTE
- *
- * n = chunk length
- * palette entry = n / 3
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      red color
- *   1      uint8     1      green color
- *   2      uint8     1      blue color
- *   3      uint8     1      red color
- *   4      uint8     1      green color
- *   5      uint8     1      blue color
- *  ...
- *   n      uint8     1      blue color
+/*
+ * 0 if the file is OK, otherwise 1 and the reason is in err. the report
+ * is added to o, id is the place of the file in the input. a file that
+ * was read ahead is checked from memory.
  */
-static void decode_plte(const uint8_t *data, const uint32_t len)
+static int check_file(const struct scan_file *f, uint64_t id, struct out *o,
+		      char *err, size_t errlen)
 {
-	if (len % 3 != 0)
-		die("PLTE: invalid chunk length: (%u)", len);
-
-	uint32_t i, col;
-
-	plt_entry = len / 3;
-	if (plt_entry > bit_depth_max)
-		die("PLTE: palette entries too large: (%u)", len);
-
-	out("Entries = %u", plt_entry);
-
-	for (i = 0, col = 0; i < plt_entry; i++, col += 3) {
-		plt[i][0] = data[col];      /* red */
-		plt[i][1] = data[col + 1];  /* green */
-		plt[i][2] = data[col + 2];  /* blue */
-	}
-
-	for (i = 0; i < plt_entry; i++) {
-		printf("\t[%03u]", i);
-		printf(" #%02x%02x%02x ", plt[i][0], plt[i][1], plt[i][2]);
-		if ((i + 1) % 3 == 0)
-			putchar('\n');
+	static const struct ci_callbacks cb = {
+		.chunk = report_chunk,
+		.field = report_field,
+		.damage = report_damage
+	};
+	/* no fields, they would only be formatted for nothing */
+	static const struct ci_callbacks bin_cb = {
+		.chunk = report_chunk,
+		.ihdr = report_ihdr,
+		.actl = report_actl,
+		.fctl = report_fctl,
+		.damage = report_damage
+	};
+	/* the same, kept for the cache on the way */
+	static const struct ci_callbacks rec_cb = {
+		.chunk = record_chunk,
+		.field = record_field,
+		.damage = record_damage
+	};
+	static const struct ci_callbacks rec_bin_cb = {
+		.chunk = record_chunk,
+		.ihdr = record_ihdr,
+		.actl = record_actl,
+		.fctl = record_fctl,
+		.damage = record_damage
+	};
+	struct recording rec;
+	struct report rep;
+	struct ci_ctx *ctx;
+	const uint8_t *ev;
+	const char *path = f->path;
+	struct stat st;
+	uint32_t chunks;
+	size_t len;
+	int ret, cacheable;
+
+	report_begin(&rep, opt.format, o, path, id);
+
+	/* - is stdin, read as it comes */
+	if (f->have_st)
+		st = f->st;
+	cacheable = cache && strcmp(path, "-") &&
+		    (f->have_st || stat(path, &st) == 0) && S_ISREG(st.st_mode);
+	if (cacheable && cache_lookup(cache, &st, &ev, &len) &&
+	    replay(ev, len, &rep, &ret, &chunks, err, errlen) == 0)
+		return end_file(&rep, ret, chunks, err, errlen);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.rep = &rep;
+	if (cacheable)
+		ctx = ci_new(opt.format == OUT_BINARY ? &rec_bin_cb : &rec_cb,
+			     &rec);
+	else
+		ctx = ci_new(opt.format == OUT_BINARY ? &bin_cb : &cb, &rep);
+	if (!ctx) {
+		snprintf(err, errlen, "%s", ci_strerror(CI_ERR_NOMEM));
+		report_end(&rep, CI_ERR_NOMEM, 0, err);
+		return 1;
 	}
 
-	if (i % 3 != 0)
-		putchar('\n');
-}
+	ci_set_verify(ctx, opt.verify);
+	ci_set_threads(ctx, opt.threads);
+	ci_set_stop(ctx, opt.stop);
+	ci_set_recover(ctx, opt.recover);
+	ci_set_inflate_limits(ctx, opt.inflate_max, opt.inflate_ratio);
 
-static void decode_idat(const uint8_t *data, const uint32_t len)
-{
-#if _DECODE_IDAT
-	FILE *f;
-	const char *idatf;
-	char temp[MAX_IDAT_PATH] = {0};
-
-	snprintf(temp, MAX_IDAT_PATH, "%s-IDAT.zlib", pngf);
-	idatf = strrchr(temp, '/');
-	if (idatf)
-		idatf++;
+	if (f->data)
+		ret = ci_open_mem(ctx, f->data, f->len);
+	else if (!strcmp(path, "-"))
+		ret = ci_open_fd(ctx, STDIN_FILENO);
 	else
-		idatf = temp;
-
-	f = fopen(idatf, "ab");
-	if (!f)
-		die("IDAT: failed to open %s", idatf);
-
-	if (fwrite(data, 1, len, f) != len) {
-		fclose(f);
-		die("IDAT: failed to write %s", idatf);
+		ret = ci_open_file(ctx, path);
+	while (ret == CI_OK) {
+		ret = ci_next(ctx, NULL);
+		if (ret == CI_OK && cacheable)
+			record_next(&rec);
+		else if (ret == CI_OK)
+			report_next(&rep);
 	}
 
-	fclose(f);
-
-	out("See %s", idatf);
-#else
-	(void)data; (void)len;
-
-	out("Image data");
-#endif
-}
-
-/**
- * tIME
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      year (example: 20,20)
- *   2      uint8     1      month (min=1,max=12)
- *   3      uint8     1      day (min=1,max=31)
- *   4      uint8     1      hour (min=0,max=23)
- *   5      uint8     1      minute (min=0,max=59)
- *   6      uint8     1      second (min=0,max=60)
- */
-static void decode_time(const uint8_t *data, const uint32_t len)
-{
-	if (len != 7)
-		die("tIME: invalid chunk length: (%u)", len);
-
-	struct tm t;
-	uint16_t year;
-	char buf[100] = {0};
-
-	year = 0;
-	memcpy(&year, data, 2);
-	year = __builtin_bswap16(year) - 1900;
-
-	t.tm_sec = data[6] <= 60 ? data[6] : 0;
-	t.tm_min = data[5] <= 59 ? data[5] : 0;
-	t.tm_hour = data[4] <= 23 ? data[4] : 0;
-	t.tm_mday = (data[3] >= 1 && data[3] <= 31) ? data[3] : 1;
-	t.tm_mon = (data[2] >= 1 && data[2] <= 12) ? data[2] : 1;
-	t.tm_year = year;
-
-	if (strftime(buf, 99, "%d %b %Y - %H:%M", &t))
-		out("Last modification = %s", buf);
-}
+	if (ret != CI_END)
+		snprintf(err, errlen, "%s", ci_errmsg(ctx));
+	chunks = ci_chunk_count(ctx);
 
-/**
- * pHYs
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      x axis
- *   4      uint32    4      y axis
- *   8      uint8     1      unit (0=pixel,1=meter)
- */
-static void decode_phys(const uint8_t *data, const uint32_t len)
-{
-	if (len != 9)
-		die("pHYs: invalid chunk length: (%u)", len);
-
-	char *unit;
-	uint32_t x, y, dpi;
-
-	x = y = 0;
-	unit = !!data[8] ? " per meter" : "";
-
-	memcpy(&x, data, 4);
-	x = __builtin_bswap32(x);
-
-	memcpy(&y, data + 4, 4);
-	y = __builtin_bswap32(y);
-
-	dpi = x * 0.0254;
-
-	out("%u x %u pixels%s (approx. %u DPI)", x, y, unit, dpi);
-}
-
-/**
- * sRGB
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      rendering intent (0,1,2,3)
- */
-static void decode_srgb(const uint8_t *data, const uint32_t len)
-{
-	if (len != 1)
-		die("sRGB: invalid chunk length: (%u)", len);
-
-	if (data[0] > 3)
-		die("sRGB: invalid sRGB value: (%u)", data[0]);
-
-	const char *srgb_data[5] = {
-		"Perceptual",
-		"Relative colorimetric",
-		"Saturation",
-		"Absolute colorimetric",
-		NULL
-	};
+	/* not what may go away: a read error, memory */
+	if (cacheable && ret != CI_ERR_IO && ret != CI_ERR_NOMEM) {
+		record_end(&rec, ret, chunks, ret != CI_END ? err : NULL);
+		cache_store(cache, path, &st, rec.buf, rec.len);
+	}
+	free(rec.buf);
 
-	out("%s intent", srgb_data[data[0]]);
+	ci_free(ctx);
+	return end_file(&rep, ret, chunks, err, errlen);
 }
 
-/**
- * gAMA
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      gamma value
+/*
+ * list of files to check: the command line first, then the lines of
+ * the --files-from list
  */
-static void decode_gama(const uint8_t *data, const uint32_t len)
-{
-	if (len != 4)
-		die("gAMA: invalid chunk length: (%u)", len);
-
-	uint32_t gama = 0;
-
-	memcpy(&gama, data, 4);
-	gama = __builtin_bswap32(gama);
-	if (gama == 0)
-		die("gAMA: invalid gamma value: (%u)", gama);
-
-	out("Gamma = %01.05f", (float)gama / 100000);
-}
+struct input {
+	char **argv;
+	int argc, argi;
+	FILE *list;
+	char *line;
+	size_t line_cap;
+	struct scan *scan;  /* -r, NULL without it */
+};
 
-/**
- * cHRM
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      white point x
- *   4      uint32    4      white point y
- *   8      uint32    4      red x
- *   12     uint32    4      red y
- *   16     uint32    4      green x
- *   20     uint32    4      green y
- *   24     uint32    4      blue x
- *   28     uint32    4      blue y
- */
-static void decode_chrm(const uint8_t *data, const uint32_t len)
+/* next path to check (caller frees it), NULL at the end */
+static char *next_path(struct input *in)
 {
-	if (len != 32)
-		die("cHRM: invalid chunk length: (%u)", len);
+	ssize_t n;
 
-	int offset, i;
-	uint32_t res[8] = {0};
-	uint32_t wx, wy, rx, ry, gx, gy, bx, by;
+	if (in->argi < in->argc)
+		return strdup(in->argv[in->argi++]);
 
-	offset = 0;
+	while (in->list && (n = getline(&in->line, &in->line_cap, in->list)) > 0) {
+		if (in->line[n - 1] == '\n')
+			in->line[--n] = 0;
 
-	for (i = 0; i < 8; i++) {
-		memcpy(&res[i], data + offset, 4);
-		res[i] = __builtin_bswap32(res[i]);
-		offset += 4;
+		if (n > 0)
+			return strdup(in->line);
 	}
 
-	wx = res[0], wy = res[1];
-	if (wx > 80000 || wy > 80000 || (wx + wy) > 100000)
-		die("cHRM: invalid white point: (x=%u,y=%u)", wx, wy);
-
-	rx = res[2], ry = res[3];
-	if (rx > 80000 || ry > 80000 || (rx + ry) > 100000)
-		die("cHRM: invalid red point: (x=%u,y=%u)", rx, ry);
-
-	gx = res[4], gy = res[5];
-	if (gx > 80000 || gx > 80000 || (gx + gy) > 100000)
-		die("cHRM: invalid green point: (x=%u,y=%u)", gx, gy);
-
-	bx = res[6], by = res[7];
-	if (bx > 80000 || by > 80000 || (bx + by) > 100000)
-		die("cHRM: invalid blue point: (x=%u,y=%u)", bx, by);
-
-	out("White point x = %01.05f", (float)wx / 100000);
-	out("White point y = %01.05f", (float)wy / 100000);
-	out("Red x = %01.05f", (float)rx / 100000);
-	out("Red y = %01.05f", (float)ry / 100000);
-	out("Blue x = %01.05f", (float)gx / 100000);
-	out("Blue y = %01.05f", (float)gy / 100000);
-	out("Green x = %01.05f", (float)bx / 100000);
-	out("Green y = %01.05f", (float)by / 100000);
+	return NULL;
 }
 
-/**
- * iCCP
- *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   profile name (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     uint8     1      compression method (0)
- *  n+2     uint8     m      compressed ICC profile
- */
-static void decode_iccp(const uint8_t *data, const uint32_t len)
+/* next file to check, 0 at the end. the caller frees it */
+static int next_file(struct input *in, struct scan_file *f)
 {
-	uint32_t i, l;
-	char *profile_name;
+	char *path;
 
-	i = 0;
-	l = len;
-
-	profile_name = get_name_or_keyword(data, &i);
-	if (!profile_name)
-		die("iCCP: failed to get profile name");
-
-	out("Profile name = %s", profile_name);
-	free(profile_name);
-	data += i; l -= i;
+	if (!in->scan) {
+		memset(f, 0, sizeof(*f));
+		f->path = next_path(in);
+		return f->path != NULL;
+	}
 
-	out("Compression method = %u (zlib deflate/inflate)", data[0]);
+	/* enough for a batch, the walk of a directory may be one too */
+	while (scan_hungry(in->scan) && (path = next_path(in)))
+		scan_add(in->scan, path);
 
-	data++; l--;
-	out("Profile (compressed) = ......");
+	return scan_next(in->scan, f);
 }
 
-/**
- * tEXt (may appear more than one)
+/*
+ * batch mode
  *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   keyword (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     char      m      text (printable ascii)
+ * every worker has its own deque of jobs and takes the oldest one from
+ * it; a worker that runs dry steals the newest job of another worker.
+ * the main thread reads the file list, deals the jobs out round-robin
+ * and prints the reports, in input order unless -u is given. at most
+ * `window` jobs are in flight so memory stays bounded for long lists.
  */
-static void decode_text(const uint8_t *data, const uint32_t len)
-{
-	uint32_t i, l;
-	char *keyword;
-
-	i = 0;
-	l = len;
-
-	keyword = get_name_or_keyword(data, &i);
-	if (!keyword)
-		die("tEXt: failed to get keyword");
+struct job {
+	struct scan_file file;
+	uint64_t id;
+	struct out report;  /* kept by the slot, for the jobs that follow */
+	char err[256];
+	int failed;
+	int done;
+};
 
-	out("Keyword = %s", keyword);
-	free(keyword);
-	data += i; l -= i;
+struct deque {
+	pthread_mutex_t lock;
+	size_t *seq;  /* ring of job numbers, window entries */
+	size_t head, tail;
+};
 
-	printf("\tText = ");
-	while (l > 0) {
-		if (valid_keyword(*data))
-			putchar(*data);
-		data++; l--;
-	}
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	pthread_mutex_t out_lock;
+	struct job *jobs;  /* job n lives in jobs[n % window] */
+	struct deque *dq;
+	size_t window;
+	size_t queued;  /* jobs sitting in the deques */
+	int nworkers;
+	int closed;
+	int ordered;
+};
 
-	putchar('\n');
-}
+struct worker {
+	struct pool *p;
+	int id;
+};
 
-/**
- * iTXt (may appear more than one)
- *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   keyword (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     uint8     1      compression flag (0=uncompress,1=compress)
- *  n+2     uint8     1      compression method
- *  n+3     char    0 - m    language tag (printable ascii)
- *   m      uint8     1      null separator (\0)
- *  m+1     utf8    0 - o    translated keyword (utf8)
- *   o      uint8     1      null separator (\0)
- *  o+1     utf8    0 - p    text (utf8 or compressed utf8)
- */
-static void decode_itxt(const uint8_t *data, const uint32_t len)
+static void print_report(struct job *j)
 {
-	uint32_t i, l;
-	uint8_t comp_flag;
-	char *buf, *comp;
-
-	i = 0;
-	l = len;
-
-	buf = get_name_or_keyword(data, &i);
-	if (!buf)
-		die("iTXt: failed to get keyword");
-
-	out("Keyword = %s", buf);
-	free(buf);
-	data += i; l -= i;
-
-	comp_flag = !!data[0];
-	comp = comp_flag ? "compressed" : "uncompressed";
-	out("Compression flag = %u (%s)", comp_flag, comp);
+	out_flush(&j->report, stdout);
 
-	data++; l--;
-	if (comp_flag)
-		out("Compression method = %u (zlib deflate/inflate)", data[0]);
-
-	data++; l--;
-	buf = get_name_or_keyword(data, &i);
-	if (!buf)
-		die("iTXt: failed to get language tag");
-
-	out("Language tag = %s", buf);
-	free(buf);
-
-	data += i; l -= i;
-
-	out("Translated keyword (UTF-8) = .....");
-	out("Text (UTF-8) = .....");
+	if (j->failed) {
+		fflush(stdout);
+		fprintf(stderr, "%s: %s\n", j->file.path, j->err);
+	}
 }
 
-/**
- * zTXt (may appear more than one)
- *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   keyword (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     uint8     1      compression method
- *  n+2     uint8     m      compressed text (ascii)
- */
-static void decode_ztxt(const uint8_t *data, const uint32_t len)
+static void deque_push(struct pool *p, int w, size_t seq)
 {
-	uint32_t i, l;
-	char *keyword;
-
-	i = 0;
-	l = len;
+	struct deque *d = &p->dq[w];
 
-	keyword = get_name_or_keyword(data, &i);
-	if (!keyword)
-		die("zTXt: failed to get keyword");
-
-	out("Keyword = %s", keyword);
-	free(keyword);
-	data += i; l -= i;
-
-	out("Compression method = %u (zlib deflate/inflate)", data[0]);
-
-	data++; l--;
-	out("Text (compressed) = .....");
+	pthread_mutex_lock(&d->lock);
+	d->seq[d->tail++ % p->window] = seq;
+	pthread_mutex_unlock(&d->lock);
 }
 
-/**
- * bKGD
- *
- * if indexed color
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      palette index
- *
- * if grayscale or grayscale+alpha
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      gray level
- *
- * if rgb or rgb+alpha
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      red color
- *   2      uint16    2      green color
- *   4      uint16    2      blue color
- */
-static void decode_bkgd(const uint8_t *data, const uint32_t len)
+static int deque_take(struct pool *p, int self, size_t *seq)
 {
-	if (len != 1 && len != 2 && len != 6)
-		die("bKGD: invalid chunk length: (%u)", len);
-
-	uint8_t idx;
-	uint32_t max;
-	uint16_t gray, r, g, b;
-
-	max = bit_depth_max - 1;
-
-	switch (color_type) {
-	case GRAY: case GRAY_ALPHA:
-		memcpy(&gray, data, 2);
-		gray = __builtin_bswap16(gray);
-		if (gray > max)
-			die("bKGD: gray level out of range: (%u)", gray);
-
-		out("Gray level = %u", gray);
-		break;
-	case RGB: case RGB_ALPHA:
-		memcpy(&r, data, 2);
-		r = __builtin_bswap16(r);
-		if (r > max)
-			die("bKGD: red colour out of range: (%u)", r);
-
-		memcpy(&g, data + 2, 2);
-		g = __builtin_bswap16(g);
-		if (g > max)
-			die("bKGD: green colour out of range: (%u)", g);
-
-		memcpy(&b, data + 4, 2);
-		b = __builtin_bswap16(b);
-		if (b > max)
-			die("bKGD: blue colour out of range: (%u)", b);
-
-		if (bit_depth < 16)
-			out("#%02x%02x%02x", r, g, b);
-		else
-			out("#%04x%04x%04x", r, g, b);
-		break;
-	case INDEXED:
-		idx = data[0];
-		if (idx > plt_entry)
-			die("bKGD: palette index out of range: (%u)", idx);
-
-		r = plt[idx][0];
-		g = plt[idx][1];
-		b = plt[idx][2];
-
-		out("[%03u] #%02x%02x%02x", idx, r, g, b);
-		break;
-	default:
-		die("bKGD: invalid color type: (%u)", color_type);
-		break;
-	}
-}
-
-/**
- * sBIT
- *
- * if grayscale
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      significant bits for gray
- *
- * if grayscale+alpha
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      significant bits for gray
- *   1      uint8     1      significant bits for alpha
- *
- * if indexed or rgb
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      significant bits for red
- *   1      uint8     1      significant bits for green
- *   2      uint8     1      significant bits for blue
- *
- * if rgb+alpha
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      significant bits for red
- *   1      uint8     1      significant bits for green
- *   2      uint8     1      significant bits for blue
- *   3      uint8     1      significant bits for alpha
- */
-static void decode_sbit(const uint8_t *data, const uint32_t len)
-{
-	if (len < 1 && len > 4)
-		die("sBIT: invalid chunk length: (%u)", len);
+	struct deque *d;
+	int i, found;
 
-	uint32_t i;
-	uint8_t max;
-	uint8_t bit[4];
-	uint8_t gray, r, g, b, alpha;
+	for (i = 0; i < p->nworkers; i++) {
+		d = &p->dq[(self + i) % p->nworkers];
 
-	max = (color_type == INDEXED) ? 8 : bit_depth;
+		pthread_mutex_lock(&d->lock);
+		found = d->head != d->tail;
+		if (found && i == 0)
+			*seq = d->seq[d->head++ % p->window];  /* own, oldest */
+		else if (found)
+			*seq = d->seq[--d->tail % p->window];  /* steal newest */
+		pthread_mutex_unlock(&d->lock);
 
-	for (i = 0; i < len; i++) {
-		bit[i] = data[i];
-		if (bit[i] > max)
-			die("sBIT: bit value out of range: (%u)", bit[i]);
+		if (found)
+			return 1;
 	}
 
-	if (color_type == GRAY && i == 1) {
-		gray = bit[0];
-		out("gray(%u)", gray);
-	} else if (color_type == GRAY_ALPHA && i == 2) {
-		gray = bit[0];
-		alpha = bit[1];
-		out("gray(%u), alpha(%u)", gray, alpha);
-	} else if ((color_type == INDEXED || color_type == RGB) && i == 3) {
-		r = bit[0];
-		g = bit[1];
-		b = bit[2];
-		out("red(%u), green(%u), blue(%u)", r, g, b);
-	} else if (color_type == RGB_ALPHA && i == 4) {
-		r = bit[0];
-		g = bit[1];
-		b = bit[2];
-		alpha = bit[3];
-		out("red(%u), green(%u), blue(%u), alpha(%u)", r, g, b, alpha);
-	} else {
-		die("sBIT: invalid color type: (%u)", color_type);
-	}
+	return 0;
 }
 
-/**
- * tRNS
- *
- * if grayscale
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      transparency level for gray
- *
- * if indexed
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      transparency level for palette index 0
- *   1      uint8     1      transparency level for palette index 1
- *  ...
- *   n      uint8     1      transparency level for palette index n
- *
- * if rgb
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      transparency level for red
- *   2      uint16    2      transparency level for green
- *   4      uint16    2      transparency level for blue
- */
-static void decode_trns(const uint8_t *data, const uint32_t len)
+static void run_job(struct pool *p, struct job *j)
 {
-	if (color_type != INDEXED && (len != 2 && len != 6))
-		die("tRNS: invalid chunk length: (%u)", len);
-
-	uint32_t i, max;
-	uint16_t gray, r, g, b;
-
-	max = bit_depth_max - 1;
-
-	switch (color_type) {
-	case GRAY:
-		memcpy(&gray, data, 2);
-		gray = __builtin_bswap16(gray);
-		if (gray > max)
-			die("tRNS: gray value out of range: (%u)", gray);
-
-		out("gray(%u)", gray);
-		break;
-	case RGB:
-		memcpy(&r, data, 2);
-		r = __builtin_bswap16(r);
-		if (r > max)
-			die("tRNS: red value out of range: (%u)", r);
-
-		memcpy(&g, data + 2, 2);
-		g = __builtin_bswap16(g);
-		if (g > max)
-			die("tRNS: green value out of range: (%u)", g);
-
-		memcpy(&b, data + 4, 2);
-		b = __builtin_bswap16(b);
-		if (b > max)
-			die("tRNS: blue value out of range: (%u)", b);
-
-		if (bit_depth < 16)
-			out("red(%02x), green(%02x), blue(%02x)", r, g, b);
-		else
-			out("red(%04x), green(%04x), blue(%04x)", r, g, b);
-		break;
-	case INDEXED:
-		for (i = 0; i < len; i++) {
-			printf("\t[%03u] %02x", i, data[i]);
-			if ((i + 1) % 3 == 0)
-				putchar('\n');
-		}
+	j->failed = check_file(&j->file, j->id, &j->report, j->err,
+			       sizeof(j->err));
 
-		if (i % 3 != 0)
-			putchar('\n');
-		break;
-	default:
-		die("tRNS: invalid color type: (%u)", color_type);
-		break;
+	/* what was read ahead is not needed anymore */
+	free(j->file.data);
+	j->file.data = NULL;
+
+	if (!p->ordered) {
+		pthread_mutex_lock(&p->out_lock);
+		print_report(j);
+		pthread_mutex_unlock(&p->out_lock);
 	}
 }
 
-/**
- * sPLT (may appear more than one)
- *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   palette name (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     uint8     1      sample depth (8,16)
- *  n+2    uint8/16  1/2     red color *
- *  n+3    uint8/16  1/2     green color *
- *  n+4    uint8/16  1/2     blue color *
- *  n+5    uint8/16  1/2     alpha *
- *  n+6    uint16     2      frequency
- *
- *  * = if sample depth is 8, then type is uint8 and each length is 1
- *      otherwise, it's 16, then type is uint16 and each length is 2
- */
-static void decode_splt(const uint8_t *data, const uint32_t len)
+static void *worker_main(void *arg)
 {
-	/* at least 1 character palette name, null, and sample depth */
-	if (len < 3)
-		die("sPLT: invalid chunk length: (%u)", len);
-
-	char *palette_name;
-	uint8_t sample_depth;
-	uint32_t col, entry, i, l, step;
-
-	i = 0;
-	l = len;
-	col = 0;
-
-	palette_name = get_name_or_keyword(data, &i);
-	if (!palette_name)
-		die("sPLT: failed to get palette name");
-
-	out("Palette name = %s", palette_name);
-	free(palette_name);
-	data += i;
-	l -= i;
-
-	sample_depth = data[0];
-	if (sample_depth != 8 && sample_depth != 16)
-		die("sPLT: invalid sample depth: (%u)", sample_depth);
-
-	out("Sample depth = %u", sample_depth);
-
-	data++; l--;
-	if ((l % 6) != 0 && (l % 10) != 0)
-		die("sPLT: invalid palette length: (%u)", l);
-
-	if (sample_depth == 8) {
-		entry = l / 6;
-		step = 6;
-	} else {
-		entry = l / 10;
-		step = 10;
-	}
+	struct worker *w = arg;
+	struct pool *p = w->p;
+	size_t seq;
 
-	out("Entries = %u", entry);
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->queued == 0 && !p->closed)
+			pthread_cond_wait(&p->work, &p->lock);
 
-	for (i = 0; i < entry; i++, col += step) {
-		printf("\t[%03u] ", i);
-		if (sample_depth == 8) {
-			printf("#%02x", data[col]);
-			printf("%02x", data[col+1]);
-			printf("%02x", data[col+2]);
-			printf("%02x", data[col+3]);
-			printf(" (%02x%02x)", data[col+4], data[col+5]);
-		} else {
-			printf("#%02x%02x", data[col], data[col+1]);
-			printf("%02x%02x", data[col+2], data[col+3]);
-			printf("%02x%02x", data[col+4], data[col+5]);
-			printf("%02x%02x", data[col+6], data[col+7]);
-			printf(" (%02x%02x)", data[col+8], data[col+9]);
+		if (p->queued == 0) {
+			pthread_mutex_unlock(&p->lock);
+			break;
 		}
-		if ((i + 1) % 3 == 0)
-			putchar('\n');
-	}
-
-	if (i % 3 != 0)
-		putchar('\n');
-}
-
-/**
- * hIST
- *
- * entry = chunk length / 2
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint16    2      frequency of used for palette index 0
- *   2      uint16    2      frequency of used for palette index 1
- *   4      uint16    2      frequency of used for palette index 2
- *  ...
- *   n      uint16    2      frequency of used for palette index n
- */
-static void decode_hist(const uint8_t *data, const uint32_t len)
-{
-	if (len % 2 != 0)
-		die("hIST: invalid chunk length: (%u)", len);
-
-	if (plt_entry == 0)
-		die("hIST: cannot find PLTE chunk");
 
-	int off;
-	uint16_t h;
-	uint32_t i, entry;
+		p->queued--;  /* one of the queued jobs is ours now */
+		pthread_mutex_unlock(&p->lock);
 
-	h = 0;
-	off = 0;
-	entry = len / 2;
+		while (!deque_take(p, w->id, &seq))
+			;
 
-	out("Entries = %u", entry);
+		run_job(p, &p->jobs[seq % p->window]);
 
-	for (i = 0; i < entry; i++) {
-		memcpy(&h, data + off, 2);
-		h = __builtin_bswap16(h);
-		off += 2;
-		printf("\t[%03u] %u  ", i, h);
-		if ((i + 1) % 3 == 0)
-			putchar('\n');
+		pthread_mutex_lock(&p->lock);
+		p->jobs[seq % p->window].done = 1;
+		pthread_cond_broadcast(&p->done);
+		pthread_mutex_unlock(&p->lock);
 	}
 
-	if (i % 3 != 0)
-		putchar('\n');
-}
-
-/**
- * oFFs
- *
- * offset   type    length   value
- * -------------------------------
- *   0      int32     4      x position
- *   4      int32     4      y position
- *   8      uint8     1      unit (0=pixel,1=micrometer)
- */
-static void decode_ext_offs(const uint8_t *data, const uint32_t len)
-{
-	if (len != 9)
-		die("oFFs: invalid chunk length: (%u)", len);
-
-	char *unit;
-	uint32_t x, y;
-
-	x = y = 0;
-	unit = !!data[8] ? "micrometres" : "pixels";
-
-	memcpy(&x, data, 4);
-	x = __builtin_bswap32(x);
-
-	memcpy(&y, data + 4, 4);
-	y = __builtin_bswap32(y);
-
-	out("Image position = %d x %d %s", (int32_t)x, (int32_t)y, unit);
+	return NULL;
 }
 
-/**
- * sCAL
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      unit (1=meter,2=radian)
- *   1      char    1 - n    pixel width (ascii floating-point)
- *   n      uint8     1      null separator (\0)
- *  n+1     char    1 - m    pixel height (ascii floating-point)
- */
-static void decode_ext_scal(const uint8_t *data, const uint32_t len)
+/* wait for job n, print it if needed and free its slot */
+static int retire_job(struct pool *p, size_t n)
 {
-	if (data[0] < 1 && data[0] > 2)
-		die("sCAL: invalid unit specifier: (%u)", len);
+	struct job *j = &p->jobs[n % p->window];
+	struct out report;
+	int failed;
 
-	char *unit;
-	uint32_t l;
+	pthread_mutex_lock(&p->lock);
+	while (!j->done)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
 
-	unit = data[0] == 1 ? "meters" : "radians";
-	l = len;
+	if (p->ordered)
+		print_report(j);
 
-	data++; l--; /* next */
-	printf("\tPhysical scale = ");
-	while (*data) {
-		if (valid_keyword(*data))
-			putchar(*data);
-		data++; l--;
-	}
+	failed = j->failed;
+	scan_file_free(&j->file);
+	report = j->report;
+	memset(j, 0, sizeof(*j));
+	j->report = report;
 
-	data++; l--; /* next */
-	printf(" x ");
-	while (l > 0) {
-		if (valid_keyword(*data))
-			putchar(*data);
-		data++; l--;
-	}
-	printf(" (%s)\n", unit);
+	return failed;
 }
 
-/**
- * pCAL
- *
- * offset   type    length   value
- * -------------------------------
- *   0      char    1 - 79   calibration name (printable ascii)
- *   n      uint8     1      null separator (\0)
- *  n+1     int32     4      original zero (x0)
- *  n+5     int32     4      original max (x1)
- *  n+9     uint8     1      equation type (0,1,2,3)
- *  n+10    uint8     1      number of parameters
- *  n+11    char    0 - m    unit name (printable ascii)
- *   m      uint8     1      null separator (\0)
- *  m+1     char    1 - p    parameter 0 (p0) (floating-point ascii)
- *   p      uint8     1      null separator (\0)
- *  p+1     char    1 - o    parameter 1 (p1) (floating-point ascii)
- */
-static void decode_ext_pcal(const uint8_t *data, const uint32_t len)
+static int run_batch(struct input *in, int nworkers, int ordered)
 {
-	uint8_t eq_type, params;
-	char *name;
-	const char *eq_str;
-	uint32_t i, l, x0, x1;
-	const char *eq_arr[5] = {
-		"linear", "exponential",
-		"exponential arbitrary base", "hyperbolic sinusoidal",
-		NULL
-	};
-
-	l = len;
-	i = x0 = x1 = 0;
-
-	/* get calibration name */
-	name = get_name_or_keyword(data, &i);
-	if (!name)
-		die("pCAL: failed to get calibration name");
-
-	out("Calibration name = %s", name);
-	free(name);
-
-	name = NULL;
-	data += i; l -= i;
-
-	/* get x0 and x1 */
-	memcpy(&x0, data, 4);
-	x0 = __builtin_bswap32(x0);
-	data += 4; l-= 4;
+	struct pool p;
+	struct worker *w;
+	pthread_t *tid;
+	struct scan_file f;
+	size_t seq, retired;
+	int i, failed;
 
-	memcpy(&x1, data, 4);
-	x1 = __builtin_bswap32(x1);
-	data += 4; l-= 4;
+	memset(&p, 0, sizeof(p));
+	p.nworkers = nworkers;
+	p.ordered = ordered;
+	p.window = (size_t)nworkers * 64;
 
-	out("Linear conversion = %d x %d", (int32_t)x0, (int32_t)x1);
+	p.jobs = calloc(p.window, sizeof(*p.jobs));
+	p.dq = calloc(nworkers, sizeof(*p.dq));
+	w = calloc(nworkers, sizeof(*w));
+	tid = calloc(nworkers, sizeof(*tid));
+	if (!p.jobs || !p.dq || !w || !tid)
+		fatal("out of memory");
 
-	/* get equation type */
-	eq_type = data[0];
-	if (eq_type > 3)
-		die("pCAL: invalid equation type: (%u)", eq_type);
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_mutex_init(&p.out_lock, NULL);
+	pthread_cond_init(&p.work, NULL);
+	pthread_cond_init(&p.done, NULL);
 
-	eq_str = eq_arr[eq_type];
-	out("Equation type = %u (%s)", eq_type, eq_str);
+	for (i = 0; i < nworkers; i++) {
+		pthread_mutex_init(&p.dq[i].lock, NULL);
+		p.dq[i].seq = calloc(p.window, sizeof(size_t));
+		if (!p.dq[i].seq)
+			fatal("out of memory");
 
-	data++; l--; /* next */
-
-	/* get total of parameters */
-	params = data[0];
-	out("Parameters = %u", params);
+		w[i].p = &p;
+		w[i].id = i;
+		if (pthread_create(&tid[i], NULL, worker_main, &w[i]))
+			fatal("failed to start worker thread");
+	}
 
-	data++; l--; /* next */
+	seq = retired = 0;
+	failed = 0;
 
-	/* get unit name */
-	name = get_name_or_keyword(data, &i);
-	if (!name)
-		die("pCAL: failed to get unit name");
+	while (next_file(in, &f)) {
+		if (seq - retired == p.window)
+			failed |= retire_job(&p, retired++);
 
-	out("Unit name = %s", name);
-	free(name);
+		p.jobs[seq % p.window].file = f;
+		p.jobs[seq % p.window].id = seq;
+		deque_push(&p, seq % nworkers, seq);
 
-	data += i; l -= i;
+		pthread_mutex_lock(&p.lock);
+		p.queued++;
+		pthread_cond_signal(&p.work);
+		pthread_mutex_unlock(&p.lock);
 
-	/* print all values */
-	printf("\tValues = ");
-	while (l > 0) {
-		if (valid_keyword(*data))
-			putchar(*data);
-		else
-			printf(", ");
-		data++; l--;
+		seq++;
 	}
 
-	putchar('\n');
-}
+	pthread_mutex_lock(&p.lock);
+	p.closed = 1;
+	pthread_cond_broadcast(&p.work);
+	pthread_mutex_unlock(&p.lock);
 
-/**
- * gIFg
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      disposal method
- *   1      uint8     1      user input flag
- *   2      uint16    2      delay time
- */
-static void decode_ext_gifg(const uint8_t *data, const uint32_t len)
-{
-	if (len != 4)
-		die("gIFg: invalid chunk length: (%u)", len);
+	while (retired < seq)
+		failed |= retire_job(&p, retired++);
 
-	uint8_t dis, input;
-	uint16_t delay_time;
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(tid[i], NULL);
+		pthread_mutex_destroy(&p.dq[i].lock);
+		free(p.dq[i].seq);
+	}
 
-	dis = data[0];
-	input = data[1];
-	delay_time = 0;
+	for (seq = 0; seq < p.window; seq++)
+		out_free(&p.jobs[seq].report);
 
-	memcpy(&delay_time, data + 2, 2);
-	delay_time = __builtin_bswap16(delay_time);
+	pthread_cond_destroy(&p.done);
+	pthread_cond_destroy(&p.work);
+	pthread_mutex_destroy(&p.out_lock);
+	pthread_mutex_destroy(&p.lock);
+	free(tid);
+	free(w);
+	free(p.dq);
+	free(p.jobs);
 
-	out("Disposal method = %u", dis);
-	out("User input = %u", input);
-	out("Delay time = %lf seconds", (double).01 * delay_time);
+	return failed;
 }
 
-/**
- * sTER
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     1      layout mode (0=cross-fuse,1=diverging-fuse)
- */
-static void decode_ext_ster(const uint8_t *data, const uint32_t len)
+static int run_serial(struct input *in)
 {
-	if (len != 1)
-		die("sTER: invalid chunk length: (%u)", len);
-
-	if (data[0] > 1)
-		die("sTER: invalid layout: (%u)", data[0]);
+	struct out o = { 0 };
+	struct scan_file f;
+	char err[256];
+	uint64_t id;
+	int failed;
 
-	char *layout = !!data[0] ? "Diverging-fuse" : "Cross-fuse";
+	failed = 0;
+	for (id = 0; next_file(in, &f); id++) {
+		if (check_file(&f, id, &o, err, sizeof(err))) {
+			out_flush(&o, stdout);
+			fflush(stdout);
+			fprintf(stderr, "%s: %s\n", f.path, err);
+			failed = 1;
+		}
+		out_flush(&o, stdout);
+		scan_file_free(&f);
+	}
 
-	out("Layout = %s layout", layout);
+	out_free(&o);
+	return failed;
 }
 
-/**
- * gIFx
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint8     8      application identifier (printable ascii)
- *   8      uint8     3      authentication code
- *   11     ?????     n      application data
- */
-static void decode_ext_gifx(const uint8_t *data, const uint32_t len)
+static void usage(const char *prog)
 {
-	if (len < 11)
-		die("gIFx: invalid chunk length: (%u)", len);
-
-	out("Application ID = %.*s", 8, (char *)data);
-	out("Authentication code = %02x%02x%02x", data[8], data[9], data[10]);
-	out("Application data = .....");
+	fatal("usage: %s [-j jobs] [-t threads] [-u] [-r] "
+	      "[--verify=none|meta|crc|inflate|full] "
+	      "[--header-only[=ihdr|idat]] [--format=text|ndjson|csv|binary] "
+	      "[--recover] [--inflate-max=bytes] [--inflate-ratio=n] "
+	      "[--cache index] [--cache-prune[=days]] "
+	      "[--files-from list] file.png|dir...",
+	      prog);
 }
 
-/**
- * acTL
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      number of frames
- *   4      uint32    4      number of looping (0=infinite looping)
- */
-static void decode_apng_actl(const uint8_t *data, const uint32_t len)
+static enum ci_verify verify_level(const char *name)
 {
-	if (len != 8)
-		die("acTL: invalid chunk length: (%u)", len);
-
-	uint32_t nframes, nplays;
-
-	nframes = nplays = 0;
-
-	memcpy(&nframes, data, 4);
-	nframes = __builtin_bswap32(nframes);
-
-	memcpy(&nplays, data + 4, 4);
-	nplays = __builtin_bswap32(nplays);
-
-	out("Number of frames = %u", nframes);
-	out("Number of plays = %u %s", nplays, nplays ? "" : "(infinite)");
-}
-
-/**
- * fcTL
- *
- * offset   type    length   value
- * -------------------------------
- *   0      uint32    4      sequence of chunk animation, start from 0
- *   4      uint32    4      width frame
- *   8      uint32    4      height frame
- *   12     uint32    4      X position
- *   16     uint32    4      Y position
- *   20     uint16    2      frame delay fraction numerator
- *   23     uint16    2      frame delay fraction denominator
- *   24     uint8     1      frame disposal type (0,1,2)
- *   25     uint8     1      frame blend type (0,1)
- */
-static void decode_apng_fctl(const uint8_t *data, const uint32_t len)
-{
-	if (len != 26)
-		die("fcTL: invalid chunk length: (%u)", len);
-
-	uint8_t i;
-	int offset;
-	const char *dispose, *blend;
-	const char *bl_str[3] = { "Source", "Over", NULL };
-	const char *dis_str[4] = { "None", "Background", "Previous", NULL };
-
-	uint32_t buf1[4] = {0}; /* width, height, x_offset, y_offset */
-	uint16_t buf2[2] = {0}; /* delay_nums, delay_den */
-	uint8_t buf3[2] = {0}; /* dispose_op, blend_op */
-
-	offset = 4; /* skip sequence_number for now */
-	for (i = 0; i < 4; i++) {
-		memcpy(&buf1[i], data + offset, 4);
-		buf1[i] = __builtin_bswap32(buf1[i]);
-		offset += 4;
-	}
+	static const char *level[] = {
+		[CI_VERIFY_NONE] = "none",
+		[CI_VERIFY_META] = "meta",
+		[CI_VERIFY_CRC] = "crc",
+		[CI_VERIFY_INFLATE] = "inflate",
+		[CI_VERIFY_FULL] = "full"
+	};
+	size_t i;
 
-	for (i = 0; i < 2; i++) {
-		memcpy(&buf2[i], data + offset, 2);
-		buf2[i] = __builtin_bswap16(buf2[i]);
-		offset += 2;
+	for (i = 0; i < sizeof(level) / sizeof(level[0]); i++) {
+		if (!strcmp(name, level[i]))
+			return i;
 	}
 
-	buf3[0] = data[offset];
-	if (buf3[0] > 3)
-		die("fcTL: invalid disposal method");
-	dispose = dis_str[buf3[0]];
-
-	buf3[1] = data[offset + 1];
-	if (buf3[1] > 1)
-		die("fcTL: invalid blend method");
-	blend = bl_str[buf3[1]];
-
-	out("Width = %u", buf1[0]);
-	out("Height = %u", buf1[1]);
-	out("X offset = %u", buf1[2]);
-	out("Y offset = %u", buf1[3]);
-	out("Delays = %u (denominator %u)", buf2[0], buf2[1]);
-	out("Disposal = %u (%s)", buf3[0], dispose);
-	out("Blend = %u (%s)", buf3[1], blend);
-}
-
-#define decode_if(what, decode_func)			\
-	do {						\
-		if (!strcmp(type, what)) {		\
-			decode_func(data, len);		\
-			return;				\
-		}					\
-	} while (0)
-
-static void decode_chunk_data(const uint8_t *data,
-			      const char *type,
-			      const uint32_t len)
-{
-	/* Critical chunks */
-	decode_if("IHDR", decode_ihdr);
-	decode_if("PLTE", decode_plte);
-	decode_if("IDAT", decode_idat);
-
-	/* ancillary chunks */
-	decode_if("tIME", decode_time);
-	decode_if("pHYs", decode_phys);
-	decode_if("sRGB", decode_srgb);
-	decode_if("gAMA", decode_gama);
-	decode_if("cHRM", decode_chrm);
-	decode_if("iCCP", decode_iccp);
-	decode_if("tEXt", decode_text);
-	decode_if("iTXt", decode_itxt);
-	decode_if("zTXt", decode_ztxt);
-	decode_if("bKGD", decode_bkgd);
-	decode_if("sBIT", decode_sbit);
-	decode_if("tRNS", decode_trns);
-	decode_if("sPLT", decode_splt);
-	decode_if("hIST", decode_hist);
-
-	/* official PNG extension chunks */
-	decode_if("oFFs", decode_ext_offs);
-	decode_if("sCAL", decode_ext_scal);
-	decode_if("pCAL", decode_ext_pcal);
-	decode_if("gIFx", decode_ext_gifx);
-	decode_if("gIFg", decode_ext_gifg);
-	decode_if("sTER", decode_ext_ster);
-
-	/* APNG */
-	decode_if("acTL", decode_apng_actl);
-	decode_if("fcTL", decode_apng_fctl);
-
-	/* no decoder yet... */
-	out(".....");
+	fatal("invalid verify level: %s", name);
 }
 
-static void read_chunk(FILE *f)
+int main(int argc, char **argv)
 {
-	int not_iend, i;
-
-	i = 0;
-	not_iend = 1;
-
-	while (not_iend) {
-		if (i == MAX_CHUNK)
+	struct input in;
+	int i, jobs, ordered, recurse, failed, prune;
+	const char *cache_path;
+	unsigned long lim;
+	size_t kept, dropped;
+	char *end, err[256];
+
+	memset(&in, 0, sizeof(in));
+	jobs = 1;
+	ordered = 1;
+	recurse = 0;
+	cache_path = NULL;
+	prune = -1;
+
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
 			break;
-
-		if (i > 0 && (feof(f) || ferror(f)))
-			die("failed to read chunk");
-
-		long offset;
-		uint8_t *data;
-		char type[5] = {0};
-		uint32_t check, chunk_crc, size;
-
-		errno = 0;
-		data = NULL;
-
-		/* read chunk length */
-		size = fread_u32(f);
-		if (errno)
-			die("failed to get chunk length");
-
-		if (size > INT_MAX - 1)
-			die("chunk length out of range: (%u)", size);
-
-		/* get current chunk offset */
-		offset = ftell(f);
-		if (offset < 0)
-			die("failed to get chunk offset");
-
-		/* read chunk type */
-		if (fread(type, 1, 4, f) != 4)
-			die("failed to get chunk type");
-
-		if (i == 0 && strcmp(type, "IHDR"))
-			die("first chunk found is not IHDR");
-
-		if (!strcmp(type, "IEND"))
-			not_iend = 0;
-
-		/* crc chunk type to check */
-		check = pd_crc32(0u, type, 4);
-
-		/* read chunk data */
-		if (size > 0) {
-			data = malloc(size);
-			if (!data)
-				die("failed to read chunk data");
-
-			if (fread(data, 1, size, f) != size) {
-				free(data);
-				die("failed to read chunk data");
-			}
-
-			/* crc chunk data to check */
-			check = pd_crc32(check, data, size);
-		}
-
-		/* read chunk crc */
-		chunk_crc = fread_u32(f);
-		if (errno)
-			die("failed to get chunk crc");
-
-		if (chunk_crc == check) {
-			printf("[%s] length %u at offset 0x%08lx (%04x)\n",
-					type, size, offset, chunk_crc);
-			if (size > 0) {
-				decode_chunk_data(data, type, size);
-				free(data);
-			} else {
-				out("No data");
-			};
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			errno = 0;
+			jobs = strtol(argv[++i], &end, 10);
+			if (errno || *end || jobs < 1 || jobs > 1024)
+				fatal("invalid number of jobs: %s", argv[i]);
+		} else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+			errno = 0;
+			opt.threads = strtol(argv[++i], &end, 10);
+			if (errno || *end || opt.threads < 1 || opt.threads > 64)
+				fatal("invalid number of threads: %s", argv[i]);
+		} else if (!strcmp(argv[i], "-u")) {
+			ordered = 0;
+		} else if (!strcmp(argv[i], "-r")) {
+			recurse = 1;
+		} else if (!strncmp(argv[i], "--verify=", 9)) {
+			opt.verify = verify_level(argv[i] + 9);
+		} else if (!strcmp(argv[i], "--header-only") ||
+			   !strcmp(argv[i], "--header-only=ihdr")) {
+			opt.stop = CI_STOP_IHDR;
+		} else if (!strcmp(argv[i], "--header-only=idat")) {
+			opt.stop = CI_STOP_IDAT;
+		} else if (!strcmp(argv[i], "--format=text")) {
+			opt.format = OUT_TEXT;
+		} else if (!strcmp(argv[i], "--format=ndjson")) {
+			opt.format = OUT_NDJSON;
+		} else if (!strcmp(argv[i], "--format=csv")) {
+			opt.format = OUT_CSV;
+		} else if (!strcmp(argv[i], "--format=binary")) {
+			opt.format = OUT_BINARY;
+		} else if (!strcmp(argv[i], "--recover")) {
+			opt.recover = 1;
+		} else if (!strncmp(argv[i], "--inflate-max=", 14)) {
+			errno = 0;
+			opt.inflate_max = strtoull(argv[i] + 14, &end, 10);
+			if (errno || *end || !isdigit((unsigned char)argv[i][14]))
+				fatal("invalid inflate limit: %s", argv[i] + 14);
+		} else if (!strncmp(argv[i], "--inflate-ratio=", 16)) {
+			errno = 0;
+			lim = strtoul(argv[i] + 16, &end, 10);
+			if (errno || *end || !isdigit((unsigned char)argv[i][16]) ||
+			    lim > UINT_MAX)
+				fatal("invalid inflate ratio: %s", argv[i] + 16);
+			opt.inflate_ratio = lim;
+		} else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cache_path = argv[++i];
+		} else if (!strcmp(argv[i], "--cache-prune")) {
+			prune = 0;
+		} else if (!strncmp(argv[i], "--cache-prune=", 14)) {
+			errno = 0;
+			lim = strtoul(argv[i] + 14, &end, 10);
+			if (errno || *end || !isdigit((unsigned char)argv[i][14]) ||
+			    lim < 1 || lim > INT_MAX / (24 * 60 * 60))
+				fatal("invalid number of days: %s", argv[i] + 14);
+			prune = lim;
+		} else if (!strcmp(argv[i], "--files-from") && i + 1 < argc) {
+			if (in.list)
+				usage(argv[0]);
+
+			i++;
+			in.list = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
+			if (!in.list)
+				fatal("%s: failed to open file list", argv[i]);
 		} else {
-			if (size > 0)
-				free(data);
-			die("%s: corrupted crc", type);
+			usage(argv[0]);
 		}
-
-		i++;
-		putchar('\n');
 	}
 
-	printf("All OK.\n");
-	printf("Found %d chunks from %s\n", i, pngf);
-}
+	in.argv = argv + i;
+	in.argc = argc - i;
 
-int main(int argc, char **argv)
-{
-	if (argc < 2)
-		die("usage: %s file.png", argv[0]);
+	/* pruning needs no file */
+	if ((in.argc == 0 && !in.list && prune < 0) || (prune >= 0 && !cache_path))
+		usage(argv[0]);
 
-	FILE *f;
-
-	pngf = argv[1];
-	errno = 0;
-
-	f = fopen(pngf, "rb");
-	if (!f)
-		die("%s: failed to open file", pngf);
-
-	if (png_ok(f)) {
-		read_chunk(f);
-	} else {
-		fclose(f);
-		die("%s: not a valid PNG file", pngf);
+	if (cache_path) {
+		cache = cache_open(cache_path, options_hash(), prune, err, sizeof(err));
+		if (!cache)
+			fatal("%s", err);
 	}
 
-	fclose(f);
-	return errno;
-}
-
-/* private util functions */
-static uint32_t pd_crc32(uint32_t crc, const void *buf, size_t len)
-{
-	static const uint32_t crc32_table[] = {
-		0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419,
-		0x706af48f, 0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4,
-		0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07,
-		0x90bf1d91, 0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-		0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7, 0x136c9856,
-		0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
-		0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4,
-		0xa2677172, 0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-		0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940, 0x32d86ce3,
-		0x45df5c75, 0xdcd60dcf, 0xabd13d59, 0x26d930ac, 0x51de003a,
-		0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423, 0xcfba9599,
-		0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-		0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190,
-		0x01db7106, 0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f,
-		0x9fbfe4a5, 0xe8b8d433, 0x7807c9a2, 0x0f00f934, 0x9609a88e,
-		0xe10e9818, 0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-		0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e, 0x6c0695ed,
-		0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-		0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3,
-		0xfbd44c65, 0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-		0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a,
-		0x346ed9fc, 0xad678846, 0xda60b8d0, 0x44042d73, 0x33031de5,
-		0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa, 0xbe0b1010,
-		0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-		0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17,
-		0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6,
-		0x03b6e20c, 0x74b1d29a, 0xead54739, 0x9dd277af, 0x04db2615,
-		0x73dc1683, 0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-		0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1, 0xf00f9344,
-		0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-		0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a,
-		0x67dd4acc, 0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-		0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252, 0xd1bb67f1,
-		0xa6bc5767, 0x3fb506dd, 0x48b2364b, 0xd80d2bda, 0xaf0a1b4c,
-		0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55, 0x316e8eef,
-		0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-		0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe,
-		0xb2bd0b28, 0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31,
-		0x2cd99e8b, 0x5bdeae1d, 0x9b64c2b0, 0xec63f226, 0x756aa39c,
-		0x026d930a, 0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-		0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38, 0x92d28e9b,
-		0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-		0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1,
-		0x18b74777, 0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-		0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45, 0xa00ae278,
-		0xd70dd2ee, 0x4e048354, 0x3903b3c2, 0xa7672661, 0xd06016f7,
-		0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc, 0x40df0b66,
-		0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-		0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605,
-		0xcdd70693, 0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8,
-		0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b,
-		0x2d02ef8d
-	};
-
-	const unsigned char *p;
-	size_t n;
-
-	p = buf;
-
-	crc ^= 0xffffffff;
-	for (n = 0; n < len; n++)
-		crc = crc32_table[(crc ^ p[n]) & 0xff] ^ (crc >> 8);
-
-	return crc ^ 0xffffffff;
-}
-
-static uint32_t fread_u32(FILE *f)
-{
-	uint32_t ret;
+	/* the signature and IHDR is all --header-only reads */
+	if (recurse)
+		in.scan = scan_new(128 << 10,
+				   opt.stop == CI_STOP_IHDR ? 8 + 25 : 0,
+				   cache ? in_cache : NULL, NULL);
+	if (recurse && !in.scan)
+		fatal("out of memory");
+
+	/* records go out in big writes, and not to a terminal */
+	if (opt.format == OUT_BINARY) {
+		if (isatty(STDOUT_FILENO))
+			fatal("binary output to a terminal, redirect it");
+		setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+	}
 
-	ret = 0;
-	if (fread(&ret, 4, 1, f) != 1)
-		errno = EIO;
+	if (opt.format == OUT_CSV || opt.format == OUT_BINARY) {
+		struct out o = { 0 };
 
-	return __builtin_bswap32(ret);
-}
+		report_header(opt.format, &o);
+		out_flush(&o, stdout);
+		out_free(&o);
+	}
 
-static char *get_name_or_keyword(const uint8_t *data, uint32_t *len)
-{
-	if (data && len) {
-		size_t i;
-		char *ret;
-
-		ret = calloc(80, 1);
-		if (!ret)
-			return NULL;
-
-		for (i = 0; i < 79; i++) {
-			if (data[i] && valid_keyword(data[i]))
-				ret[i] = data[i];
-			else
-				break;
-		}
+	if (jobs > 1)
+		failed = run_batch(&in, jobs, ordered);
+	else
+		failed = run_serial(&in);
 
-		ret[i] = 0;
-		*len = i + 1;  /* + 1 null character */
-		return ret;
+	if (in.scan) {
+		failed |= scan_failed(in.scan);
+		scan_free(in.scan);
+	}
+	if (in.list && in.list != stdin)
+		fclose(in.list);
+	free(in.line);
+
+	if (cache) {
+		if (cache_close(cache, &kept, &dropped, err, sizeof(err)))
+			fatal("%s", err);
+		if (prune >= 0)
+			fprintf(stderr, "%s: %zu entries kept, %zu dropped\n",
+				cache_path, kept, dropped);
 	}
 
-	return NULL;
+	return failed;
 }
 
-static void die(const char *msg, ...)
+static void fatal(const char *msg, ...)
 {
 	va_list ap;
 
 	va_start(ap, msg);
 	vfprintf(stderr, msg, ap);
-	if (errno)
-		fprintf(stderr, " (%s)\n", strerror(errno));
-	else
-		fputc('\n', stderr);
+	fputc('\n', stderr);
 	va_end(ap);
 
 	exit(1);
 }
-
-static void out(const char *msg, ...)
-{
-	va_list ap;
-
-	va_start(ap, msg);
-	fputc('\t', stdout);
-	vfprintf(stdout, msg, ap);
-	fputc('\n', stdout);
-	va_end(ap);
-}
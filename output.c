@@ -0,0 +1,555 @@
+/*
+ * output - reports of the checked files, as text, NDJSON or CSV
+ *
+ * Reports are made in a buffer that grows to the biggest one and is
+ * then reused, and are written in one go once a file is done. Numbers
+ * are formatted by hand, this runs for every chunk of millions of files.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+static void grow(struct out *o, size_t n)
+{
+	size_t cap;
+	char *tmp;
+
+	if (o->cap - o->len >= n)
+		return;
+
+	cap = o->cap ? o->cap : 65536;
+	while (cap - o->len < n)
+		cap *= 2;
+
+	tmp = realloc(o->buf, cap);
+	if (!tmp) {
+		fputs("out of memory\n", stderr);
+		exit(1);
+	}
+
+	o->buf = tmp;
+	o->cap = cap;
+}
+
+static void put(struct out *o, const char *s, size_t n)
+{
+	grow(o, n);
+	memcpy(o->buf + o->len, s, n);
+	o->len += n;
+}
+
+static void put_str(struct out *o, const char *s)
+{
+	put(o, s, strlen(s));
+}
+
+static void put_char(struct out *o, char c)
+{
+	grow(o, 1);
+	o->buf[o->len++] = c;
+}
+
+/* v in base 10 or 16, at least width digits */
+static void put_num(struct out *o, uint64_t v, unsigned base, int width)
+{
+	static const char digit[] = "0123456789abcdef";
+	char tmp[20];
+	int n;
+
+	n = 0;
+	do {
+		tmp[n++] = digit[v % base];
+		v /= base;
+	} while (v);
+
+	grow(o, width > n ? width : n);
+	for (; width > n; width--)
+		o->buf[o->len++] = '0';
+	while (n > 0)
+		o->buf[o->len++] = tmp[--n];
+}
+
+static void put_dec(struct out *o, uint64_t v)
+{
+	put_num(o, v, 10, 0);
+}
+
+static void le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void le64(uint8_t *p, uint64_t v)
+{
+	le32(p, v);
+	le32(p + 4, v >> 32);
+}
+
+/* s as a JSON string, control bytes escaped */
+static void put_json(struct out *o, const char *s, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i, k;
+	uint8_t c;
+
+	put_char(o, '"');
+	for (i = 0; i < n; i = k + 1) {
+		for (k = i; k < n; k++) {
+			c = s[k];
+			if (c < 0x20 || c == '"' || c == '\\')
+				break;
+		}
+		put(o, s + i, k - i);
+		if (k == n)
+			break;
+
+		c = s[k];
+		if (c == '"' || c == '\\') {
+			put_char(o, '\\');
+			put_char(o, c);
+		} else if (c == '\n') {
+			put(o, "\\n", 2);
+		} else if (c == '\t') {
+			put(o, "\\t", 2);
+		} else {
+			put(o, "\\u00", 4);
+			put_char(o, hex[c >> 4]);
+			put_char(o, hex[c & 15]);
+		}
+	}
+	put_char(o, '"');
+}
+
+/* s inside a quoted CSV cell, quotes doubled */
+static void put_csv(struct out *o, const char *s, size_t n)
+{
+	const char *q;
+
+	while ((q = memchr(s, '"', n))) {
+		put(o, s, q - s + 1);
+		put_char(o, '"');
+		n -= q - s + 1;
+		s = q + 1;
+	}
+	put(o, s, n);
+}
+
+void out_free(struct out *o)
+{
+	free(o->buf);
+	memset(o, 0, sizeof(*o));
+}
+
+void out_flush(struct out *o, FILE *f)
+{
+	if (o->len > 0)
+		fwrite(o->buf, 1, o->len, f);
+	o->len = 0;
+}
+
+void report_header(enum out_format format, struct out *o)
+{
+	uint8_t hdr[OUT_BIN_HEADER];
+
+	if (format == OUT_CSV)
+		put_str(o, "file,index,type,length,offset,crc,fields\n");
+
+	if (format == OUT_BINARY) {
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, "CHUNKREC", 8);
+		le32(hdr + 8, 1);
+		le32(hdr + 12, OUT_BIN_RECORD);
+		le32(hdr + 16, OUT_BIN_HEADER);
+		put(o, (const char *)hdr, sizeof(hdr));
+	}
+}
+
+void report_begin(struct report *rep, enum out_format format, struct out *o,
+		  const char *path, uint64_t id)
+{
+	memset(rep, 0, sizeof(*rep));
+	rep->format = format;
+	rep->o = o;
+	rep->path = path;
+	rep->id = id;
+
+	if (format == OUT_NDJSON) {
+		put_str(o, "{\"file\":");
+		put_json(o, path, strlen(path));
+		put_str(o, ",\"chunks\":[");
+	}
+}
+
+/* the last chunk is done, its fields all came */
+static void close_chunk(struct report *rep)
+{
+	if (!rep->open)
+		return;
+	rep->open = 0;
+
+	if (rep->format == OUT_NDJSON)
+		put(rep->o, "]}", 2);
+	else if (rep->format == OUT_CSV)
+		put(rep->o, "\"\n", 2);
+	else if (rep->format == OUT_BINARY)
+		put(rep->o, (const char *)rep->rec, sizeof(rep->rec));
+}
+
+/* text: list entries are printed three per line */
+static void end_entries(struct report *rep)
+{
+	if (rep->entries % 3 != 0)
+		put_char(rep->o, '\n');
+
+	rep->entries = 0;
+}
+
+void report_chunk(void *user, const struct ci_chunk *c)
+{
+	struct report *rep = user;
+	struct out *o = rep->o;
+
+	close_chunk(rep);
+
+	switch (rep->format) {
+	case OUT_TEXT:
+		if (rep->gap)
+			put_char(o, '\n');
+		rep->gap = 0;
+
+		put_char(o, '[');
+		put_str(o, c->type);
+		put_str(o, "] length ");
+		put_dec(o, c->length);
+		put_str(o, " at offset 0x");
+		put_num(o, c->offset, 16, 8);
+		put_str(o, " (");
+		put_num(o, c->crc, 16, 4);
+		put_str(o, ")\n");
+		break;
+	case OUT_NDJSON:
+		put_str(o, rep->chunks + rep->damages > 0 ?
+			",{\"type\":" : "{\"type\":");
+		put_json(o, c->type, strlen(c->type));
+		put_str(o, ",\"index\":");
+		put_dec(o, c->index);
+		put_str(o, ",\"length\":");
+		put_dec(o, c->length);
+		put_str(o, ",\"offset\":");
+		put_dec(o, c->offset);
+		put_str(o, ",\"crc\":\"");
+		put_num(o, c->crc, 16, 8);
+		put_str(o, "\",\"fields\":[");
+		break;
+	case OUT_CSV:
+		put_char(o, '"');
+		put_csv(o, rep->path, strlen(rep->path));
+		put_str(o, "\",");
+		put_dec(o, c->index);
+		put_str(o, ",\"");
+		put_csv(o, c->type, strlen(c->type));
+		put_str(o, "\",");
+		put_dec(o, c->length);
+		put_char(o, ',');
+		put_dec(o, c->offset);
+		put_char(o, ',');
+		put_num(o, c->crc, 16, 8);
+		put_str(o, ",\"");
+		break;
+	case OUT_BINARY:
+		memset(rep->rec, 0, sizeof(rep->rec));
+		le64(rep->rec, rep->id);
+		le64(rep->rec + 8, c->offset);
+		le32(rep->rec + 16, c->tag);
+		le32(rep->rec + 20, c->length);
+		le32(rep->rec + 24, c->crc);
+		le32(rep->rec + 28, c->index);
+		rep->rec[32] = OUT_REC_CHUNK;
+		break;
+	}
+
+	rep->chunks++;
+	rep->fields = 0;
+	rep->open = 1;
+}
+
+static void text_field(struct report *rep, const struct ci_field *f)
+{
+	struct out *o = rep->o;
+
+	switch (f->kind) {
+	case CI_FIELD_ENTRY:
+		put_str(o, "\t[");
+		put_num(o, f->index, 10, 3);
+		put_str(o, "] ");
+		put(o, f->value, f->value_len);
+		if (++rep->entries % 3 == 0)
+			put_char(o, '\n');
+		break;
+	case CI_FIELD_VALUE:
+		end_entries(rep);
+		put_char(o, '\t');
+		put_str(o, f->key);
+		put_str(o, " = ");
+		put(o, f->value, f->value_len);
+		put_char(o, '\n');
+		break;
+	default:
+		end_entries(rep);
+		put_char(o, '\t');
+		put(o, f->value, f->value_len);
+		put_char(o, '\n');
+		break;
+	}
+}
+
+static void json_field(struct report *rep, const struct ci_field *f)
+{
+	struct out *o = rep->o;
+
+	if (rep->fields > 0)
+		put_char(o, ',');
+
+	switch (f->kind) {
+	case CI_FIELD_ENTRY:
+		put_str(o, "{\"entry\":");
+		put_dec(o, f->index);
+		put_str(o, ",\"value\":");
+		break;
+	case CI_FIELD_VALUE:
+		put_str(o, "{\"key\":");
+		put_json(o, f->key, strlen(f->key));
+		put_str(o, ",\"value\":");
+		break;
+	default:
+		put_str(o, "{\"note\":");
+		break;
+	}
+
+	put_json(o, f->value, f->value_len);
+	put_char(o, '}');
+}
+
+static void csv_field(struct report *rep, const struct ci_field *f)
+{
+	struct out *o = rep->o;
+
+	if (rep->fields > 0)
+		put(o, "; ", 2);
+
+	switch (f->kind) {
+	case CI_FIELD_ENTRY:
+		put_char(o, '[');
+		put_dec(o, f->index);
+		put_str(o, "] ");
+		break;
+	case CI_FIELD_VALUE:
+		put_csv(o, f->key, strlen(f->key));
+		put_str(o, " = ");
+		break;
+	default:
+		break;
+	}
+
+	put_csv(o, f->value, f->value_len);
+}
+
+void report_field(void *user, const struct ci_field *f)
+{
+	struct report *rep = user;
+
+	switch (rep->format) {
+	case OUT_TEXT:
+		text_field(rep, f);
+		break;
+	case OUT_NDJSON:
+		json_field(rep, f);
+		break;
+	case OUT_CSV:
+		csv_field(rep, f);
+		break;
+	case OUT_BINARY:
+		break;
+	}
+
+	rep->fields++;
+}
+
+/* a stretch that is no chunk, between the last chunk and the next */
+void report_damage(void *user, const struct ci_damage *d)
+{
+	struct report *rep = user;
+	struct out *o = rep->o;
+
+	close_chunk(rep);
+
+	switch (rep->format) {
+	case OUT_TEXT:
+		if (rep->gap)
+			put_char(o, '\n');
+		rep->gap = 1;
+
+		put_str(o, "[damage] ");
+		put_dec(o, d->length);
+		put_str(o, " bytes at offset 0x");
+		put_num(o, d->offset, 16, 8);
+		put_str(o, " skipped\n\t");
+		put_str(o, d->msg);
+		put_char(o, '\n');
+		break;
+	case OUT_NDJSON:
+		put_str(o, rep->chunks + rep->damages > 0 ?
+			",{\"damage\":" : "{\"damage\":");
+		put_json(o, d->msg, strlen(d->msg));
+		put_str(o, ",\"offset\":");
+		put_dec(o, d->offset);
+		put_str(o, ",\"length\":");
+		put_dec(o, d->length);
+		put_char(o, '}');
+		break;
+	case OUT_CSV:
+		put_char(o, '"');
+		put_csv(o, rep->path, strlen(rep->path));
+		put_str(o, "\",,\"damage\",");
+		put_dec(o, d->length);
+		put_char(o, ',');
+		put_dec(o, d->offset);
+		put_str(o, ",,\"");
+		put_csv(o, d->msg, strlen(d->msg));
+		put_str(o, "\"\n");
+		break;
+	case OUT_BINARY:
+		memset(rep->rec, 0, sizeof(rep->rec));
+		le64(rep->rec, rep->id);
+		le64(rep->rec + 8, d->offset);
+		le32(rep->rec + 20, d->length);
+		rep->rec[32] = OUT_REC_DAMAGE;
+		rep->rec[33] = d->error;
+		put(o, (const char *)rep->rec, sizeof(rep->rec));
+		break;
+	}
+
+	if (rep->damages++ == 0) {
+		rep->damage_err = d->error;
+		snprintf(rep->damage_msg, sizeof(rep->damage_msg), "%s", d->msg);
+	}
+}
+
+void report_ihdr(void *user, const struct ci_ihdr *ihdr)
+{
+	struct report *rep = user;
+	uint8_t *p = rep->rec;
+
+	p[34] = OUT_TYPED_IHDR;
+	le32(p + 36, ihdr->width);
+	le32(p + 40, ihdr->height);
+	p[44] = ihdr->bit_depth;
+	p[45] = ihdr->color_type;
+	p[46] = ihdr->compression;
+	p[47] = ihdr->filter;
+	p[48] = ihdr->interlace;
+}
+
+void report_actl(void *user, const struct ci_actl *actl)
+{
+	struct report *rep = user;
+	uint8_t *p = rep->rec;
+
+	p[34] = OUT_TYPED_ACTL;
+	le32(p + 36, actl->frames);
+	le32(p + 40, actl->plays);
+}
+
+void report_fctl(void *user, const struct ci_fctl *fctl)
+{
+	struct report *rep = user;
+	uint8_t *p = rep->rec;
+
+	p[34] = OUT_TYPED_FCTL;
+	le32(p + 36, fctl->sequence);
+	le32(p + 40, fctl->width);
+	le32(p + 44, fctl->height);
+	le32(p + 48, fctl->x_offset);
+	le32(p + 52, fctl->y_offset);
+	le16(p + 56, fctl->delay_num);
+	le16(p + 58, fctl->delay_den);
+	p[60] = fctl->dispose;
+	p[61] = fctl->blend;
+}
+
+void report_next(struct report *rep)
+{
+	if (rep->format == OUT_TEXT) {
+		end_entries(rep);
+		rep->gap = 1;
+	}
+}
+
+void report_end(struct report *rep, int err, uint32_t chunks,
+		const char *errmsg)
+{
+	struct out *o = rep->o;
+	uint8_t *p = rep->rec;
+	int ok = err == CI_END && rep->damages == 0;
+	int status = err == CI_END ? rep->damage_err : err;
+
+	/* the chunk it failed in, if it got that far */
+	if (rep->format == OUT_BINARY)
+		p[33] = err == CI_END ? CI_OK : err;
+	close_chunk(rep);
+
+	switch (rep->format) {
+	case OUT_TEXT:
+		if (rep->gap)
+			put_char(o, '\n');
+
+		if (err == CI_END && ok) {
+			put_str(o, "All OK.\n");
+		} else if (err == CI_END) {
+			put_str(o, "Recovered, ");
+			put_dec(o, rep->damages);
+			put_str(o, " damaged parts skipped.\n");
+		}
+
+		if (err == CI_END) {
+			put_str(o, "Found ");
+			put_dec(o, chunks);
+			put_str(o, " chunks from ");
+			put_str(o, rep->path);
+			put_char(o, '\n');
+		}
+		break;
+	case OUT_NDJSON:
+		put_str(o, "],\"count\":");
+		put_dec(o, chunks);
+		if (ok) {
+			put_str(o, ",\"ok\":true}\n");
+		} else {
+			put_str(o, ",\"ok\":false,\"error\":");
+			put_json(o, errmsg, strlen(errmsg));
+			put_str(o, "}\n");
+		}
+		break;
+	case OUT_CSV:
+		break;
+	case OUT_BINARY:
+		memset(p, 0, sizeof(rep->rec));
+		le64(p, rep->id);
+		le32(p + 20, chunks);
+		p[32] = OUT_REC_FILE;
+		p[33] = status;
+		put(o, (const char *)p, sizeof(rep->rec));
+		break;
+	}
+}
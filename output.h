@@ -0,0 +1,128 @@
+/*
+ * output - reports of the checked files, as text, NDJSON or CSV
+ */
+
+#ifndef CHUNKINFO_OUTPUT_H
+#define CHUNKINFO_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chunkinfo.h"
+
+enum out_format {
+	OUT_TEXT,    /* for people, what chunkinfo always printed */
+	OUT_NDJSON,  /* one object per file, on one line */
+	OUT_CSV,     /* one row per chunk, its fields in the last column */
+	OUT_BINARY   /* fixed size records, see below */
+};
+
+/*
+ * OUT_BINARY: a header, then one record per chunk and one at the end
+ * of each file, all little-endian and aligned, to be mapped or loaded
+ * as they are.
+ *
+ * header, 32 bytes
+ *    0  char[8]  "CHUNKREC"
+ *    8  uint32   version, 1
+ *   12  uint32   record size, 64
+ *   16  uint32   header size, 32
+ *   20           zero
+ *
+ * record, 64 bytes
+ *    0  uint64   file id, the place of the file in the input from 0
+ *    8  uint64   offset of the chunk type, 0 for a file, of the bytes
+ *                skipped for damage
+ *   16  uint32   chunk type, 'IHDR' is 0x49484452, 0 for a file
+ *   20  uint32   chunk length, chunks checked for a file, bytes
+ *                skipped for damage
+ *   24  uint32   CRC
+ *   28  uint32   chunk index
+ *   32  uint8    OUT_REC_CHUNK, OUT_REC_FILE or OUT_REC_DAMAGE
+ *   33  uint8    enum ci_error, CI_OK if fine: a chunk only has the
+ *                error if it failed after its CRC was checked, a file
+ *                that was recovered has the one of its first damage
+ *   34  uint8    OUT_TYPED_*, what follows
+ *   35           zero
+ *   36           IHDR: uint32 width, height at 40, uint8 bit depth at
+ *                44, color type, compression, filter and interlace
+ *                acTL: uint32 frames, plays at 40
+ *                fcTL: uint32 sequence, width at 40, height at 44,
+ *                x offset at 48, y offset at 52, uint16 delay_num at
+ *                56, delay_den at 58, uint8 dispose at 60, blend at 61
+ *                zero otherwise, up to 64
+ */
+#define OUT_BIN_HEADER	32
+#define OUT_BIN_RECORD	64
+
+enum {
+	OUT_REC_CHUNK,
+	OUT_REC_FILE,
+	OUT_REC_DAMAGE  /* --recover */
+};
+
+enum {
+	OUT_TYPED_NONE,
+	OUT_TYPED_IHDR,
+	OUT_TYPED_ACTL,
+	OUT_TYPED_FCTL
+};
+
+/* bytes of reports, kept and reused from one file to the next */
+struct out {
+	char *buf;
+	size_t len, cap;
+};
+
+/*
+ * report of one file, built from the library callbacks. fields of a
+ * chunk may come after the next ci_next() call, when a stream kept for
+ * threads is reported, so a chunk is only closed by the next one.
+ */
+struct report {
+	enum out_format format;
+	struct out *o;
+	const char *path;
+	uint64_t id;       /* place of the file in the input */
+	uint32_t chunks;   /* chunks seen */
+	int open;          /* the last one may still get fields */
+	uint32_t fields;   /* fields of the current chunk */
+	uint32_t damages;  /* damaged stretches skipped */
+	int damage_err;    /* of the first one */
+	char damage_msg[64];
+	uint32_t entries;  /* text: entries on the current line */
+	int gap;           /* text: blank line owed to the last chunk */
+	uint8_t rec[OUT_BIN_RECORD];  /* binary: the current chunk */
+};
+
+void out_free(struct out *o);
+
+/* write what is buffered to f, and empty the buffer */
+void out_flush(struct out *o, FILE *f);
+
+/* CSV and binary: what comes once, before the first report */
+void report_header(enum out_format format, struct out *o);
+
+void report_begin(struct report *rep, enum out_format format, struct out *o,
+		  const char *path, uint64_t id);
+
+/* callbacks, user is the report */
+void report_chunk(void *user, const struct ci_chunk *c);
+void report_field(void *user, const struct ci_field *f);
+void report_ihdr(void *user, const struct ci_ihdr *ihdr);
+void report_actl(void *user, const struct ci_actl *actl);
+void report_fctl(void *user, const struct ci_fctl *fctl);
+void report_damage(void *user, const struct ci_damage *d);
+
+/* ci_next() returned CI_OK */
+void report_next(struct report *rep);
+
+/*
+ * err is what ended the stream, CI_END if it is fine. errmsg is why it
+ * failed, or why it was damaged.
+ */
+void report_end(struct report *rep, int err, uint32_t chunks,
+		const char *errmsg);
+
+#endif
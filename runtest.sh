@@ -100,14 +100,117 @@ test_zlib() {
 }
 
 test_corrupt() {
-	files="xc1n0g08.png xc9n2c08.png xcrn0g04.png xcsn0g01.png xd0n2c08.png xd3n2c08.png xd9n2c08.png xhdn0g08.png xlfn0g04.png xs1n0g01.png xs4n0g01.png xs2n0g01.png xs7n0g01.png"
+	files="xc1n0g08.png xc9n2c08.png xcrn0g04.png xcsn0g01.png xd0n2c08.png xd3n2c08.png xd9n2c08.png xdtn0g01.png xhdn0g08.png xlfn0g04.png xs1n0g01.png xs4n0g01.png xs2n0g01.png xs7n0g01.png"
 	info_test "Test corrupted files, must FAIL"
 	for f in $files; do
 		exec_test "$pngsuite_dir/$f"
 	done
 }
 
+test_selftest() {
+	info_test "Self-test (CRC engines, library)"
+	if [ ! -x "test" ]; then
+		echo "  skipped, run \"make test\" first"
+		return
+	fi
+
+	if ( ./test "$pngsuite_dir" ); then
+		echo "  \e[32m[OK]\e[0m  self-test"
+	else
+		echo "  \e[31m[FAIL]\e[0m  self-test"
+	fi
+}
+
+test_formats() {
+	info_test "Test output formats"
+	files=$(ls $pngsuite_dir/*.png)
+	nfiles=$(echo "$files" | wc -l)
+	nchunks=$(./chunkinfo $files 2>/dev/null | grep -c '^\[')
+
+	# one object per file, one row per chunk after the header
+	lines=$(./chunkinfo --format=ndjson -j 4 $files 2>/dev/null | grep -c '^{"file":')
+	if [ "$lines" = "$nfiles" ]; then
+		echo "  \e[32m[OK]\e[0m  ndjson"
+	else
+		echo "  \e[31m[FAIL]\e[0m  ndjson: $lines objects for $nfiles files"
+	fi
+
+	rows=$(./chunkinfo --format=csv $files 2>/dev/null | tail -n +2 | grep -c '^"')
+	if [ "$rows" = "$nchunks" ]; then
+		echo "  \e[32m[OK]\e[0m  csv"
+	else
+		echo "  \e[31m[FAIL]\e[0m  csv: $rows rows for $nchunks chunks"
+	fi
+
+	# a 32 byte header, 64 bytes per chunk and per file
+	size=$(./chunkinfo --format=binary -j 4 $files 2>/dev/null | wc -c)
+	if [ "$size" = "$((32 + 64 * (nchunks + nfiles)))" ]; then
+		echo "  \e[32m[OK]\e[0m  binary"
+	else
+		echo "  \e[31m[FAIL]\e[0m  binary: $size bytes"
+	fi
+}
+
+test_cache() {
+	info_test "Test the index of --cache"
+	files=$(ls $pngsuite_dir/*.png)
+	index=$(mktemp -u)
+
+	# checked, then answered from the index: the same reports
+	for format in text ndjson binary; do
+		./chunkinfo --format=$format $files >"$index.a" 2>&1
+		./chunkinfo --cache "$index" --format=$format $files >/dev/null 2>&1
+		./chunkinfo --cache "$index" --format=$format -j 4 $files >"$index.b" 2>&1
+		if cmp -s "$index.a" "$index.b"; then
+			echo "  \e[32m[OK]\e[0m  $format"
+		else
+			echo "  \e[31m[FAIL]\e[0m  $format from the index"
+		fi
+	done
+
+	# the threads are in the fields: -t is part of the key
+	./chunkinfo --verify=full -t 4 --cache "$index" $files >/dev/null 2>&1
+	./chunkinfo --verify=full -t 1 $files >"$index.a" 2>&1
+	./chunkinfo --verify=full -t 1 --cache "$index" $files >"$index.b" 2>&1
+	if cmp -s "$index.a" "$index.b"; then
+		echo "  \e[32m[OK]\e[0m  -t"
+	else
+		echo "  \e[31m[FAIL]\e[0m  -t 4 replayed for -t 1"
+	fi
+
+	cp $pngsuite_dir/basn0g01.png "$index.png"
+	./chunkinfo --cache "$index" "$index.png" >/dev/null
+	rm "$index.png"
+	if ./chunkinfo --cache "$index" --cache-prune 2>&1 | grep -q " 1 dropped"; then
+		echo "  \e[32m[OK]\e[0m  prune"
+	else
+		echo "  \e[31m[FAIL]\e[0m  prune"
+	fi
+
+	rm -f "$index" "$index.a" "$index.b"
+}
+
+test_recurse() {
+	info_test "Test the directory walk of -r"
+	files=$(ls $pngsuite_dir/*.png)
+	out=$(mktemp)
+
+	# the walk is in name order, as the shell sorts the list
+	for args in "" "--header-only" "-j 4 --format=ndjson"; do
+		./chunkinfo $args $files >"$out.a" 2>&1
+		./chunkinfo $args -r $pngsuite_dir >"$out.b" 2>&1
+		if cmp -s "$out.a" "$out.b"; then
+			echo "  \e[32m[OK]\e[0m  -r $args"
+		else
+			echo "  \e[31m[FAIL]\e[0m  -r $args differs from the list"
+		fi
+	done
+
+	rm -f "$out" "$out.a" "$out.b"
+}
+
 test_all() {
+	test_selftest
 	test_basic
 	test_interlace
 	test_odd_sizes
@@ -118,6 +221,9 @@ test_all() {
 	test_pallete
 	test_zlib
 	test_corrupt
+	test_formats
+	test_cache
+	test_recurse
 }
 
 test_all
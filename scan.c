@@ -0,0 +1,618 @@
+/*
+ * scan - files of directory trees, read ahead in batches
+ *
+ * The walk gives up to BATCH files and they are stat()ed, then the ones
+ * small enough to be read ahead go through an io_uring in two rounds:
+ * openat of all of them, and a read of each linked to its close. That is
+ * two more system calls for the whole batch instead of three for each
+ * file, and the reads of a batch are all in flight together. The stat is
+ * not in the ring: the kernel always hands statx to its worker threads,
+ * which made the batch twice as slow as the plain calls. The
+ * workers then check the files from memory. A file that fails at any
+ * step, or is too big, is given by path and read by the worker with
+ * pread(), which also says why it failed the usual way. Without an
+ * io_uring every file is given that way.
+ *
+ * The ring is set up with the raw system calls, <linux/io_uring.h> only
+ * gives the layout.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "scan.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+#define BATCH		256
+#define BATCH_BYTES	(32 << 20)  /* read ahead in one batch at most */
+
+#ifdef HAVE_IO_URING
+struct ring {
+	int fd;
+	unsigned entries, queued;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+};
+#endif
+
+/* a directory being walked, its entries sorted by name */
+struct dir {
+	char *path;
+	struct dir_entry {
+		char *name;
+		unsigned char type;
+	} *ent;
+	size_t n, at;
+};
+
+struct scan {
+	size_t read_max, head;
+	int (*fresh)(void *, const struct stat *);
+	void *user;
+	int failed;
+
+	char **roots;  /* added, not walked yet */
+	size_t roots_head, roots_tail, roots_cap;
+	struct dir *dirs;  /* the walk, innermost last */
+	size_t ndirs, dirs_cap;
+
+	struct scan_file batch[BATCH];
+	size_t nbatch, at;
+
+#ifdef HAVE_IO_URING
+	struct ring ring;
+#endif
+	enum scan_engine engine;
+};
+
+/* what could not be walked for want of memory, like a bad directory */
+static void no_memory(struct scan *s, const char *path)
+{
+	fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+	s->failed = 1;
+}
+
+void scan_file_free(struct scan_file *f)
+{
+	free(f->path);
+	free(f->data);
+	memset(f, 0, sizeof(*f));
+}
+
+#ifdef HAVE_IO_URING
+static int ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto fail;
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_map;
+	cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->entries = p.sq_entries;
+
+	return 0;
+
+fail:
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_len);
+	if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+static void ring_free(struct ring *r)
+{
+	if (r->fd < 0)
+		return;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	munmap(r->sq_map, r->sq_len);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/* a cleared entry, user_data is where its result goes in ring_run() */
+static struct io_uring_sqe *ring_sqe(struct ring *r, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	i = (*r->sq_tail + r->queued++) & *r->sq_mask;
+	r->sq_array[i] = i;
+	sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+
+	return sqe;
+}
+
+/*
+ * submit what was queued and wait for all of it: res[user_data]. -1 if
+ * the ring failed, some of it may then still be in flight
+ */
+static int ring_run(struct ring *r, int *res, size_t nres)
+{
+	unsigned n, submit, done, head;
+	struct io_uring_cqe *cqe;
+	long ret;
+
+	n = submit = r->queued;
+	r->queued = 0;
+	__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+
+	for (done = 0; done < n;) {
+		ret = syscall(__NR_io_uring_enter, r->fd, submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			return -1;
+		if (ret > 0)
+			submit -= ret;
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			if (cqe->user_data < nres)
+				res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/*
+ * what can be of the batch, from memory. -1 if the ring failed: the
+ * batch is then all given by path
+ */
+static int read_ahead(struct scan *s)
+{
+	struct io_uring_sqe *sqe;
+	struct scan_file *f;
+	struct ring *r = &s->ring;
+	int res[BATCH], fd[BATCH];
+	size_t i, want[BATCH], bytes;
+
+	bytes = 0;
+	for (i = 0; i < s->nbatch; i++) {
+		f = &s->batch[i];
+		want[i] = 0;
+		res[i] = -1;
+		if (stat(f->path, &f->st) < 0)
+			continue;
+
+		f->have_st = 1;
+		if (!S_ISREG(f->st.st_mode) || f->st.st_size == 0 ||
+		    (s->fresh && s->fresh(s->user, &f->st)))
+			continue;
+
+		want[i] = f->st.st_size;
+		if (s->head > 0 && want[i] > s->head)
+			want[i] = s->head;
+		if (s->head == 0 && want[i] > s->read_max)
+			want[i] = 0;
+		if (bytes + want[i] > BATCH_BYTES)
+			want[i] = 0;
+		bytes += want[i];
+
+		if (want[i] > 0) {
+			sqe = ring_sqe(r, i);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)f->path;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		}
+	}
+	if (ring_run(r, res, BATCH) < 0) {
+		for (i = 0; i < s->nbatch; i++)
+			if (want[i] > 0 && res[i] >= 0)
+				close(res[i]);
+		return -1;
+	}
+
+	for (i = 0; i < s->nbatch; i++) {
+		f = &s->batch[i];
+		fd[i] = want[i] > 0 ? res[i] : -1;
+		res[i] = -1;
+		if (fd[i] < 0)
+			continue;
+
+		f->data = malloc(want[i]);
+		if (!f->data) {
+			close(fd[i]);
+			fd[i] = -1;
+			continue;
+		}
+
+		sqe = ring_sqe(r, i);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd[i];
+		sqe->addr = (uintptr_t)f->data;
+		sqe->len = want[i];
+		sqe->off = 0;
+		sqe->flags = IOSQE_IO_HARDLINK;
+
+		/* closed even if the read failed */
+		sqe = ring_sqe(r, BATCH);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fd[i];
+	}
+	if (ring_run(r, res, BATCH) < 0) {
+		/* the kernel may still write them: they are left to it */
+		for (i = 0; i < s->nbatch; i++)
+			s->batch[i].data = NULL;
+		return -1;
+	}
+
+	/* anything short is read again by path, to fail the usual way */
+	for (i = 0; i < s->nbatch; i++) {
+		f = &s->batch[i];
+		if (fd[i] < 0)
+			continue;
+
+		if (res[i] >= 0 && (size_t)res[i] == want[i]) {
+			f->len = want[i];
+		} else {
+			free(f->data);
+			f->data = NULL;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+struct scan *scan_new(size_t read_max, size_t head,
+		      int (*fresh)(void *user, const struct stat *st),
+		      void *user)
+{
+	struct scan *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->read_max = read_max;
+	s->head = head;
+	s->fresh = fresh;
+	s->user = user;
+	s->engine = SCAN_PATHS;
+
+#ifdef HAVE_IO_URING
+	/* a read and a close for each file of the batch */
+	if (ring_init(&s->ring, 2 * BATCH) == 0 &&
+	    s->ring.entries >= 2 * BATCH)
+		s->engine = SCAN_IO_URING;
+#endif
+
+	return s;
+}
+
+void scan_free(struct scan *s)
+{
+	size_t i;
+
+	for (i = s->at; i < s->nbatch; i++)
+		scan_file_free(&s->batch[i]);
+	for (i = s->roots_head; i < s->roots_tail; i++)
+		free(s->roots[i]);
+	while (s->ndirs > 0) {
+		struct dir *d = &s->dirs[--s->ndirs];
+
+		for (i = d->at; i < d->n; i++)
+			free(d->ent[i].name);
+		free(d->ent);
+		free(d->path);
+	}
+
+#ifdef HAVE_IO_URING
+	ring_free(&s->ring);
+#endif
+	free(s->dirs);
+	free(s->roots);
+	free(s);
+}
+
+enum scan_engine scan_engine_used(const struct scan *s)
+{
+	return s->engine;
+}
+
+int scan_hungry(const struct scan *s)
+{
+	return s->roots_tail - s->roots_head < BATCH;
+}
+
+void scan_add(struct scan *s, char *path)
+{
+	char **roots;
+	size_t cap;
+
+	if (s->roots_head == s->roots_tail)
+		s->roots_head = s->roots_tail = 0;
+
+	if (s->roots_tail == s->roots_cap) {
+		cap = s->roots_cap ? s->roots_cap * 2 : BATCH;
+		roots = realloc(s->roots, cap * sizeof(char *));
+		if (!roots) {
+			no_memory(s, path);
+			free(path);
+			return;
+		}
+
+		s->roots = roots;
+		s->roots_cap = cap;
+	}
+
+	s->roots[s->roots_tail++] = path;
+}
+
+int scan_failed(const struct scan *s)
+{
+	return s->failed;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const struct dir_entry *x = a, *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+/* path/name, NULL without memory */
+static char *join(const char *path, const char *name)
+{
+	size_t n = strlen(path), k = strlen(name);
+	char *p;
+
+	p = malloc(n + k + 2);
+	if (!p)
+		return NULL;
+
+	memcpy(p, path, n);
+	if (n == 0 || path[n - 1] != '/')
+		p[n++] = '/';
+	memcpy(p + n, name, k + 1);
+
+	return p;
+}
+
+/*
+ * its entries, sorted, on the walk; path is the walk's. a directory
+ * that can't be read whole is said on stderr and left out
+ */
+static void push_dir(struct scan *s, char *path)
+{
+	struct dir_entry *ent;
+	struct dirent *de;
+	struct dir *d, *dirs;
+	DIR *dir;
+	size_t cap = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		s->failed = 1;
+		free(path);
+		return;
+	}
+
+	if (s->ndirs == s->dirs_cap) {
+		cap = s->dirs_cap ? s->dirs_cap * 2 : 16;
+		dirs = realloc(s->dirs, cap * sizeof(*s->dirs));
+		if (!dirs)
+			goto fail;
+
+		s->dirs = dirs;
+		s->dirs_cap = cap;
+		cap = 0;
+	}
+
+	d = &s->dirs[s->ndirs++];
+	memset(d, 0, sizeof(*d));
+	d->path = path;
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (d->n == cap) {
+			cap = cap ? cap * 2 : 64;
+			ent = realloc(d->ent, cap * sizeof(*d->ent));
+			if (!ent)
+				goto fail_entries;
+			d->ent = ent;
+		}
+		d->ent[d->n].name = strdup(de->d_name);
+		if (!d->ent[d->n].name)
+			goto fail_entries;
+		d->ent[d->n].type = de->d_type;
+		d->n++;
+	}
+	closedir(dir);
+
+	if (d->n)
+		qsort(d->ent, d->n, sizeof(*d->ent), cmp_entry);
+	return;
+
+fail_entries:
+	while (d->n > 0)
+		free(d->ent[--d->n].name);
+	free(d->ent);
+	s->ndirs--;
+fail:
+	closedir(dir);
+	no_memory(s, path);
+	free(path);
+}
+
+static int png_name(const char *name)
+{
+	size_t n = strlen(name);
+
+	return (n > 4 && !strcasecmp(name + n - 4, ".png")) ||
+	       (n > 5 && !strcasecmp(name + n - 5, ".apng"));
+}
+
+/* the next file of the walk, NULL once it is over */
+static char *walk_next(struct scan *s)
+{
+	struct dir_entry *e;
+	struct stat st;
+	struct dir *d;
+	unsigned char type;
+	char *path;
+
+	for (;;) {
+		if (s->ndirs > 0) {
+			d = &s->dirs[s->ndirs - 1];
+			if (d->at == d->n) {
+				free(d->ent);
+				free(d->path);
+				s->ndirs--;
+				continue;
+			}
+
+			e = &d->ent[d->at++];
+			path = join(d->path, e->name);
+			if (!path) {
+				no_memory(s, d->path);
+				free(e->name);
+				continue;
+			}
+
+			type = e->type;
+			if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+				type = S_ISDIR(st.st_mode) ? DT_DIR :
+				       S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+			if (type == DT_DIR) {
+				free(e->name);
+				push_dir(s, path);
+				continue;
+			}
+			if (type == DT_REG && png_name(e->name)) {
+				free(e->name);
+				return path;
+			}
+
+			free(e->name);
+			free(path);
+			continue;
+		}
+
+		if (s->roots_head == s->roots_tail)
+			return NULL;
+
+		/* what was given is followed, and checked whatever its name */
+		path = s->roots[s->roots_head++];
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			push_dir(s, path);
+			continue;
+		}
+
+		return path;
+	}
+}
+
+int scan_next(struct scan *s, struct scan_file *f)
+{
+	if (s->at == s->nbatch) {
+		s->at = s->nbatch = 0;
+		while (s->nbatch < BATCH) {
+			memset(&s->batch[s->nbatch], 0, sizeof(s->batch[0]));
+			s->batch[s->nbatch].path = walk_next(s);
+			if (!s->batch[s->nbatch].path)
+				break;
+			s->nbatch++;
+		}
+
+#ifdef HAVE_IO_URING
+		/* the workers can still read it all, the usual way */
+		if (s->engine == SCAN_IO_URING && s->nbatch > 0 &&
+		    read_ahead(s) < 0) {
+			ring_free(&s->ring);
+			s->engine = SCAN_PATHS;
+		}
+#endif
+	}
+
+	if (s->at == s->nbatch)
+		return 0;
+
+	*f = s->batch[s->at++];
+	return 1;
+}
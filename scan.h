@@ -0,0 +1,63 @@
+/*
+ * scan - files of directory trees, read ahead in batches
+ */
+
+#ifndef CHUNKINFO_SCAN_H
+#define CHUNKINFO_SCAN_H
+
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a file to check, what scan_next() gives */
+struct scan_file {
+	char *path;
+	uint8_t *data;  /* its first len bytes, NULL if it is to be read the
+			   usual way, by its path */
+	size_t len;
+	struct stat st; /* if have_st, from before it was read */
+	int have_st;
+};
+
+void scan_file_free(struct scan_file *f);
+
+enum scan_engine {
+	SCAN_IO_URING,  /* openat, read and close, a batch at a time */
+	SCAN_PATHS      /* no reads ahead, the workers read with pread() */
+};
+
+struct scan;
+
+/*
+ * read_max: files up to that size are read ahead whole, bigger ones are
+ * given by path. head > 0 reads only that much of every file, for the
+ * header-only checks. fresh, if not NULL, is asked first whether a file
+ * needs to be read at all (the cache has it), user is its argument.
+ * NULL without memory.
+ */
+struct scan *scan_new(size_t read_max, size_t head,
+		      int (*fresh)(void *user, const struct stat *st),
+		      void *user);
+void scan_free(struct scan *s);
+
+/* SCAN_PATHS if io_uring can't be used, or failed on the way */
+enum scan_engine scan_engine_used(const struct scan *s);
+
+/* more paths would fill the next batch */
+int scan_hungry(const struct scan *s);
+
+/*
+ * a path to check: a directory is walked, in name order, for the files
+ * named *.png or *.apng in any case, symlinks aside. anything else is
+ * checked as it is.
+ */
+void scan_add(struct scan *s, char *path);
+
+/* the next file, 0 once all that was added is given */
+int scan_next(struct scan *s, struct scan_file *f);
+
+/* a directory could not be read, or a path kept: it was said on stderr */
+int scan_failed(const struct scan *s);
+
+#endif
@@ -0,0 +1,1963 @@
+/*
+ * test - self-test for the internals that chunkinfo trusts blindly
+ *
+ * usage: ./test [pngsuite dir]
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/mman.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "chunkinfo.h"
+#include "crc32.h"
+#include "filter.h"
+#include "utf8.h"
+
+static int failed;
+
+static void fail(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	fputs("  [FAIL] ", stdout);
+	vfprintf(stdout, msg, ap);
+	fputc('\n', stdout);
+	va_end(ap);
+
+	failed++;
+}
+
+static uint32_t xorshift(uint32_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 17;
+	*s ^= *s << 5;
+	return *s;
+}
+
+static uint8_t *load_file(const char *path, size_t *len)
+{
+	FILE *f;
+	uint8_t *buf;
+	long n;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	buf = NULL;
+	if (fseek(f, 0, SEEK_END) == 0 && (n = ftell(f)) > 0) {
+		rewind(f);
+		buf = malloc(n);
+		if (buf && fread(buf, 1, n, f) != (size_t)n) {
+			free(buf);
+			buf = NULL;
+		}
+		*len = n;
+	}
+
+	fclose(f);
+	return buf;
+}
+
+/* every engine against the table, one buffer */
+static void crc_check(const uint8_t *buf, size_t len, const char *what)
+{
+	uint32_t ref, got, half;
+	int e;
+
+	ref = crc32_with(CRC32_TABLE, 0, buf, len);
+
+	for (e = 0; e < CRC32_ENGINES; e++) {
+		if (!crc32_engine_ok(e))
+			continue;
+
+		got = crc32_with(e, 0, buf, len);
+		if (got != ref)
+			fail("crc32 %s: %s, length %zu: %08x != %08x",
+			     crc32_engine_name(e), what, len, got, ref);
+
+		/* feeding in two pieces must not change anything */
+		half = crc32_with(e, 0, buf, len / 2);
+		half = crc32_with(e, half, buf + len / 2, len - len / 2);
+		if (half != ref)
+			fail("crc32 %s: %s, length %zu split: %08x != %08x",
+			     crc32_engine_name(e), what, len, half, ref);
+	}
+}
+
+static void test_crc_random(void)
+{
+	uint8_t *buf;
+	uint32_t seed;
+	size_t len, off, i;
+
+	buf = malloc(1 << 20);
+	if (!buf) {
+		fail("crc32: out of memory");
+		return;
+	}
+
+	seed = 0x2545f491;
+	for (i = 0; i < (1 << 20); i++)
+		buf[i] = xorshift(&seed);
+
+	/* every short length and alignment, then some big ones */
+	for (len = 0; len < 300; len++)
+		for (off = 0; off < 16; off++)
+			crc_check(buf + off, len, "random");
+
+	for (i = 0; i < 64; i++) {
+		len = xorshift(&seed) % ((1 << 20) - 16);
+		off = xorshift(&seed) % 16;
+		crc_check(buf + off, len, "random");
+	}
+
+	crc_check(buf, 1 << 20, "random");
+
+	/* "123456789" is the standard check value */
+	if (pd_crc32(0, "123456789", 9) != 0xcbf43926)
+		fail("crc32: check value mismatch");
+
+	free(buf);
+}
+
+static void test_crc_pngsuite(const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[1024];
+	uint8_t *buf;
+	size_t len, pos, n;
+	uint32_t size;
+	int files;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("crc32: cannot open %s", dir);
+		return;
+	}
+
+	files = 0;
+	while ((de = readdir(d))) {
+		n = strlen(de->d_name);
+		if (n < 4 || strcmp(de->d_name + n - 4, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		buf = load_file(path, &len);
+		if (!buf)
+			continue;
+
+		/* type + data of every chunk, corrupted ones included */
+		for (pos = 8; pos + 12 <= len; pos += size + 12) {
+			size = (uint32_t)buf[pos] << 24 | buf[pos + 1] << 16 |
+			       buf[pos + 2] << 8 | buf[pos + 3];
+			if (size > len - pos - 12)
+				break;
+
+			crc_check(buf + pos + 4, size + 4, de->d_name);
+		}
+
+		crc_check(buf, len, de->d_name);
+		free(buf);
+		files++;
+	}
+
+	closedir(d);
+	if (files == 0)
+		fail("crc32: no PNG file in %s", dir);
+}
+
+/* every filter engine against the scalar one, on random rows */
+static void test_filter_random(void)
+{
+	static const unsigned bpps[] = { 1, 2, 3, 4, 6, 8 };
+	uint8_t prev[1024], row[1024], ref[1024], got[1024];
+	uint32_t seed;
+	size_t len, i, b;
+	unsigned type;
+	int e;
+
+	seed = 0x9e3779b9;
+	for (i = 0; i < sizeof(prev); i++)
+		prev[i] = xorshift(&seed);
+
+	for (b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+		for (len = 0; len <= sizeof(row); len += len < 100 ? 1 : 97) {
+			for (i = 0; i < len; i++)
+				row[i] = xorshift(&seed);
+
+			for (type = 0; type < FILTER_TYPES; type++) {
+				memcpy(ref, row, len);
+				unfilter_with(FILTER_SCALAR, type, ref, prev, len,
+					      bpps[b]);
+
+				for (e = 0; e < FILTER_ENGINES; e++) {
+					if (!filter_engine_ok(e))
+						continue;
+
+					memcpy(got, row, len);
+					unfilter_with(e, type, got, prev, len, bpps[b]);
+					if (memcmp(got, ref, len))
+						fail("filter %s: type %u, bpp %u, length %zu",
+						     filter_engine_name(e), type,
+						     bpps[b], len);
+				}
+			}
+		}
+	}
+
+	if (unfilter_row(FILTER_TYPES, row, prev, 16, 1) != -1)
+		fail("filter: invalid type accepted");
+}
+
+/* every engine finds what the scalar one does, where it does */
+static size_t utf8_check(const uint8_t *s, size_t len, size_t *cut)
+{
+	size_t ref, got, refcut, gotcut;
+	int e;
+
+	ref = utf8_valid_with(UTF8_SCALAR, s, len, &refcut);
+	for (e = 0; e < UTF8_ENGINES; e++) {
+		if (!utf8_engine_ok(e))
+			continue;
+
+		got = utf8_valid_with(e, s, len, &gotcut);
+		if (got != ref || gotcut != refcut)
+			fail("utf8 %s: %zu/%zu, %zu/%zu expected, length %zu",
+			     utf8_engine_name(e), got, gotcut, ref, refcut, len);
+	}
+
+	*cut = refcut;
+	return ref;
+}
+
+static void test_utf8(void)
+{
+	static const struct {
+		const char *s;
+		size_t valid, cut;
+	} cases[] = {
+		{ "plain", 5, 0 },
+		{ "a\xc3\xa4" "b\xe2\x82\xac\xf0\x9f\x98\x80", 11, 0 },
+		{ "\xf4\x8f\xbf\xbf", 4, 0 },     /* U+10FFFF */
+		{ "\xee\x80\x80", 3, 0 },         /* U+E000 */
+		{ "a\x80", 1, 0 },                /* lone continuation */
+		{ "a\xc0\x80", 1, 0 },            /* overlong */
+		{ "a\xc1\xbf", 1, 0 },
+		{ "a\xe0\x9f\xbf", 1, 0 },
+		{ "a\xf0\x8f\xbf\xbf", 1, 0 },
+		{ "a\xed\xa0\x80", 1, 0 },        /* surrogate */
+		{ "a\xf4\x90\x80\x80", 1, 0 },    /* past U+10FFFF */
+		{ "a\xf5\x80\x80\x80", 1, 0 },
+		{ "a\xff", 1, 0 },
+		{ "a\xc3" "a", 1, 0 },            /* too short */
+		{ "a\xe2\x82" "a", 1, 0 },
+		{ "a\xc3", 1, 1 },                /* cut by the end */
+		{ "a\xe2\x82", 1, 2 },
+		{ "a\xf0\x9f\x98", 1, 3 },
+		{ "a\xe0\x80", 1, 0 },            /* not just cut */
+	};
+	static const char *chars[] = {
+		"a", "~", "\x7f", "\xc3\xa4", "\xdf\xbf", "\xe2\x82\xac",
+		"\xe0\xa0\x80", "\xed\x9f\xbf", "\xef\xbf\xbf",
+		"\xf0\x90\x80\x80", "\xf4\x8f\xbf\xbf"
+	};
+	uint8_t buf[64 + 4096], text[4096], *at;
+	size_t i, k, n, len, valid, cut;
+	uint32_t seed = 0x2545f491;
+	uint8_t keep;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		/* at every place in a block, with ASCII before */
+		for (k = 0; k < 64; k++) {
+			memset(buf, 'x', k);
+			len = strlen(cases[i].s);
+			memcpy(buf + k, cases[i].s, len);
+			valid = utf8_check(buf, k + len, &cut);
+			if (valid != k + cases[i].valid || cut != cases[i].cut)
+				fail("utf8: case %zu at %zu: %zu/%zu", i, k,
+				     valid - k, cut);
+		}
+	}
+
+	/* random text, mostly ASCII or not, then broken at one byte */
+	for (n = 0; n < 400; n++) {
+		for (len = 0; len < sizeof(text) - 4; len += strlen(chars[k])) {
+			k = xorshift(&seed) % (n & 1 ? 3 : 11);
+			memcpy(text + len, chars[k], strlen(chars[k]));
+		}
+
+		/* a few hundred bytes in, or at its every length */
+		len = n < 8 ? len : 1 + xorshift(&seed) % 300;
+		if (utf8_check(text, len, &cut) + cut != len)
+			fail("utf8: random text %zu of %zu", n, len);
+		for (k = 0; n < 8 && k < 300; k++)
+			utf8_check(text, k, &cut);
+
+		at = text + xorshift(&seed) % len;
+		keep = *at;
+		*at = xorshift(&seed);
+		utf8_check(text, len, &cut);
+		*at = keep;
+	}
+}
+
+/* every callback, as text */
+static void log_chunk(void *user, const struct ci_chunk *c)
+{
+	fprintf(user, "[%s] %u %llu %08x\n", c->type, c->length,
+		(unsigned long long)c->offset, c->crc);
+}
+
+static void log_field(void *user, const struct ci_field *f)
+{
+	fprintf(user, "%d %s %u %s\n", f->kind, f->key ? f->key : "",
+		f->index, f->value);
+}
+
+static const struct ci_callbacks log_cb = {
+	.chunk = log_chunk,
+	.field = log_field
+};
+
+/* run one file through a context, return the log and the result */
+static char *level_log(const uint8_t *buf, size_t len, size_t piece,
+		       enum ci_verify level, int *err)
+{
+	struct ci_ctx *ctx;
+	char *log;
+	size_t log_len, off, n;
+	FILE *f;
+
+	log = NULL;
+	f = open_memstream(&log, &log_len);
+	ctx = ci_new(&log_cb, f);
+	ci_set_verify(ctx, level);
+
+	if (piece == 0) {
+		/* pull */
+		*err = ci_open_mem(ctx, buf, len);
+		while (*err == CI_OK)
+			*err = ci_next(ctx, NULL);
+	} else {
+		*err = CI_OK;
+		for (off = 0; off < len && *err == CI_OK; off += n) {
+			n = len - off < piece ? len - off : piece;
+			*err = ci_push(ctx, buf + off, n);
+		}
+
+		if (*err == CI_OK)
+			*err = ci_push_end(ctx);
+	}
+
+	if (*err == CI_END)
+		*err = CI_OK;
+
+	fprintf(f, "%d %s\n", *err, ci_errmsg(ctx));
+	ci_free(ctx);
+	fclose(f);
+	return log;
+}
+
+static char *parse_log(const uint8_t *buf, size_t len, size_t piece,
+		       int *err)
+{
+	return level_log(buf, len, piece, CI_VERIFY_INFLATE, err);
+}
+
+/* pushing the file in pieces must give exactly what pulling gives */
+static void test_push_pull(const char *dir)
+{
+	static const size_t pieces[] = { 1, 7, 64, 4096 };
+	DIR *d;
+	struct dirent *de;
+	char path[1024];
+	uint8_t *buf;
+	char *pull, *push;
+	size_t len, n, i;
+	int pull_err, push_err;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("push/pull: cannot open %s", dir);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		n = strlen(de->d_name);
+		if (n < 4 || strcmp(de->d_name + n - 4, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		buf = load_file(path, &len);
+		if (!buf)
+			continue;
+
+		pull = parse_log(buf, len, 0, &pull_err);
+		for (i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+			push = parse_log(buf, len, pieces[i], &push_err);
+			if (push_err != pull_err || strcmp(push, pull))
+				fail("push/pull: %s, pieces of %zu differ",
+				     de->d_name, pieces[i]);
+			free(push);
+		}
+
+		free(pull);
+		free(buf);
+	}
+
+	closedir(d);
+}
+
+/*
+ * what passes a level passes the ones below it, and image data seeked
+ * over gives the same log as image data only CRC'd
+ */
+static void test_verify(const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[1024], *all, *crc, *meta, *none, *push;
+	int err_all, err_crc, err_meta, err_none, err_push;
+	uint8_t *buf;
+	size_t n, len;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("verify: cannot open %s", dir);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		n = strlen(de->d_name);
+		if (n < 4 || strcmp(de->d_name + n - 4, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		buf = load_file(path, &len);
+		if (!buf)
+			continue;
+
+		all = level_log(buf, len, 0, CI_VERIFY_INFLATE, &err_all);
+		crc = level_log(buf, len, 0, CI_VERIFY_CRC, &err_crc);
+		meta = level_log(buf, len, 0, CI_VERIFY_META, &err_meta);
+		none = level_log(buf, len, 0, CI_VERIFY_NONE, &err_none);
+		push = level_log(buf, len, 7, CI_VERIFY_META, &err_push);
+
+		if (err_all == CI_OK &&
+		    (err_crc != CI_OK || err_meta != CI_OK || err_none != CI_OK))
+			fail("verify: %s, fails a lower level", de->d_name);
+
+		if (err_crc == CI_OK && strcmp(crc, meta))
+			fail("verify: %s, meta and crc differ", de->d_name);
+
+		if (err_push != err_meta || strcmp(push, meta))
+			fail("verify: %s, meta push/pull differ", de->d_name);
+
+		/* a corrupted IDAT is only seen from crc up */
+		if (!strcmp(de->d_name, "xcsn0g01.png") &&
+		    (err_crc != CI_ERR_CRC || err_meta != CI_OK))
+			fail("verify: %s, IDAT CRC", de->d_name);
+
+		/* a file cut in its image data is still too short */
+		if (!strcmp(de->d_name, "basn6a16.png") && len > 1000) {
+			free(meta);
+			meta = level_log(buf, 1000, 0, CI_VERIFY_META, &err_meta);
+			if (err_meta != CI_ERR_IO)
+				fail("verify: %s, cut in IDAT", de->d_name);
+		}
+
+		free(all);
+		free(crc);
+		free(meta);
+		free(none);
+		free(push);
+		free(buf);
+	}
+
+	closedir(d);
+}
+
+/* log of a file checked from its path until stop, without the result */
+static char *stop_log(const char *path, enum ci_stop stop, int *err,
+		      uint32_t *chunks)
+{
+	struct ci_ctx *ctx;
+	char *log;
+	size_t log_len;
+	FILE *f;
+
+	log = NULL;
+	f = open_memstream(&log, &log_len);
+	ctx = ci_new(&log_cb, f);
+	ci_set_stop(ctx, stop);
+
+	*err = ci_check_file(ctx, path);
+	*chunks = ci_chunk_count(ctx);
+	ci_free(ctx);
+	fclose(f);
+	return log;
+}
+
+/* stopping early gives the start of the whole log, and no error */
+static void test_stop(const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[1024], *all, *head, *meta;
+	uint32_t n_all, n_head, n_meta;
+	int err_all, err_head, err_meta;
+	size_t n;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("stop: cannot open %s", dir);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		n = strlen(de->d_name);
+		if (n < 4 || strcmp(de->d_name + n - 4, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		all = stop_log(path, CI_STOP_IEND, &err_all, &n_all);
+		head = stop_log(path, CI_STOP_IHDR, &err_head, &n_head);
+		meta = stop_log(path, CI_STOP_IDAT, &err_meta, &n_meta);
+
+		if (err_all == CI_OK &&
+		    (err_head != CI_OK || n_head != 1 ||
+		     strncmp(all, head, strlen(head))))
+			fail("stop: %s, IHDR only", de->d_name);
+
+		if (err_all == CI_OK &&
+		    (err_meta != CI_OK || n_meta < 1 || n_meta >= n_all ||
+		     strncmp(all, meta, strlen(meta)) ||
+		     strncmp(all + strlen(meta), "[IDAT]", 6)))
+			fail("stop: %s, until IDAT", de->d_name);
+
+		free(all);
+		free(head);
+		free(meta);
+	}
+
+	closedir(d);
+}
+
+static uint8_t *put_chunk(uint8_t *p, const char *type, const void *data,
+			  uint32_t len)
+{
+	uint32_t crc;
+
+	p[0] = len >> 24; p[1] = len >> 16; p[2] = len >> 8; p[3] = len;
+	memcpy(p + 4, type, 4);
+	if (len > 0)
+		memcpy(p + 8, data, len);
+
+	crc = pd_crc32(0, p + 4, len + 4);
+	p += 8 + len;
+	p[0] = crc >> 24; p[1] = crc >> 16; p[2] = crc >> 8; p[3] = crc;
+	return p + 4;
+}
+
+static int decode_priv(struct ci_ctx *ctx, const struct ci_chunk *c,
+		       void *arg)
+{
+	ci_field(ctx, "private", "%.*s", (int)c->length, c->data);
+	++*(int *)arg;
+	return CI_OK;
+}
+
+static int reject_text(struct ci_ctx *ctx, const struct ci_chunk *c,
+		       void *arg)
+{
+	(void)ctx; (void)c; (void)arg;
+	return CI_ERR_CHUNK;
+}
+
+/* private chunk types and built-in ones replaced with ci_register() */
+static void test_register(void)
+{
+	static const char ihdr[] = "\0\0\0\1\0\0\0\1\x08\0\0\0";
+	uint8_t png[256], *p;
+	struct ci_ctx *ctx;
+	char *log;
+	size_t log_len;
+	FILE *f;
+	int calls, err;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	p = put_chunk(p, "prIv", "hello", 5);
+	p = put_chunk(p, "tEXt", "Title\0x", 7);
+	p = put_chunk(p, "IDAT", "\x78\x9c\x63\x60\0\0\0\2\0\1", 10);
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	log = NULL;
+	f = open_memstream(&log, &log_len);
+	ctx = ci_new(&log_cb, f);
+	calls = 0;
+	if (ci_register(ctx, "prIv", decode_priv, &calls) != CI_OK ||
+	    ci_register(ctx, "prIvate", decode_priv, &calls) != CI_ERR_USAGE)
+		fail("register: ci_register() result");
+
+	err = ci_open_mem(ctx, png, p - png);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	fclose(f);
+
+	if (err != CI_END || calls != 1 || !strstr(log, "0 private 0 hello\n"))
+		fail("register: private chunk not decoded (%d): %s", err, log);
+	free(log);
+	ci_free(ctx);
+
+	ctx = ci_new(NULL, NULL);
+	ci_register(ctx, "tEXt", reject_text, NULL);
+	err = ci_open_mem(ctx, png, p - png);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	if (err != CI_ERR_CHUNK || ci_chunk_count(ctx) != 3)
+		fail("register: decoder error not returned (%d)", err);
+	ci_free(ctx);
+}
+
+/* pull the whole buffer, CI_OK if it ends with IEND */
+static int check_mem(const uint8_t *buf, size_t len)
+{
+	struct ci_ctx *ctx;
+	int err;
+
+	ctx = ci_new(NULL, NULL);
+	err = ci_open_mem(ctx, buf, len);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	ci_free(ctx);
+
+	return err == CI_END ? CI_OK : err;
+}
+
+/* keywords are read within their chunk, text without its control bytes */
+static void test_text(void)
+{
+	static const char ihdr[] = "\0\0\0\1\0\0\0\1\x08\0\0\0";
+	uint8_t *png, *p, *big;
+	size_t len, big_len = 100000;
+	char *log;
+	int i, err;
+
+	png = malloc(big_len + 65536);
+	big = malloc(big_len);
+	if (!png || !big) {
+		fail("text: out of memory");
+		free(png);
+		free(big);
+		return;
+	}
+
+	memset(big, 'x', big_len);
+	memcpy(big, "Big\0", 4);
+	big[big_len - 1] = '\n';
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	p = put_chunk(p, "tEXt", "Comment\0a\tb\x01" "c", 13);
+	p = put_chunk(p, "tEXt", big, big_len);
+	for (i = 0; i < 300; i++)
+		p = put_chunk(p, "tEXt", "Title\0small", 11);
+	p = put_chunk(p, "sCAL", "\x01" "1.5\0" "2\x01.5", 9);
+	p = put_chunk(p, "IDAT", "\x78\x9c\x63\x60\0\0\0\2\0\1", 10);
+	p = put_chunk(p, "IEND", NULL, 0);
+	len = p - png;
+
+	log = parse_log(png, len, 0, &err);
+	if (err != CI_OK || !strstr(log, "0 Keyword 0 Comment\n0 Text 0 abc\n") ||
+	    !strstr(log, "0 Text 0 xxxxxxxx") ||
+	    !strstr(log, "0 Physical scale 0 1.5 x 2.5 (meters)\n"))
+		fail("text: log (%d)", err);
+	free(log);
+
+	/* a keyword that runs to the end of its chunk, past it before */
+	p = put_chunk(png + 33, "tEXt", "Title", 5);
+	p = put_chunk(p, "IDAT", "\x78\x9c\x63\x60\0\0\0\2\0\1", 10);
+	p = put_chunk(p, "IEND", NULL, 0);
+	if (check_mem(png, p - png) != CI_ERR_CHUNK)
+		fail("text: keyword without separator");
+
+	free(big);
+	free(png);
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+	return p + 4;
+}
+
+/* deflate rows zero rows of a w pixels wide gray 8-bit image */
+static size_t zrows(uint8_t *z, size_t cap, uint32_t w, uint32_t rows)
+{
+	static uint8_t raw[4096];
+	uLongf zlen = cap;
+
+	memset(raw, 0, sizeof(raw));
+	if (compress(z, &zlen, raw, rows * (w + 1)) != Z_OK)
+		fail("idat: compress");
+	return zlen;
+}
+
+/* w x h gray 8-bit image whose IDAT stream z is cut in pieces */
+static size_t gray_png(uint8_t *png, uint32_t w, uint32_t h,
+		       const uint8_t *z, size_t zlen, size_t piece)
+{
+	uint8_t ihdr[13] = { 0 }, *p;
+	size_t off, n;
+
+	put_u32(put_u32(ihdr, w), h);
+	ihdr[8] = 8;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	for (off = 0; off < zlen; off += n) {
+		n = zlen - off < piece ? zlen - off : piece;
+		p = put_chunk(p, "IDAT", z + off, n);
+	}
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	return p - png;
+}
+
+/* the IDAT stream is inflated and checked against IHDR */
+static void test_idat(void)
+{
+	static uint8_t png[16384];
+	uint8_t z[1024], fd[1024], fctl[26] = { 0 }, actl[8] = { 0 }, *p;
+	size_t zlen, fdlen, len;
+	uint32_t h;
+
+	zlen = zrows(z, sizeof(z), 16, 16);
+
+	len = gray_png(png, 16, 16, z, zlen, zlen);
+	if (check_mem(png, len) != CI_OK)
+		fail("idat: valid stream rejected");
+
+	len = gray_png(png, 16, 16, z, zlen, 1);
+	if (check_mem(png, len) != CI_OK)
+		fail("idat: stream in 1 byte chunks rejected");
+
+	z[zlen - 1] ^= 1;
+	len = gray_png(png, 16, 16, z, zlen, 7);
+	if (check_mem(png, len) != CI_ERR_CHUNK)
+		fail("idat: bad Adler-32 not found");
+	z[zlen - 1] ^= 1;
+
+	len = gray_png(png, 16, 16, z, zlen - 4, zlen);
+	if (check_mem(png, len) != CI_ERR_CHUNK)
+		fail("idat: truncated stream not found");
+
+	len = gray_png(png, 16, 17, z, zlen, zlen);
+	if (check_mem(png, len) != CI_ERR_CHUNK)
+		fail("idat: short image data not found");
+
+	len = gray_png(png, 16, 15, z, zlen, zlen);
+	if (check_mem(png, len) != CI_ERR_CHUNK)
+		fail("idat: long image data not found");
+
+	/* APNG, a 16x16 default image and one 4x4 frame */
+	fdlen = 4 + zrows(fd + 4, sizeof(fd) - 4, 4, 4);
+	put_u32(fd, 1);
+	put_u32(actl, 1);
+	put_u32(put_u32(put_u32(fctl, 0), 4), 4);
+
+	for (h = 4; h <= 5; h++) {
+		put_u32(fctl + 8, h);
+
+		/* keep the signature and IHDR */
+		gray_png(png, 16, 16, z, zlen, zlen);
+		p = put_chunk(png + 33, "acTL", actl, 8);
+		p = put_chunk(p, "IDAT", z, zlen);
+		p = put_chunk(p, "fcTL", fctl, 26);
+		p = put_chunk(p, "fdAT", fd, fdlen);
+		p = put_chunk(p, "IEND", NULL, 0);
+
+		if (check_mem(png, p - png) != (h == 4 ? CI_OK : CI_ERR_CHUNK))
+			fail("idat: APNG frame of height %u", h);
+	}
+}
+
+struct inflated_log {
+	char type[5];
+	uint64_t len;
+	uint32_t pieces, lasts, stopped;
+	uint32_t adler;
+};
+
+static void log_inflated(void *user, const struct ci_inflated *piece)
+{
+	struct inflated_log *il = user;
+	size_t cut;
+
+	if (piece->offset != il->len)
+		fail("inflate: piece at %llu, %llu expected",
+		     (unsigned long long)piece->offset,
+		     (unsigned long long)il->len);
+
+	memcpy(il->type, piece->type, 5);
+	if (!strcmp(il->type, "iTXt") &&
+	    utf8_valid(piece->data, piece->len, &cut) != piece->len)
+		fail("inflate: iTXt piece at %llu is not UTF-8",
+		     (unsigned long long)piece->offset);
+	il->adler = adler32(il->adler, piece->data, piece->len);
+	il->len += piece->len;
+	il->pieces++;
+	il->lasts += piece->last;
+	il->stopped += piece->stopped;
+}
+
+/* a 1x1 gray image with one chunk of type before IDAT, through limits */
+static int inflate_png(const char *type, const uint8_t *data, size_t len,
+		       enum ci_verify verify, uint64_t max, unsigned ratio,
+		       struct inflated_log *il)
+{
+	static const struct ci_callbacks cb = { .inflated = log_inflated };
+	static uint8_t png[65536];
+	uint8_t ihdr[13] = { 0, 0, 0, 1, 0, 0, 0, 1, 8 }, z[64], *p;
+	struct ci_ctx *ctx;
+	int err;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	p = put_chunk(p, type, data, len);
+	p = put_chunk(p, "IDAT", z, zrows(z, sizeof(z), 1, 1));
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	memset(il, 0, sizeof(*il));
+	il->adler = adler32(0, NULL, 0);
+	ctx = ci_new(&cb, il);
+	ci_set_verify(ctx, verify);
+	ci_set_inflate_limits(ctx, max, ratio);
+	err = ci_open_mem(ctx, png, p - png);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	ci_free(ctx);
+
+	return err == CI_END ? CI_OK : err;
+}
+
+/*
+ * zTXt, iTXt and iCCP are inflated a window at a time, up to the limits:
+ * 16 MB of zeros in 16 KB is stopped at the first MB
+ */
+static void test_inflate_meta(void)
+{
+	static uint8_t raw[16 << 20], chunk[32768];
+	struct inflated_log il;
+	uLongf zlen;
+	size_t i, k;
+	uint32_t adler;
+
+	for (i = 0; i < 100000; i++)
+		raw[i] = "PNG chunk text "[i % 15] + (i % 977 == 0);
+	adler = adler32(adler32(0, NULL, 0), raw, 100000);
+
+	/* zTXt: keyword, nul, method */
+	memcpy(chunk, "Comment\0\0", 9);
+	zlen = sizeof(chunk) - 9;
+	if (compress2(chunk + 9, &zlen, raw, 100000, 9) != Z_OK)
+		fail("inflate: compress");
+
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_INFLATE, 1 << 20,
+			0, &il) != CI_OK || strcmp(il.type, "zTXt") ||
+	    il.len != 100000 || il.adler != adler || il.pieces < 2 ||
+	    il.lasts != 1 || il.stopped != 0)
+		fail("inflate: zTXt (%llu bytes in %u)",
+		     (unsigned long long)il.len, il.pieces);
+
+	/* limits */
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_INFLATE, 5000, 0,
+			&il) != CI_OK || il.len != 5000 || il.stopped != 1 ||
+	    il.lasts != 1)
+		fail("inflate: zTXt over max (%llu)", (unsigned long long)il.len);
+
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_INFLATE, 1 << 20, 2,
+			&il) != CI_OK || il.len != 2 * zlen ||
+	    il.stopped != 1)
+		fail("inflate: zTXt over ratio (%llu)",
+		     (unsigned long long)il.len);
+
+	/* not below CI_VERIFY_INFLATE */
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_CRC, 1 << 20, 0,
+			&il) != CI_OK || il.pieces != 0)
+		fail("inflate: zTXt at CI_VERIFY_CRC");
+
+	/* cut short and damaged */
+	if (inflate_png("zTXt", chunk, 9 + zlen / 2, CI_VERIFY_INFLATE,
+			1 << 20, 0, &il) != CI_ERR_CHUNK)
+		fail("inflate: zTXt cut short");
+	chunk[9 + zlen / 2] ^= 0x55;
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_ERR_CHUNK)
+		fail("inflate: damaged zTXt");
+
+	/* the bomb */
+	memset(raw, 0, sizeof(raw));
+	memcpy(chunk, "Comment\0\0", 9);
+	zlen = sizeof(chunk) - 9;
+	if (compress2(chunk + 9, &zlen, raw, sizeof(raw), 9) != Z_OK)
+		fail("inflate: compress the bomb");
+	if (inflate_png("zTXt", chunk, 9 + zlen, CI_VERIFY_INFLATE, 1 << 20,
+			0, &il) != CI_OK || il.len != 1 << 20 || il.stopped != 1)
+		fail("inflate: bomb (%llu)", (unsigned long long)il.len);
+
+	/* iTXt: keyword, flag, method, language, translated keyword */
+	k = sizeof("Title\0\1\0en\0Titel\0") - 1;
+	memcpy(chunk, "Title\0\1\0en\0Titel\0", k);
+	zlen = sizeof(chunk) - k;
+	compress(chunk + k, &zlen, (const uint8_t *)"PngSuite", 8);
+	if (inflate_png("iTXt", chunk, k + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_OK || strcmp(il.type, "iTXt") || il.len != 8)
+		fail("inflate: iTXt (%llu)", (unsigned long long)il.len);
+
+	/* characters cut by the windows, and by the limit */
+	for (i = 0; i < 60000; i += 3)
+		memcpy(raw + i, "\xe2\x82\xac", 3);
+	adler = adler32(adler32(0, NULL, 0), raw, 60000);
+	zlen = sizeof(chunk) - k;
+	compress(chunk + k, &zlen, raw, 60000);
+	if (inflate_png("iTXt", chunk, k + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_OK || il.len != 60000 || il.adler != adler ||
+	    il.pieces < 4)
+		fail("inflate: iTXt in UTF-8 (%llu)", (unsigned long long)il.len);
+	if (inflate_png("iTXt", chunk, k + zlen, CI_VERIFY_INFLATE, 5000, 0,
+			&il) != CI_OK || il.len != 4998 || il.stopped != 1)
+		fail("inflate: iTXt in UTF-8 over max (%llu)",
+		     (unsigned long long)il.len);
+
+	/* and not UTF-8: broken, or cut by the end */
+	raw[40000] = 0xff;
+	zlen = sizeof(chunk) - k;
+	compress(chunk + k, &zlen, raw, 60000);
+	if (inflate_png("iTXt", chunk, k + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_ERR_CHUNK || il.len != 32766)
+		fail("inflate: iTXt not in UTF-8 (%llu)",
+		     (unsigned long long)il.len);
+	zlen = sizeof(chunk) - k;
+	compress(chunk + k, &zlen, raw, 20);
+	if (inflate_png("iTXt", chunk, k + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_ERR_CHUNK)
+		fail("inflate: iTXt cut in a character");
+
+	memcpy(chunk, "Title\0\0\0en\0Titel\0Pr\xc3\xbc" "fung", k + 9);
+	if (inflate_png("iTXt", chunk, k + 9, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_OK)
+		fail("inflate: uncompressed iTXt");
+	chunk[k + 3] = 0xc3;
+	if (inflate_png("iTXt", chunk, k + 9, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_ERR_CHUNK)
+		fail("inflate: uncompressed iTXt not in UTF-8");
+	chunk[k - 2] = 0xa4;
+	if (inflate_png("iTXt", chunk, k, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_ERR_CHUNK)
+		fail("inflate: translated keyword not in UTF-8");
+
+	/* iCCP: name, nul, method */
+	memcpy(chunk, "sRGB\0\0", 6);
+	zlen = sizeof(chunk) - 6;
+	compress(chunk + 6, &zlen, raw, 3144);
+	if (inflate_png("iCCP", chunk, 6 + zlen, CI_VERIFY_INFLATE, 1 << 20, 0,
+			&il) != CI_OK || strcmp(il.type, "iCCP") ||
+	    il.len != 3144)
+		fail("inflate: iCCP (%llu)", (unsigned long long)il.len);
+}
+
+/*
+ * a 1x1 image of color type color, 8-bit, with the chunks of list:
+ * acTL gives as many frames as there are fcTL, acTL9 gives 9, skip
+ * leaves a gap in the sequence numbers
+ */
+static size_t order_png(uint8_t *png, int color, const char *list)
+{
+	uint8_t ihdr[13] = { 0, 0, 0, 1, 0, 0, 0, 1, 8 }, buf[256], z[64];
+	uint32_t seq = 0, frames = 0;
+	const char *at;
+	uint8_t *p;
+	size_t zlen;
+	char name[8];
+	int n;
+
+	ihdr[9] = color;
+	zlen = zrows(z, sizeof(z), color == 2 ? 3 : 1, 1);
+	for (at = list; (at = strstr(at, "fcTL")); at++)
+		frames++;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	while (sscanf(list, "%7s%n", name, &n) == 1) {
+		list += n;
+		memset(buf, 0, sizeof(buf));
+		if (!strcmp(name, "skip")) {
+			seq++;
+		} else if (!strncmp(name, "acTL", 4)) {
+			put_u32(buf, name[4] ? 9 : frames);
+			p = put_chunk(p, "acTL", buf, 8);
+		} else if (!strcmp(name, "fcTL")) {
+			put_u32(put_u32(put_u32(buf, seq++), 1), 1);
+			buf[23] = 1;
+			p = put_chunk(p, name, buf, 26);
+		} else if (!strcmp(name, "fdAT")) {
+			put_u32(buf, seq++);
+			memcpy(buf + 4, z, zlen);
+			p = put_chunk(p, name, buf, 4 + zlen);
+		} else if (!strcmp(name, "IDAT")) {
+			p = put_chunk(p, name, z, zlen);
+		} else if (!strcmp(name, "PLTE") || !strcmp(name, "IEND")) {
+			p = put_chunk(p, name, buf, name[0] == 'P' ? 3 : 0);
+		} else if (!strcmp(name, "gAMA")) {
+			put_u32(buf, 45455);
+			p = put_chunk(p, name, buf, 4);
+		} else if (!strcmp(name, "bKGD") || !strcmp(name, "tRNS")) {
+			p = put_chunk(p, name, buf, color == 2 ? 6 : 1);
+		} else if (!strcmp(name, "pHYs")) {
+			p = put_chunk(p, name, buf, 9);
+		} else if (!strcmp(name, "tIME")) {
+			p = put_chunk(p, name, "\x07\xd0\x01\x01\0\0\0", 7);
+		} else {
+			p = put_chunk(p, name, "a\0b", 3);
+		}
+	}
+
+	return p - png;
+}
+
+/* PNG and APNG chunk order and how many of each there can be */
+static void test_order(void)
+{
+	static const struct {
+		int color;
+		const char *list;
+		int err;
+	} tests[] = {
+		{ 2, "gAMA PLTE bKGD tRNS pHYs IDAT tIME tEXt IEND", CI_OK },
+		{ 2, "bKGD IDAT IEND", CI_OK },
+		{ 3, "PLTE IDAT IEND", CI_OK },
+		{ 2, "acTL IDAT fcTL fdAT fcTL fdAT IEND", CI_OK },
+		{ 2, "acTL fcTL IDAT fcTL fdAT IEND", CI_OK },
+		{ 2, "IEND", CI_ERR_ORDER },
+		{ 2, "PLTE gAMA IDAT IEND", CI_ERR_ORDER },
+		{ 2, "IDAT gAMA IEND", CI_ERR_ORDER },
+		{ 2, "gAMA gAMA IDAT IEND", CI_ERR_ORDER },
+		{ 2, "bKGD PLTE IDAT IEND", CI_ERR_ORDER },
+		{ 2, "IDAT PLTE IEND", CI_ERR_ORDER },
+		{ 2, "IDAT pHYs IEND", CI_ERR_ORDER },
+		{ 2, "IDAT tEXt IDAT IEND", CI_ERR_ORDER },
+		{ 2, "tIME IDAT tIME IEND", CI_ERR_ORDER },
+		{ 3, "IDAT IEND", CI_ERR_ORDER },
+		{ 2, "IDAT acTL IEND", CI_ERR_ORDER },
+		{ 2, "IDAT fcTL fdAT IEND", CI_ERR_ORDER },
+		{ 2, "acTL fcTL fcTL IDAT IEND", CI_ERR_ORDER },
+		{ 2, "acTL fcTL fdAT IDAT IEND", CI_ERR_ORDER },
+		{ 2, "acTL IDAT fdAT IEND", CI_ERR_ORDER },
+		{ 2, "acTL IDAT fcTL skip fdAT IEND", CI_ERR_ORDER },
+		{ 2, "acTL9 IDAT fcTL fdAT IEND", CI_ERR_ORDER },
+	};
+	uint8_t png[1024];
+	size_t i, len;
+	int err;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		len = order_png(png, tests[i].color, tests[i].list);
+		err = check_mem(png, len);
+		if (err != tests[i].err)
+			fail("order: %s (%d)", tests[i].list, err);
+
+		/* the same when pushed a byte at a time */
+		free(parse_log(png, len, 1, &err));
+		if (err != tests[i].err)
+			fail("order: %s, pushed (%d)", tests[i].list, err);
+	}
+}
+
+/* far more chunks than the 8192 that used to be the most */
+static void test_table(void)
+{
+	uint8_t ihdr[13] = { 0, 0, 0, 16, 0, 0, 0, 16, 8 }, z[512];
+	const uint32_t nfill = 100000;
+	enum ci_verify verify;
+	struct ci_table t;
+	struct ci_ctx *ctx;
+	uint8_t *png, *p;
+	uint32_t i, idat;
+	size_t zlen, len;
+	int err;
+
+	zlen = zrows(z, sizeof(z), 16, 16);
+	png = malloc(8 + 25 + nfill * 13 + 12 + zlen + 12);
+	if (!png)
+		fail("table: out of memory");
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	for (i = 0; i < nfill; i++)
+		p = put_chunk(p, "prIv", &i, 1);
+	p = put_chunk(p, "IDAT", z, zlen);
+	p = put_chunk(p, "IEND", NULL, 0);
+	len = p - png;
+	idat = nfill + 1;
+
+	for (verify = CI_VERIFY_NONE; verify <= CI_VERIFY_INFLATE; verify++) {
+		ctx = ci_new(NULL, NULL);
+		ci_set_verify(ctx, verify);
+		err = ci_open_mem(ctx, png, len);
+		while (err == CI_OK)
+			err = ci_next(ctx, NULL);
+
+		ci_chunk_table(ctx, &t);
+		if (err != CI_END || t.count != nfill + 3 ||
+		    ci_chunk_count(ctx) != t.count)
+			fail("table: %u chunks (%d)", t.count, err);
+
+		for (i = 1; i < idat; i++) {
+			if (t.tag[i] != 0x70724976 || t.length[i] != 1 ||
+			    t.offset[i] != 37 + (uint64_t)(i - 1) * 13 ||
+			    t.flags[i] != (verify >= CI_VERIFY_META ?
+					   CI_CHUNK_CRC : 0))
+				fail("table: chunk %u", i);
+		}
+
+		if (t.tag[idat] != 0x49444154 || t.length[idat] != zlen ||
+		    t.crc[idat] != pd_crc32(0, p - 20 - zlen, zlen + 4) ||
+		    t.flags[idat] != (verify < CI_VERIFY_CRC ?
+				      CI_CHUNK_SKIPPED : CI_CHUNK_CRC))
+			fail("table: IDAT flags %x", t.flags[idat]);
+		ci_free(ctx);
+	}
+
+	free(png);
+}
+
+struct damage_log {
+	uint32_t n;
+	uint64_t offset[4], length[4];
+	int error[4];
+};
+
+static void log_damage(void *user, const struct ci_damage *d)
+{
+	struct damage_log *dl = user;
+
+	if (dl->n < 4) {
+		dl->offset[dl->n] = d->offset;
+		dl->length[dl->n] = d->length;
+		dl->error[dl->n] = d->error;
+	}
+	dl->n++;
+}
+
+/*
+ * a damaged chunk and junk of every length up to 80 bytes, with letters
+ * that look like a chunk type in it: each is skipped up to the next good
+ * chunk, whatever its place in the 16 byte steps of the search
+ */
+static void test_recover(void)
+{
+	static const struct ci_callbacks cb = { .damage = log_damage };
+	uint8_t ihdr[13] = { 0, 0, 0, 16, 0, 0, 0, 16, 8 }, z[512];
+	uint8_t png[2048], *p, *text, *junk;
+	struct damage_log dl;
+	struct ci_table t;
+	struct ci_ctx *ctx;
+	size_t zlen, n, k;
+	int err;
+
+	zlen = zrows(z, sizeof(z), 16, 16);
+	for (n = 1; n <= 80; n++) {
+		memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+		p = put_chunk(png + 8, "IHDR", ihdr, 13);
+		text = p;
+		p = put_chunk(p, "tEXt", "Title\0damaged", 13);
+		text[20] ^= 1;
+		p = put_chunk(p, "IDAT", z, zlen);
+
+		junk = p;
+		for (k = 0; k < n; k++)
+			*p++ = (uint8_t)(k * 37 + n);
+		if (n >= 8)
+			memcpy(junk + n - 8, "\0\0\0\0IDAT", 8);
+		p = put_chunk(p, "IEND", NULL, 0);
+
+		memset(&dl, 0, sizeof(dl));
+		ctx = ci_new(&cb, &dl);
+		ci_set_recover(ctx, 1);
+		err = ci_open_mem(ctx, png, p - png);
+		while (err == CI_OK)
+			err = ci_next(ctx, NULL);
+
+		if (err != CI_END || dl.n != 2 || ci_damage_count(ctx) != 2 ||
+		    dl.offset[0] != (size_t)(text - png) || dl.length[0] != 25 ||
+		    dl.error[0] != CI_ERR_CRC ||
+		    dl.offset[1] != (size_t)(junk - png) || dl.length[1] != n ||
+		    ci_chunk_count(ctx) != 3)
+			fail("recover: %zu bytes of junk (%d, %u damaged)",
+			     n, err, dl.n);
+
+		ci_chunk_table(ctx, &t);
+		if (t.flags[0] != CI_CHUNK_CRC ||
+		    t.flags[1] != (CI_CHUNK_CRC | CI_CHUNK_RESYNC) ||
+		    t.flags[2] != (CI_CHUNK_CRC | CI_CHUNK_RESYNC))
+			fail("recover: table flags %x %x %x",
+			     t.flags[0], t.flags[1], t.flags[2]);
+		ci_free(ctx);
+
+		/* without recovery the first one is the end */
+		if (check_mem(png, p - png) != CI_ERR_CRC)
+			fail("recover: not asked for");
+	}
+
+	/* nothing good after the damage: the usual error */
+	p = put_chunk(png + 33, "tEXt", "Title\0damaged", 13);
+	png[33 + 20] ^= 1;
+	memset(&dl, 0, sizeof(dl));
+	ctx = ci_new(&cb, &dl);
+	ci_set_recover(ctx, 1);
+	err = ci_open_mem(ctx, png, p - png);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	if (err != CI_ERR_CRC || dl.n != 0)
+		fail("recover: damage at the end (%d)", err);
+	ci_free(ctx);
+
+	/* cut in a chunk header, or no chunk at all: the usual error */
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	for (n = 8; n <= (size_t)(p - png) + 6; n += p - png - 8 + 6) {
+		memset(&dl, 0, sizeof(dl));
+		ctx = ci_new(&cb, &dl);
+		ci_set_recover(ctx, 1);
+		err = ci_open_mem(ctx, png, n);
+		while (err == CI_OK)
+			err = ci_next(ctx, NULL);
+		if (err != CI_ERR_IO || err != check_mem(png, n) || dl.n != 0)
+			fail("recover: cut after %zu bytes (%d)", n, err);
+		ci_free(ctx);
+	}
+}
+
+struct pipe_writer {
+	int fd;
+	const uint8_t *buf;
+	size_t len;
+};
+
+static void *write_pipe(void *arg)
+{
+	struct pipe_writer *w = arg;
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < w->len; off += n) {
+		n = write(w->fd, w->buf + off, w->len - off);
+		if (n <= 0)
+			break;
+	}
+	close(w->fd);
+
+	return NULL;
+}
+
+/* parse_log() of buf read from a pipe, ahead on a thread if threads > 1 */
+static char *pipe_log(const uint8_t *buf, size_t len, unsigned threads,
+		      int *err)
+{
+	struct pipe_writer w = { .buf = buf, .len = len };
+	struct ci_ctx *ctx;
+	pthread_t tid;
+	char *log;
+	size_t log_len;
+	FILE *f;
+	int fd[2];
+
+	if (pipe(fd) < 0) {
+		fail("pipe: pipe()");
+		return strdup("");
+	}
+	w.fd = fd[1];
+	pthread_create(&tid, NULL, write_pipe, &w);
+
+	log = NULL;
+	f = open_memstream(&log, &log_len);
+	ctx = ci_new(&log_cb, f);
+	ci_set_threads(ctx, threads);
+
+	*err = ci_open_fd(ctx, fd[0]);
+	while (*err == CI_OK)
+		*err = ci_next(ctx, NULL);
+	if (*err == CI_END)
+		*err = CI_OK;
+
+	fprintf(f, "%d %s\n", *err, ci_errmsg(ctx));
+	ci_free(ctx);
+	fclose(f);
+
+	/* the writer may be stuck on what was not read */
+	close(fd[0]);
+	pthread_join(tid, NULL);
+	return log;
+}
+
+/* a chunk too big to keep is CRC'd without being kept, not decoded */
+static void test_huge_chunk(void)
+{
+	uint8_t ihdr[13] = { 0, 0, 0, 1, 0, 0, 0, 1, 8 }, z[64], *png, *text, *p;
+	uint32_t len = (16 << 20) + 1;
+	char *log;
+	size_t zlen;
+	int err;
+
+	png = malloc(len + 256);
+	text = calloc(1, len);
+	if (!png || !text) {
+		fail("huge chunk: out of memory");
+		free(png);
+		free(text);
+		return;
+	}
+
+	zlen = zrows(z, sizeof(z), 1, 1);
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	memcpy(text, "Comment", 8);
+	p = put_chunk(p, "tEXt", text, len);
+	p = put_chunk(p, "IDAT", z, zlen);
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	log = pipe_log(png, p - png, 1, &err);
+	if (err != CI_OK || !strstr(log, "Not decoded"))
+		fail("huge chunk: pipe (%d)", err);
+	free(log);
+
+	log = parse_log(png, p - png, 1 << 20, &err);
+	if (err != CI_OK || !strstr(log, "Not decoded"))
+		fail("huge chunk: push (%d)", err);
+	free(log);
+
+	/* a 2 GB IDAT that never comes */
+	p = put_chunk(png + 33, "IDAT", NULL, 0);
+	put_u32(png + 33, INT_MAX - 1);
+	log = parse_log(png, p - png, 4096, &err);
+	if (err != CI_ERR_IO)
+		fail("huge chunk: truncated push (%d)", err);
+	free(log);
+
+	free(text);
+	free(png);
+}
+
+/* the chunks of test_large(), CI_VERIFY_META seeks over the IDAT ones */
+static void check_large(struct ci_ctx *ctx, int err, uint64_t text,
+			const char *how)
+{
+	struct ci_table t;
+
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+
+	ci_chunk_table(ctx, &t);
+	if (err != CI_END || t.count != 6 || t.tag[4] != 0x74455874 ||
+	    t.offset[4] != text || t.offset[5] != text + 23 ||
+	    t.flags[3] != CI_CHUNK_SKIPPED)
+		fail("large: %s (%d, %u chunks)", how, err, t.count);
+	ci_free(ctx);
+}
+
+/*
+ * a sparse file past 4 GB: three IDAT chunks of 2^31 - 1 bytes, then
+ * tEXt and IEND. the PNG starts a page into the file, it is read with
+ * pread() from an fd left at that offset, and mapped from there.
+ */
+static void test_large(void)
+{
+	const uint32_t len = 0x7fffffff;
+	const off_t base = 4096;
+	char path[] = "/tmp/chunkinfo-test-XXXXXX";
+	uint8_t png[128], *p;
+	struct ci_ctx *ctx;
+	uint64_t off, text;
+	void *map;
+	int fd, err, k;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fail("large: %s", path);
+		return;
+	}
+	unlink(path);
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR",
+		      "\0\0\0\x01\0\0\0\x01\x08\0\0\0\0", 13);
+	err = pwrite(fd, png, p - png, base) != p - png;
+
+	off = p - png;
+	for (k = 0; k < 3 && !err; k++) {
+		put_u32(png, len);
+		memcpy(png + 4, "IDAT", 4);
+		err = pwrite(fd, png, 8, base + off) != 8;
+		off += 12 + (uint64_t)len;
+	}
+
+	text = off + 4;
+	p = put_chunk(png, "tEXt", "Comment\0far", 11);
+	p = put_chunk(p, "IEND", NULL, 0);
+	if (err || pwrite(fd, png, p - png, base + off) != p - png) {
+		/* no sparse files here, or no room for them */
+		printf("large file: skipped\n");
+		close(fd);
+		return;
+	}
+	off += p - png;
+
+	lseek(fd, base, SEEK_SET);
+	ctx = ci_new(NULL, NULL);
+	ci_set_verify(ctx, CI_VERIFY_META);
+	check_large(ctx, ci_open_fd(ctx, fd), text, "pread");
+	if (lseek(fd, 0, SEEK_CUR) != base)
+		fail("large: the fd offset moved");
+
+	/* a 32-bit build can't map it */
+	map = off <= SIZE_MAX ?
+		mmap(NULL, off, PROT_READ, MAP_PRIVATE, fd, base) : MAP_FAILED;
+	if (map != MAP_FAILED) {
+		ctx = ci_new(NULL, NULL);
+		ci_set_verify(ctx, CI_VERIFY_META);
+		check_large(ctx, ci_open_mem(ctx, map, off), text, "mapped");
+		munmap(map, off);
+	}
+
+	close(fd);
+}
+
+/* a pipe, read through the window, must give what the file gives */
+static void test_pipe(const char *dir)
+{
+	static uint8_t raw[256 * 1025], z[256 * 1025 + 4096];
+	static uint8_t png[sizeof(z) + 200000];
+	DIR *d;
+	struct dirent *de;
+	char path[1024], *mem, *piped;
+	uint8_t *buf, *p;
+	uint32_t seed = 5;
+	uLongf zlen;
+	size_t len, n, i;
+	unsigned t;
+	int mem_err, pipe_err;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("pipe: cannot open %s", dir);
+		return;
+	}
+
+	while ((de = readdir(d))) {
+		n = strlen(de->d_name);
+		if (n < 4 || strcmp(de->d_name + n - 4, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		buf = load_file(path, &len);
+		if (!buf)
+			continue;
+
+		mem = parse_log(buf, len, 0, &mem_err);
+		for (t = 1; t <= 2; t++) {
+			piped = pipe_log(buf, len, t, &pipe_err);
+			if (pipe_err != mem_err || strcmp(mem, piped))
+				fail("pipe: %s differs, %u threads",
+				     de->d_name, t);
+			free(piped);
+		}
+
+		free(mem);
+		free(buf);
+	}
+	closedir(d);
+
+	/* chunks bigger than the window: image data, unknown, and tEXt */
+	for (i = 0; i < sizeof(raw); i++)
+		raw[i] = i % 1025 ? xorshift(&seed) >> 24 : 0;
+	zlen = sizeof(z);
+	if (compress2(z, &zlen, raw, sizeof(raw), 0) != Z_OK)
+		fail("pipe: compress");
+
+	len = gray_png(png, 1024, 256, z, zlen, 100000);
+	memmove(png + 33 + 2 * 100012, png + 33, len - 33);
+	memset(raw, 'x', 100000);
+	memcpy(raw, "Comment", 8);
+	p = put_chunk(png + 33, "tEXt", raw, 100000);
+	put_chunk(p, "prIv", raw, 100000);
+	len += 2 * 100012;
+
+	for (i = 0; i < 2; i++) {
+		mem = parse_log(png, len, 0, &mem_err);
+		for (t = 1; t <= 2; t++) {
+			piped = pipe_log(png, len, t, &pipe_err);
+			if (mem_err != (i ? CI_ERR_CRC : CI_OK) ||
+			    pipe_err != mem_err || strcmp(mem, piped))
+				fail("pipe: big chunks differ%s, %u threads",
+				     i ? ", bad CRC" : "", t);
+			free(piped);
+		}
+
+		/* pushed in pieces smaller than the window, and bigger */
+		for (n = 4096; n <= 1 << 20; n *= 256) {
+			piped = parse_log(png, len, n, &pipe_err);
+			if (pipe_err != mem_err || strcmp(mem, piped))
+				fail("push: big chunks differ%s, pieces of %zu",
+				     i ? ", bad CRC" : "", n);
+			free(piped);
+		}
+		free(mem);
+
+		/* then in the middle of a window of the second IDAT */
+		png[33 + 2 * 100012 + 100012 + 70000] ^= 1;
+	}
+}
+
+/* the thread reading ahead must not keep ci_free() waiting on a writer */
+static void test_pipe_open(void)
+{
+	static const uint8_t z[] = { 0x78, 0x9c, 0x63, 0x60, 0x00, 0x00,
+				     0x00, 0x02, 0x00, 0x01 };
+	uint8_t png[128];
+	struct ci_ctx *ctx;
+	size_t len;
+	int fd[2], err;
+
+	len = gray_png(png, 1, 1, z, sizeof(z), sizeof(z));
+	if (pipe(fd) < 0 || write(fd[1], png, len) != (ssize_t)len) {
+		fail("pipe open: pipe()");
+		return;
+	}
+
+	ctx = ci_new(NULL, NULL);
+	ci_set_threads(ctx, 2);
+	err = ci_open_fd(ctx, fd[0]);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	if (err != CI_END)
+		fail("pipe open: %d %s", err, ci_errmsg(ctx));
+	ci_free(ctx);
+
+	close(fd[0]);
+	close(fd[1]);
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* filter one row of raw bytes with type, the way an encoder would */
+static void filter_row(uint8_t *out, const uint8_t *raw, const uint8_t *prev,
+		       size_t len, unsigned bpp, unsigned type)
+{
+	uint8_t a, b, c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a = i >= bpp ? raw[i - bpp] : 0;
+		b = prev[i];
+		c = i >= bpp ? prev[i - bpp] : 0;
+
+		switch (type) {
+		case FILTER_SUB: out[i] = raw[i] - a; break;
+		case FILTER_UP: out[i] = raw[i] - b; break;
+		case FILTER_AVG: out[i] = raw[i] - ((a + b) >> 1); break;
+		case FILTER_PAETH: out[i] = raw[i] - paeth(a, b, c); break;
+		default: out[i] = raw[i]; break;
+		}
+	}
+}
+
+static void get_image(void *user, const struct ci_image *img)
+{
+	*(struct ci_image *)user = *img;
+}
+
+/*
+ * random pixels, every filter type: the CRC-32 of the rows unfiltered by
+ * the library must be the one of the rows before they were filtered.
+ */
+static void unfilter_image(uint32_t w, uint32_t h, uint8_t depth,
+			   uint8_t color, int il, uint32_t *seed)
+{
+	static const uint8_t adam7[7][4] = {
+		{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+		{ 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+	};
+	static const uint8_t channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+	static uint8_t raw[2][1024], filtered[65536], z[65536], png[70000];
+	struct ci_callbacks cb = { .image = get_image };
+	struct ci_image img;
+	struct ci_ctx *ctx;
+	uint8_t ihdr[13] = { 0 }, *p;
+	uint32_t crc, pw, ph, y, type;
+	size_t len, rowlen, i;
+	unsigned bits, bpp;
+	uLongf zlen;
+	unsigned threads;
+	int pass, err;
+
+	bits = depth * channels[color];
+	bpp = bits < 8 ? 1 : bits / 8;
+
+	len = 0;
+	crc = 0;
+	type = 0;
+	for (pass = 0; pass < (il ? 7 : 1); pass++) {
+		pw = w, ph = h;
+		if (il) {
+			pw = w > adam7[pass][0] ? (w - adam7[pass][0] +
+				adam7[pass][2] - 1) / adam7[pass][2] : 0;
+			ph = h > adam7[pass][1] ? (h - adam7[pass][1] +
+				adam7[pass][3] - 1) / adam7[pass][3] : 0;
+		}
+		if (pw == 0 || ph == 0)
+			continue;
+
+		rowlen = (pw * bits + 7) / 8;
+		memset(raw[1], 0, rowlen);
+		for (y = 0; y < ph; y++) {
+			for (i = 0; i < rowlen; i++)
+				raw[y & 1][i] = xorshift(seed);
+
+			filtered[len] = type;
+			filter_row(filtered + len + 1, raw[y & 1], raw[~y & 1],
+				   rowlen, bpp, type);
+			len += 1 + rowlen;
+
+			crc = pd_crc32(crc, raw[y & 1], rowlen);
+			type = (type + 1) % FILTER_TYPES;
+		}
+	}
+
+	zlen = sizeof(z);
+	if (compress(z, &zlen, filtered, len) != Z_OK) {
+		fail("unfilter: compress");
+		return;
+	}
+
+	put_u32(put_u32(ihdr, w), h);
+	ihdr[8] = depth;
+	ihdr[9] = color;
+	ihdr[12] = il;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = put_chunk(png + 8, "IHDR", ihdr, 13);
+	if (color == 3)
+		p = put_chunk(p, "PLTE", raw[0], 48);
+	p = put_chunk(p, "IDAT", z, zlen);
+	p = put_chunk(p, "IEND", NULL, 0);
+
+	/* one thread, then the Adam7 passes in parallel */
+	for (threads = 1; threads <= 3; threads += 2) {
+		memset(&img, 0, sizeof(img));
+		ctx = ci_new(&cb, &img);
+		ci_set_verify(ctx, CI_VERIFY_FULL);
+		ci_set_threads(ctx, threads);
+		err = ci_open_mem(ctx, png, p - png);
+		while (err == CI_OK)
+			err = ci_next(ctx, NULL);
+
+		if (err != CI_END || img.pixels_crc != crc)
+			fail("unfilter: %ux%u, %u bits per pixel, %s, %u threads: %s",
+			     w, h, bits, il ? "Adam7" : "no interlace", threads,
+			     err != CI_END ? ci_errmsg(ctx) : "pixels differ");
+		ci_free(ctx);
+	}
+}
+
+/* every pixel format, with and without Adam7 */
+static void test_unfilter(void)
+{
+	static const uint8_t formats[][2] = {  /* bit depth, color type */
+		{ 1, 0 }, { 2, 0 }, { 4, 0 }, { 8, 0 }, { 16, 0 },
+		{ 8, 2 }, { 16, 2 }, { 4, 3 }, { 8, 4 }, { 16, 4 },
+		{ 8, 6 }, { 16, 6 }
+	};
+	static const uint32_t sizes[][2] = { { 1, 1 }, { 7, 5 }, { 33, 17 } };
+	uint8_t filtered[2] = { FILTER_TYPES, 0 }, z[64], png[256];
+	struct ci_ctx *ctx;
+	uint32_t seed;
+	size_t f, n, len;
+	uLongf zlen;
+	int il, err;
+
+	seed = 0x1234567;
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+			for (il = 0; il <= 1; il++)
+				unfilter_image(sizes[n][0], sizes[n][1],
+					       formats[f][0], formats[f][1],
+					       il, &seed);
+		}
+	}
+
+	/* an invalid filter type */
+	zlen = sizeof(z);
+	compress(z, &zlen, filtered, 2);
+	len = gray_png(png, 1, 1, z, zlen, zlen);
+
+	ctx = ci_new(NULL, NULL);
+	ci_set_verify(ctx, CI_VERIFY_FULL);
+	err = ci_open_mem(ctx, png, len);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	if (err != CI_ERR_CHUNK)
+		fail("unfilter: invalid filter type not found");
+	ci_free(ctx);
+}
+
+/* rows of a gray 8-bit w x h image deflated with a flush every n rows */
+static size_t zflush(uint8_t *z, size_t cap, const uint8_t *raw, uint32_t w,
+		     uint32_t h, uint32_t n, int flush, int level)
+{
+	z_stream zs;
+	uint32_t y;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit(&zs, level) != Z_OK)
+		fail("flush: deflateInit");
+
+	zs.next_out = z;
+	zs.avail_out = cap;
+	for (y = 0; y < h; y++) {
+		zs.next_in = (Bytef *)raw + y * (w + 1);
+		zs.avail_in = w + 1;
+		deflate(&zs, y + 1 == h ? Z_FINISH :
+			(y + 1) % n ? Z_NO_FLUSH : flush);
+	}
+	deflateEnd(&zs);
+
+	return zs.total_out;
+}
+
+static int check_threads(const uint8_t *png, size_t len, unsigned threads,
+			 enum ci_verify level, struct ci_image *img)
+{
+	struct ci_callbacks cb = { .image = get_image };
+	struct ci_ctx *ctx;
+	int err;
+
+	memset(img, 0, sizeof(*img));
+	ctx = ci_new(&cb, img);
+	ci_set_verify(ctx, level);
+	ci_set_threads(ctx, threads);
+	err = ci_open_mem(ctx, png, len);
+	while (err == CI_OK)
+		err = ci_next(ctx, NULL);
+	ci_free(ctx);
+
+	return err == CI_END ? CI_OK : err;
+}
+
+/* streams cut at full flushes are inflated in parallel, others not */
+static void test_flush(void)
+{
+	static const struct {
+		const char *what;
+		int flush, level, split;
+	} t[] = {
+		{ "full flush", Z_FULL_FLUSH, 6, 1 },
+		{ "sync flush", Z_SYNC_FLUSH, 6, 0 },
+		{ "stored 00 00 ff ff", Z_NO_FLUSH, 0, 0 }
+	};
+	enum { W = 1024, H = 256 };
+	static uint8_t raw[H * (W + 1)], z[H * (W + 1) + 4096];
+	static uint8_t png[sizeof(z) + 4096];
+	struct ci_image one, many;
+	uint32_t seed = 1, x, y;
+	uint8_t *row;
+	size_t zlen, len, i;
+	int err;
+
+	/* random rows, the even ones repeat the row above */
+	for (y = 0; y < H; y++) {
+		row = raw + y * (W + 1);
+		row[0] = 0;
+		if (y > 0 && y % 2 == 0) {
+			memcpy(row + 1, row - W, W);
+			continue;
+		}
+
+		for (x = 0; x < W; x++)
+			row[1 + x] = xorshift(&seed) >> 24;
+		memcpy(row + 1 + y % W, "\0\0\xff\xff", 4);
+	}
+
+	for (i = 0; i < sizeof(t) / sizeof(t[0]); i++) {
+		zlen = zflush(z, sizeof(z), raw, W, H, 16, t[i].flush,
+			      t[i].level);
+		len = gray_png(png, W, H, z, zlen, 8192);
+
+		err = check_threads(png, len, 1, CI_VERIFY_INFLATE, &one);
+		if (err != CI_OK || one.pieces != 0)
+			fail("flush: %s, 1 thread (%d)", t[i].what, err);
+
+		err = check_threads(png, len, 4, CI_VERIFY_INFLATE, &many);
+		if (err != CI_OK || (many.pieces > 1) != t[i].split)
+			fail("flush: %s, %u pieces (%d)", t[i].what,
+			     many.pieces, err);
+
+		if (many.decompressed != one.decompressed ||
+		    many.adler32 != one.adler32 ||
+		    many.compressed != one.compressed)
+			fail("flush: %s, threads change the image", t[i].what);
+
+		/* rows unfiltered one by one: inflated as it comes */
+		err = check_threads(png, len, 1, CI_VERIFY_FULL, &one);
+		if (err == CI_OK)
+			err = check_threads(png, len, 4, CI_VERIFY_FULL, &many);
+		if (err != CI_OK || many.pieces != 0 ||
+		    many.pixels_crc != one.pixels_crc ||
+		    many.adler32 != one.adler32)
+			fail("flush: %s, full verify with threads (%d)",
+			     t[i].what, err);
+	}
+
+	/* a bad byte or Adler-32 still found, now by the pieces */
+	zlen = zflush(z, sizeof(z), raw, W, H, 16, Z_FULL_FLUSH, 6);
+	for (i = 0; i < 2; i++) {
+		z[i ? zlen - 1 : zlen / 2] ^= 0x55;
+		len = gray_png(png, W, H, z, zlen, 8192);
+		if (check_threads(png, len, 4, CI_VERIFY_INFLATE,
+				  &many) != CI_ERR_CHUNK)
+			fail("flush: %s not found with threads",
+			     i ? "bad Adler-32" : "bad deflate data");
+		z[i ? zlen - 1 : zlen / 2] ^= 0x55;
+	}
+
+	/* the last piece missing */
+	len = gray_png(png, W, H, z, zlen / 2, 8192);
+	if (check_threads(png, len, 4, CI_VERIFY_INFLATE, &many) != CI_ERR_CHUNK)
+		fail("flush: truncated stream not found with threads");
+}
+
+/* CRC-32 of the pixels of a file, deinterlaced if it is Adam7 */
+static uint32_t raster_crc(const char *path, int *ok)
+{
+	struct ci_callbacks cb = { .image = get_image };
+	struct ci_image img;
+	struct ci_ctx *ctx;
+
+	memset(&img, 0, sizeof(img));
+	ctx = ci_new(&cb, &img);
+	ci_set_verify(ctx, CI_VERIFY_FULL);
+	ci_set_threads(ctx, 3);
+	*ok = ci_check_file(ctx, path) == CI_OK;
+	ci_free(ctx);
+
+	return img.raster_crc;
+}
+
+/* basi0g01.png deinterlaced in parallel must be basn0g01.png */
+static void test_deinterlace(const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[1024];
+	uint32_t a, b;
+	int ok_a, ok_b, pairs;
+
+	d = opendir(dir);
+	if (!d) {
+		fail("deinterlace: cannot open %s", dir);
+		return;
+	}
+
+	pairs = 0;
+	while ((de = readdir(d))) {
+		if (strlen(de->d_name) != 12 || de->d_name[3] != 'i' ||
+		    strcmp(de->d_name + 8, ".png"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		a = raster_crc(path, &ok_a);
+
+		snprintf(path, sizeof(path), "%s/%.3sn%s", dir, de->d_name,
+			 de->d_name + 4);
+		if (access(path, R_OK))
+			continue;
+		b = raster_crc(path, &ok_b);
+
+		if (!ok_a || !ok_b || a != b)
+			fail("deinterlace: %s: %08x != %08x", de->d_name, a, b);
+		pairs++;
+	}
+
+	closedir(d);
+	if (pairs == 0)
+		fail("deinterlace: no interlaced image in %s", dir);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = argc > 1 ? argv[1] : "pngsuite";
+	int e;
+
+	crc32_init();
+
+	printf("crc32 engine: %s (available:", crc32_engine_name(crc32_engine_used()));
+	for (e = 0; e < CRC32_ENGINES; e++)
+		if (crc32_engine_ok(e))
+			printf(" %s", crc32_engine_name(e));
+	printf(")\n");
+
+	printf("filter engine: %s\n", filter_engine_name(filter_engine_used()));
+	printf("utf8 engine: %s\n", utf8_engine_name(utf8_engine_used()));
+
+	test_crc_random();
+	test_crc_pngsuite(dir);
+	test_filter_random();
+	test_utf8();
+	test_push_pull(dir);
+	test_register();
+	test_text();
+	test_stop(dir);
+	test_verify(dir);
+	test_pipe(dir);
+	test_pipe_open();
+	test_huge_chunk();
+	test_large();
+	test_idat();
+	test_order();
+	test_inflate_meta();
+	test_recover();
+	test_table();
+	test_flush();
+	test_unfilter();
+	test_deinterlace(dir);
+
+	if (failed) {
+		printf("%d test(s) failed\n", failed);
+		return 1;
+	}
+
+	printf("All OK.\n");
+	return 0;
+}
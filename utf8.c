@@ -0,0 +1,345 @@
+/*
+ * utf8 - check UTF-8 text, as iTXt holds it
+ *
+ * The scalar engine is the reference, every other engine must find the
+ * same prefix (see test.c). The vector engines classify each byte with
+ * the one before it by three 16 entry table lookups, on the high and
+ * low nibble of the first byte and the high nibble of the second, whose
+ * AND is non-zero for an invalid pair: too short, too long, overlong, a
+ * surrogate or past U+10FFFF. Third and fourth bytes are checked against
+ * the lead two and three bytes back (Keiser and Lemire, "Validating
+ * UTF-8 In Less Than One Instruction Per Byte"). A block of ASCII is
+ * only checked for a sequence cut short before it.
+ *
+ * The vector engines only tell that a block is wrong, the scalar one
+ * then finds where, from the start of the sequence the block is in.
+ */
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "utf8.h"
+
+static int ready;
+static enum utf8_engine engine = UTF8_SCALAR;
+
+static size_t valid_scalar(const uint8_t *s, size_t len, size_t *cut)
+{
+	size_t i, k, n;
+	uint8_t c, lo, hi;
+
+	*cut = 0;
+	for (i = 0; i < len; i += n) {
+		c = s[i];
+		n = 1;
+		if (c < 0x80)
+			continue;
+
+		/* the range of the second byte, the others are 80-bf */
+		lo = 0x80;
+		hi = 0xbf;
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 2;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 3;
+			lo = c == 0xe0 ? 0xa0 : lo;  /* overlong */
+			hi = c == 0xed ? 0x9f : hi;  /* surrogate */
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 4;
+			lo = c == 0xf0 ? 0x90 : lo;  /* overlong */
+			hi = c == 0xf4 ? 0x8f : hi;  /* past U+10FFFF */
+		} else {
+			return i;
+		}
+
+		for (k = 1; k < n; k++) {
+			if (i + k == len) {
+				*cut = k;
+				return i;
+			}
+			if (s[i + k] < lo || s[i + k] > hi)
+				return i;
+			lo = 0x80;
+			hi = 0xbf;
+		}
+	}
+
+	return len;
+}
+
+/* start of the sequence that may go on at i, the rest was checked */
+static size_t sequence_start(const uint8_t *s, size_t i)
+{
+	size_t k = i;
+
+	while (k > 0 && i - k < 3 && (s[k - 1] & 0xc0) == 0x80)
+		k--;
+
+	return k > 0 && s[k - 1] >= 0xc0 ? k - 1 : i;
+}
+
+#ifdef __SSE2__
+/* what is wrong with a pair of bytes, one bit each */
+#define TOO_SHORT	(1 << 0)  /* 11______ 0_______, 11______ 11______ */
+#define TOO_LONG	(1 << 1)  /* 0_______ 10______ */
+#define OVERLONG_3	(1 << 2)  /* 11100000 100_____ */
+#define TOO_LARGE	(1 << 3)  /* 11110100 1001____, 11110101+ 10______ */
+#define SURROGATE	(1 << 4)  /* 11101101 101_____ */
+#define OVERLONG_2	(1 << 5)  /* 1100000_ 10______ */
+#define TOO_LARGE_1000	(1 << 6)  /* 11110101+ 1000____ */
+#define OVERLONG_4	(1 << 6)  /* 11110000 1000____ */
+#define TWO_CONTS	(1 << 7)  /* 10______ 10______ */
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* by the high nibble of the first byte */
+#define BYTE_1_HIGH							\
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,				\
+	TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,				\
+	(char)TWO_CONTS, (char)TWO_CONTS, (char)TWO_CONTS, (char)TWO_CONTS, \
+	TOO_SHORT | OVERLONG_2,						\
+	TOO_SHORT,							\
+	TOO_SHORT | OVERLONG_3 | SURROGATE,				\
+	(char)(TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4)
+
+/* by the low nibble of the first byte */
+#define BYTE_1_LOW							\
+	(char)(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),		\
+	(char)(CARRY | OVERLONG_2),					\
+	(char)CARRY, (char)CARRY,					\
+	(char)(CARRY | TOO_LARGE),					\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),	\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000),			\
+	(char)(CARRY | TOO_LARGE | TOO_LARGE_1000)
+
+/* by the high nibble of the second byte */
+#define BYTE_2_HIGH							\
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,			\
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,			\
+	(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 |		\
+	       TOO_LARGE_1000 | OVERLONG_4),				\
+	(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE), \
+	(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE), \
+	(char)(TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE), \
+	TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* a lead byte in the last 3 that wants more than there is */
+#define LAST_MAX							\
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,		\
+	(char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1)
+
+__attribute__((target("ssse3")))
+static size_t valid_ssse3(const uint8_t *s, size_t len, size_t *cut)
+{
+	const __m128i t1 = _mm_setr_epi8(BYTE_1_HIGH);
+	const __m128i t2 = _mm_setr_epi8(BYTE_1_LOW);
+	const __m128i t3 = _mm_setr_epi8(BYTE_2_HIGH);
+	const __m128i max = _mm_setr_epi8(LAST_MAX);
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i in, prev, prev1, sc, must, err, incomplete;
+	size_t i, b;
+
+	prev = incomplete = zero;
+	for (i = 0; i + 16 <= len; i += 16) {
+		in = _mm_loadu_si128((const __m128i *)(s + i));
+
+		if (_mm_movemask_epi8(in) == 0) {
+			err = incomplete;
+			incomplete = zero;
+		} else {
+			prev1 = _mm_alignr_epi8(in, prev, 15);
+			sc = _mm_shuffle_epi8(t1, _mm_and_si128(
+				_mm_srli_epi16(prev1, 4), nib));
+			sc = _mm_and_si128(sc, _mm_shuffle_epi8(t2,
+				_mm_and_si128(prev1, nib)));
+			sc = _mm_and_si128(sc, _mm_shuffle_epi8(t3,
+				_mm_and_si128(_mm_srli_epi16(in, 4), nib)));
+
+			/* 111_____ two back or 1111____ three back */
+			must = _mm_or_si128(
+				_mm_subs_epu8(_mm_alignr_epi8(in, prev, 14),
+					      _mm_set1_epi8(0xe0 - 0x80)),
+				_mm_subs_epu8(_mm_alignr_epi8(in, prev, 13),
+					      _mm_set1_epi8(0xf0 - 0x80)));
+			must = _mm_and_si128(must, _mm_set1_epi8((char)0x80));
+			err = _mm_xor_si128(must, sc);
+			incomplete = _mm_subs_epu8(in, max);
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, zero)) != 0xffff)
+			break;
+		prev = in;
+	}
+
+	b = sequence_start(s, i);
+	return b + valid_scalar(s + b, len - b, cut);
+}
+
+__attribute__((target("avx2")))
+static size_t valid_avx2(const uint8_t *s, size_t len, size_t *cut)
+{
+	const __m256i t1 = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+	const __m256i t2 = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+	const __m256i t3 = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+	const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+					     -1, -1, -1, -1, -1, -1, -1, -1,
+					     LAST_MAX);
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i in, prev, shifted, prev1, sc, must, err, incomplete;
+	size_t i, b;
+
+	prev = incomplete = zero;
+	for (i = 0; i + 32 <= len; i += 32) {
+		in = _mm256_loadu_si256((const __m256i *)(s + i));
+
+		if (_mm256_movemask_epi8(in) == 0) {
+			err = incomplete;
+			incomplete = zero;
+		} else {
+			/* the high half of prev, then the low half of in */
+			shifted = _mm256_permute2x128_si256(prev, in, 0x21);
+			prev1 = _mm256_alignr_epi8(in, shifted, 15);
+			sc = _mm256_shuffle_epi8(t1, _mm256_and_si256(
+				_mm256_srli_epi16(prev1, 4), nib));
+			sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(t2,
+				_mm256_and_si256(prev1, nib)));
+			sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(t3,
+				_mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+
+			must = _mm256_or_si256(
+				_mm256_subs_epu8(_mm256_alignr_epi8(in, shifted, 14),
+						 _mm256_set1_epi8(0xe0 - 0x80)),
+				_mm256_subs_epu8(_mm256_alignr_epi8(in, shifted, 13),
+						 _mm256_set1_epi8(0xf0 - 0x80)));
+			must = _mm256_and_si256(must, _mm256_set1_epi8((char)0x80));
+			err = _mm256_xor_si256(must, sc);
+			incomplete = _mm256_subs_epu8(in, max);
+		}
+
+		if (!_mm256_testz_si256(err, err))
+			break;
+		prev = in;
+	}
+
+	b = sequence_start(s, i);
+	return b + valid_ssse3(s + b, len - b, cut);
+}
+
+static int have_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int have_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#else
+static size_t valid_ssse3(const uint8_t *s, size_t len, size_t *cut)
+{
+	return valid_scalar(s, len, cut);
+}
+
+static size_t valid_avx2(const uint8_t *s, size_t len, size_t *cut)
+{
+	return valid_scalar(s, len, cut);
+}
+
+static int have_ssse3(void)
+{
+	return 0;
+}
+
+static int have_avx2(void)
+{
+	return 0;
+}
+#endif
+
+int utf8_engine_ok(enum utf8_engine e)
+{
+	switch (e) {
+	case UTF8_SCALAR:
+		return 1;
+	case UTF8_SSSE3:
+		return have_ssse3();
+	case UTF8_AVX2:
+		return have_ssse3() && have_avx2();
+	default:
+		return 0;
+	}
+}
+
+const char *utf8_engine_name(enum utf8_engine e)
+{
+	static const char *name[UTF8_ENGINES] = {
+		[UTF8_SCALAR] = "scalar",
+		[UTF8_SSSE3] = "ssse3",
+		[UTF8_AVX2] = "avx2"
+	};
+
+	return (unsigned)e < UTF8_ENGINES ? name[e] : "unknown";
+}
+
+void utf8_init(void)
+{
+	if (ready)
+		return;
+
+	if (utf8_engine_ok(UTF8_AVX2))
+		engine = UTF8_AVX2;
+	else if (utf8_engine_ok(UTF8_SSSE3))
+		engine = UTF8_SSSE3;
+	else
+		engine = UTF8_SCALAR;
+
+	ready = 1;
+}
+
+enum utf8_engine utf8_engine_used(void)
+{
+	utf8_init();
+	return engine;
+}
+
+static size_t valid_run(enum utf8_engine e, const uint8_t *s, size_t len,
+			size_t *cut)
+{
+	switch (e) {
+	case UTF8_SSSE3:
+		return valid_ssse3(s, len, cut);
+	case UTF8_AVX2:
+		return valid_avx2(s, len, cut);
+	default:
+		return valid_scalar(s, len, cut);
+	}
+}
+
+size_t utf8_valid_with(enum utf8_engine e, const uint8_t *s, size_t len,
+		       size_t *cut)
+{
+	if (!utf8_engine_ok(e))
+		e = UTF8_SCALAR;
+
+	return valid_run(e, s, len, cut);
+}
+
+size_t utf8_valid(const uint8_t *s, size_t len, size_t *cut)
+{
+	if (!ready)
+		utf8_init();
+
+	return valid_run(engine, s, len, cut);
+}
@@ -0,0 +1,36 @@
+/*
+ * utf8 - check UTF-8 text, as iTXt holds it
+ */
+
+#ifndef CHUNKINFO_UTF8_H
+#define CHUNKINFO_UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum utf8_engine {
+	UTF8_SCALAR,  /* a sequence at a time, the reference */
+	UTF8_SSSE3,   /* 16 bytes at a time, table lookups */
+	UTF8_AVX2,    /* the same, 32 bytes */
+	UTF8_ENGINES
+};
+
+/* pick the fastest engine for this cpu, call it once before using threads */
+void utf8_init(void);
+
+/*
+ * length of the longest valid UTF-8 prefix of s, len if s is all valid.
+ * a sequence that is only cut short by the end of s is not valid, its
+ * length so far (1 to 3) is then in *cut, to be joined to what follows.
+ * *cut is 0 otherwise.
+ */
+size_t utf8_valid(const uint8_t *s, size_t len, size_t *cut);
+
+/* force one engine, for testing and benchmarking */
+int utf8_engine_ok(enum utf8_engine e);
+const char *utf8_engine_name(enum utf8_engine e);
+enum utf8_engine utf8_engine_used(void);
+size_t utf8_valid_with(enum utf8_engine e, const uint8_t *s, size_t len,
+		       size_t *cut);
+
+#endif
@@ -0,0 +1,274 @@
+/*
+ * zsync - inflate a zlib stream in pieces cut at its full-flush points
+ *
+ * A deflate full flush ends the current block with an empty stored
+ * block, 00 00 ff ff once byte aligned, and forgets the window: what
+ * follows is a raw deflate stream of its own. Parallel encoders leave
+ * one every so often, so a big stream can be cut there and each piece
+ * inflated by a thread, the Adler-32 of the pieces combined in the end.
+ *
+ * 00 00 ff ff can just as well be compressed bytes, or come from a sync
+ * flush that keeps the window. Such a cut gives a piece that does not
+ * end on a block boundary or refers to data before it: zlib finds both,
+ * and the caller inflates the stream the usual way. The Adler-32 of the
+ * trailer is checked against the whole output whatever the cuts.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "zsync.h"
+
+int zsync_add(struct zsync *z, const void *data, size_t len)
+{
+	const uint8_t *p, *end;
+	size_t cap, *cut;
+	uint8_t *tmp;
+
+	if (len > SIZE_MAX - z->len)
+		return 0;
+
+	if (z->len + len > z->cap) {
+		cap = z->cap ? z->cap : 65536;
+		while (cap < z->len + len)
+			cap = cap > SIZE_MAX / 2 ? SIZE_MAX : cap * 2;
+
+		tmp = realloc(z->data, cap);
+		if (!tmp)
+			return 0;
+		z->data = tmp;
+		z->cap = cap;
+	}
+
+	memcpy(z->data + z->len, data, len);
+
+	/* from the first 00 00 ff ff that was not all there, after the header */
+	p = z->data + (z->len > 5 ? z->len - 3 : 2);
+	z->len += len;
+	if (z->len < 6)
+		return 1;
+
+	end = z->data + z->len - 3;
+	while (p < end && (p = memchr(p, 0, end - p))) {
+		if (p[1] != 0 || p[2] != 0xff || p[3] != 0xff) {
+			p++;
+			continue;
+		}
+
+		if (z->ncut == z->cut_cap) {
+			cap = z->cut_cap ? z->cut_cap * 2 : 64;
+			cut = realloc(z->cut, cap * sizeof(*cut));
+			if (!cut)
+				return 0;
+			z->cut = cut;
+			z->cut_cap = cap;
+		}
+
+		z->cut[z->ncut++] = p + 4 - z->data;
+		p += 4;
+	}
+
+	return 1;
+}
+
+/* room for more output, up to max, 0 if it is already there */
+static int grow(struct zsync_piece *pc)
+{
+	size_t cap;
+	uint8_t *tmp;
+
+	if (pc->out_cap >= pc->max)
+		return 0;
+
+	cap = pc->out_cap > pc->max / 2 ? pc->max : pc->out_cap * 2;
+	tmp = realloc(pc->out, cap);
+	if (!tmp)
+		return 0;
+
+	pc->out = tmp;
+	pc->out_cap = cap;
+	return 1;
+}
+
+/* inflate one piece as a raw deflate stream */
+static void *inflate_piece(void *arg)
+{
+	struct zsync_piece *pc = arg;
+	uint8_t window[ZSYNC_WINDOW], *dst;
+	z_stream z;
+	size_t left, n;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -pc->wbits) != Z_OK)
+		return NULL;
+
+	if (pc->keep) {
+		pc->out_cap = pc->in_len < pc->max / 4 ?
+			pc->in_len * 4 : pc->max;
+		if (pc->out_cap < 4096)
+			pc->out_cap = pc->max < 4096 ? pc->max : 4096;
+		pc->out = malloc(pc->out_cap ? pc->out_cap : 1);
+		if (!pc->out)
+			goto out;
+	}
+
+	z.next_in = (Bytef *)pc->in;
+	left = pc->in_len;
+	pc->adler = adler32(0, NULL, 0);
+
+	do {
+		if (pc->keep) {
+			if (pc->out_len == pc->out_cap && !grow(pc))
+				goto out;
+
+			dst = pc->out + pc->out_len;
+			n = pc->out_cap - pc->out_len < UINT_MAX ?
+				pc->out_cap - pc->out_len : UINT_MAX;
+		} else {
+			/* thrown away, but never more than max of it */
+			if (pc->out_len >= pc->max)
+				goto out;
+
+			dst = window;
+			n = pc->max - pc->out_len < sizeof(window) ?
+				pc->max - pc->out_len : sizeof(window);
+		}
+
+		if (z.avail_in == 0) {
+			z.avail_in = left < UINT_MAX ? left : UINT_MAX;
+			left -= z.avail_in;
+		}
+
+		z.next_out = dst;
+		z.avail_out = n;
+
+		ret = inflate(&z, Z_NO_FLUSH);
+		n -= z.avail_out;
+		pc->adler = adler32_z(pc->adler, dst, n);
+		pc->out_len += n;
+
+		if (ret == Z_STREAM_END)
+			break;
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			goto out;
+	} while (z.avail_in > 0 || left > 0 || z.avail_out == 0);
+
+	if (pc->last)
+		/* the Adler-32 trailer and nothing else */
+		pc->ok = ret == Z_STREAM_END && left == 0 && z.avail_in == 4;
+	else
+		/* all used, right after the empty stored block */
+		pc->ok = ret != Z_STREAM_END && (z.data_type & 0x1ff) == 128;
+
+out:
+	inflateEnd(&z);
+	return NULL;
+}
+
+unsigned zsync_inflate(const struct zsync *z, unsigned threads, uint64_t max,
+		       int keep, struct zsync_piece *piece, uint32_t *adler)
+{
+	struct zsync_piece *pc;
+	size_t start[ZSYNC_MAX], target, c;
+	uint64_t total;
+	unsigned n, want, k;
+	int wbits;
+
+	/* zlib header: deflate, a window, no preset dictionary */
+	if (z->len < 6 || (z->data[0] << 8 | z->data[1]) % 31 != 0 ||
+	    (z->data[0] & 0x0f) != 8 || z->data[0] >> 4 > 7 ||
+	    (z->data[1] & 0x20))
+		return 0;
+	wbits = (z->data[0] >> 4) + 8;
+
+	want = threads < ZSYNC_MAX ? threads : ZSYNC_MAX;
+	if (want > z->len / ZSYNC_MIN)
+		want = z->len / ZSYNC_MIN;
+
+	/* cuts near equal shares of the compressed bytes */
+	start[0] = 2;
+	n = 1;
+	c = 0;
+	for (k = 1; k < want; k++) {
+		target = z->len / want * k;
+		while (c < z->ncut && z->cut[c] < target)
+			c++;
+		if (c == z->ncut || z->cut[c] >= z->len - 4)
+			break;
+		if (z->cut[c] > start[n - 1])
+			start[n++] = z->cut[c];
+	}
+
+	if (n < 2 || max > SIZE_MAX)
+		return 0;
+
+	memset(piece, 0, n * sizeof(*piece));
+	for (k = 0; k < n; k++) {
+		pc = &piece[k];
+		pc->in = z->data + start[k];
+		pc->in_len = (k + 1 < n ? start[k + 1] : z->len) - start[k];
+		pc->wbits = wbits;
+		pc->last = k + 1 == n;
+		pc->keep = keep;
+		pc->max = max;
+	}
+
+	/* the last piece is for this thread */
+	for (k = 0; k < n; k++) {
+		pc = &piece[k];
+		pc->running = k + 1 < n &&
+			pthread_create(&pc->tid, NULL, inflate_piece, pc) == 0;
+		if (!pc->running)
+			inflate_piece(pc);
+	}
+
+	total = 0;
+	*adler = adler32(0, NULL, 0);
+	for (k = 0; k < n; k++) {
+		pc = &piece[k];
+		if (pc->running)
+			pthread_join(pc->tid, NULL);
+		pc->running = 0;
+
+		total += pc->out_len;
+		*adler = adler32_combine(*adler, pc->adler, pc->out_len);
+	}
+
+	for (k = 0; k < n; k++) {
+		if (!piece[k].ok)
+			break;
+	}
+
+	pc = &piece[n - 1];
+	if (k < n || total > max ||
+	    *adler != ((uint32_t)pc->in[pc->in_len - 4] << 24 |
+		       (uint32_t)pc->in[pc->in_len - 3] << 16 |
+		       (uint32_t)pc->in[pc->in_len - 2] << 8 |
+		       pc->in[pc->in_len - 1])) {
+		zsync_release(piece, n);
+		return 0;
+	}
+
+	return n;
+}
+
+void zsync_release(struct zsync_piece *piece, unsigned n)
+{
+	unsigned k;
+
+	for (k = 0; k < n; k++) {
+		free(piece[k].out);
+		piece[k].out = NULL;
+	}
+}
+
+void zsync_free(struct zsync *z)
+{
+	free(z->data);
+	free(z->cut);
+	memset(z, 0, sizeof(*z));
+}
@@ -0,0 +1,54 @@
+/*
+ * zsync - inflate a zlib stream in pieces cut at its full-flush points
+ */
+
+#ifndef CHUNKINFO_ZSYNC_H
+#define CHUNKINFO_ZSYNC_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZSYNC_MAX	64     /* pieces */
+#define ZSYNC_MIN	32768  /* compressed bytes of a piece */
+#define ZSYNC_WINDOW	32768  /* output of a piece that is not kept */
+
+/* a compressed stream kept whole, and where it can be cut */
+struct zsync {
+	uint8_t *data;
+	size_t len, cap;
+	size_t *cut;  /* offsets right after each 00 00 ff ff */
+	size_t ncut, cut_cap;
+};
+
+struct zsync_piece {
+	const uint8_t *in;
+	size_t in_len;
+	int wbits, last;
+	int keep;     /* the output is wanted, else only counted */
+	uint8_t *out;
+	size_t out_len, out_cap, max;
+	uint32_t adler;
+	int ok;
+	pthread_t tid;
+	int running;
+};
+
+/* append a piece of the stream, 0 if out of memory */
+int zsync_add(struct zsync *z, const void *data, size_t len);
+
+/*
+ * inflate the stream in up to threads pieces, one thread each. the
+ * pieces are in piece[], the number of them is returned. 0 if the
+ * stream can't be cut, is not valid as cut, or gives more than max
+ * bytes: it must then be inflated the usual way. with keep the output
+ * of each piece is in its out, else it only goes through a window on
+ * the stack of its thread and is counted.
+ */
+unsigned zsync_inflate(const struct zsync *z, unsigned threads, uint64_t max,
+		       int keep, struct zsync_piece *piece, uint32_t *adler);
+
+void zsync_release(struct zsync_piece *piece, unsigned n);
+void zsync_free(struct zsync *z);
+
+#endif